@@ -19,6 +19,7 @@ var (
 	concurrency = flag.Int("c", 100, "Number of concurrent connections")
 	duration    = flag.Duration("d", 10*time.Second, "Test duration")
 	msgSize     = flag.Int("s", 64, "Payload size in bytes")
+	pipeline    = flag.Int("p", 1, "Pipeline depth: messages sent back-to-back before reading the replies (latency is per batch)")
 	saveResults = flag.Bool("save", false, "Save results to benchmark_results.csv")
 	serverName  = flag.String("name", "Unknown", "Server name for the report (e.g. 'Threaded Server')")
 )
@@ -38,6 +39,9 @@ func main() {
 	fmt.Printf("   Concurrency: %d connections\n", *concurrency)
 	fmt.Printf("   Duration:    %v\n", *duration)
 	fmt.Printf("   Payload:     %d bytes\n", *msgSize)
+	if *pipeline > 1 {
+		fmt.Printf("   Pipeline:    %d messages per batch\n", *pipeline)
+	}
 	fmt.Println("--------------------------------------------------")
 
 	var wg sync.WaitGroup
@@ -75,11 +79,20 @@ func runClient(id int) {
 	for i := range payload {
 		payload[i] = 'a' // 使用小写字母，期望服务器返回大写 B
 	}
-	reqMsg := append([]byte{'^'}, payload...)
-	reqMsg = append(reqMsg, '$')
+	oneMsg := append([]byte{'^'}, payload...)
+	oneMsg = append(oneMsg, '$')
+	// 流水线 (-p N)：一次写 N 条消息，再一起读 N 条回复
+	depth := *pipeline
+	if depth < 1 {
+		depth = 1
+	}
+	reqMsg := make([]byte, 0, len(oneMsg)*depth)
+	for i := 0; i < depth; i++ {
+		reqMsg = append(reqMsg, oneMsg...)
+	}
 
-	// 期望的响应长度 = payload 长度
-	expectedReplyLen := *msgSize
+	// 期望的响应长度 = payload 长度 (流水线时乘以条数)
+	expectedReplyLen := *msgSize * depth
 	replyBuf := make([]byte, expectedReplyLen)
 
 	endTime := time.Now().Add(*duration)
@@ -125,7 +138,7 @@ func runClient(id int) {
 
 		lat := time.Since(reqStart)
 		localLats = append(localLats, lat)
-		atomic.AddInt64(&totalReqs, 1)
+		atomic.AddInt64(&totalReqs, int64(depth))
 	}
 
 	// 汇总延迟数据
@@ -0,0 +1,396 @@
+#define _GNU_SOURCE
+#include "coroutine.h"
+#include "../utils.h"
+#include "../log.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+
+#if !defined(__x86_64__)
+#include <ucontext.h>
+#endif
+
+// 每次 epoll_wait 最多取回的就绪事件数
+#define CO_MAX_EVENTS 1024
+// 一个协程连续这么多次 I/O 都没有挂起 (对方一直在发，数据总是现成的)，就主动让出一次，
+// 不然它会一直占着线程，别的连接饿死 (线程模型里有内核的时间片抢占，协程没有)
+#define CO_IO_BUDGET 64
+
+typedef struct coroutine {
+    struct coroutine* next;      // 就绪队列 / 睡眠链表 / 空闲链表
+#if defined(__x86_64__)
+    void* sp;                    // 挂起时的栈指针 (寄存器都压在它自己的栈上)
+#else
+    ucontext_t ctx;
+#endif
+    char* stack;                 // mmap 的起点，最低一页是保护页
+    void (*fn)(void*);
+    void* arg;
+    uint64_t wake_at_ms;         // co_sleep_ms 的到期时间
+    int io_streak;               // 上次挂起以来连续成功的 I/O 次数
+    int done;
+} coroutine_t;
+
+// 每个 fd 上等着读 / 写的协程 (可以一个协程读、另一个协程写)
+typedef struct {
+    coroutine_t* reader;
+    coroutine_t* writer;
+    int registered;              // 已经 EPOLL_CTL_ADD 过
+} co_fd_t;
+
+struct co_sched {
+    int epfd;
+#if defined(__x86_64__)
+    void* sp;                    // 调度器自己 (线程原来的栈) 的上下文
+#else
+    ucontext_t ctx;
+#endif
+    coroutine_t* current;        // 正在运行的协程，调度器自己在跑时为 NULL
+    coroutine_t* ready_head;
+    coroutine_t* ready_tail;
+    coroutine_t* sleepers;       // co_sleep_ms 挂起的协程，不排序 (只有很少几个)
+    coroutine_t* free_cos;       // 结束了的协程，连同它的栈一起留着复用
+    int free_count;
+    co_fd_t* fds;                // 按 fd 下标
+    int nfds;
+    int count;                   // 还活着的协程数
+};
+
+static __thread co_sched_t* current_sched;
+static size_t page_size;
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// ---------------- 上下文切换 ----------------
+#if defined(__x86_64__)
+// co_ctx_switch(&from_sp, to_sp)：把 System V ABI 规定的被调用者保存寄存器 (rbp rbx r12~r15) 压到当前栈上，
+// 记下栈指针，换到 to_sp 指向的栈，弹出那边的寄存器，ret 回到那边上次调用 co_ctx_switch 的地方。
+// 调用者保存的寄存器编译器在调用前自己存好了，不用管；浮点控制字 (MXCSR / x87) 没人改，也不保存。
+void co_ctx_switch(void** from_sp, void* to_sp);
+__asm__(
+    ".text\n"
+    ".globl co_ctx_switch\n"
+    ".hidden co_ctx_switch\n"
+    ".type co_ctx_switch, @function\n"
+    "co_ctx_switch:\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq %rsi, %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    ret\n"
+    ".size co_ctx_switch, .-co_ctx_switch\n");
+#endif
+
+static void switch_to_co(co_sched_t* s, coroutine_t* co) {
+    s->current = co;
+#if defined(__x86_64__)
+    co_ctx_switch(&s->sp, co->sp);
+#else
+    swapcontext(&s->ctx, &co->ctx);
+#endif
+    s->current = NULL;
+}
+
+// 挂起当前协程，回到调度器 (调用前要先把自己登记到就绪队列 / fd / 睡眠链表上，否则再也不会被唤醒)
+static void switch_to_sched(co_sched_t* s) {
+    coroutine_t* co = s->current;
+    co->io_streak = 0;
+#if defined(__x86_64__)
+    co_ctx_switch(&co->sp, s->sp);
+#else
+    swapcontext(&co->ctx, &s->ctx);
+#endif
+}
+
+// 协程的第一帧：跑完 fn 就标记结束，切回调度器，再也不会被切回来
+static void co_entry(void) {
+    co_sched_t* s = current_sched;
+    coroutine_t* co = s->current;
+    co->fn(co->arg);
+    co->done = 1;
+    switch_to_sched(s);
+}
+
+// 在协程的栈上摆好第一次切换要用的现场：co_ctx_switch 弹出 6 个寄存器之后 ret 到 co_entry
+static void co_prepare(coroutine_t* co) {
+#if defined(__x86_64__)
+    void** sp = (void**)(co->stack + CO_STACK_SIZE);
+    *--sp = NULL;               // co_entry 的“返回地址”，永远用不到；放在这里是为了让入口处 rsp % 16 == 8
+    *--sp = (void*)co_entry;
+    for (int i = 0; i < 6; i++) {
+        *--sp = NULL;
+    }
+    co->sp = sp;
+#else
+    getcontext(&co->ctx);
+    co->ctx.uc_stack.ss_sp = co->stack + page_size;
+    co->ctx.uc_stack.ss_size = CO_STACK_SIZE - page_size;
+    co->ctx.uc_link = NULL;
+    makecontext(&co->ctx, co_entry, 0);
+#endif
+}
+
+// ---------------- 调度器 ----------------
+co_sched_t* co_sched_create(void) {
+    if (current_sched) {
+        die("co_sched_create: this thread already has a scheduler");
+    }
+    if (page_size == 0) {
+        page_size = (size_t)sysconf(_SC_PAGESIZE);
+    }
+    co_sched_t* s = xmalloc(sizeof(co_sched_t));
+    memset(s, 0, sizeof(*s));
+    s->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (s->epfd == -1) {
+        perror_die("epoll_create1");
+    }
+    current_sched = s;
+    return s;
+}
+
+static void ready_push(co_sched_t* s, coroutine_t* co) {
+    co->next = NULL;
+    if (s->ready_tail) {
+        s->ready_tail->next = co;
+    } else {
+        s->ready_head = co;
+    }
+    s->ready_tail = co;
+}
+
+int co_spawn(void (*fn)(void*), void* arg) {
+    co_sched_t* s = current_sched;
+    coroutine_t* co = s->free_cos;
+    if (co) {
+        s->free_cos = co->next;
+        s->free_count--;
+    } else {
+        co = malloc(sizeof(coroutine_t));
+        if (!co) return -1;
+        co->stack = mmap(NULL, CO_STACK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+        if (co->stack == MAP_FAILED) {
+            free(co);
+            return -1;
+        }
+        // 栈往低地址长，最低一页是保护页：溢出时当场 SIGSEGV
+        if (mprotect(co->stack, page_size, PROT_NONE) == -1) {
+            log_warn("mprotect stack guard page: %m");
+        }
+    }
+    co->fn = fn;
+    co->arg = arg;
+    co->done = 0;
+    co->io_streak = 0;
+    co_prepare(co);
+    s->count++;
+    ready_push(s, co);
+    return 0;
+}
+
+// 协程结束：栈留着给下一个协程用，池子满了才还给系统
+static void co_recycle(co_sched_t* s, coroutine_t* co) {
+    s->count--;
+    if (s->free_count >= CO_STACK_POOL_MAX) {
+        munmap(co->stack, CO_STACK_SIZE);
+        free(co);
+        return;
+    }
+    co->next = s->free_cos;
+    s->free_cos = co;
+    s->free_count++;
+}
+
+// 睡够了的协程放回就绪队列，返回离最近一个到期还有多少毫秒 (没有睡着的协程时返回 -1)
+static int wake_sleepers(co_sched_t* s) {
+    if (s->sleepers == NULL) return -1;
+    uint64_t now = now_ms();
+    uint64_t nearest = UINT64_MAX;
+    coroutine_t** link = &s->sleepers;
+    while (*link) {
+        coroutine_t* co = *link;
+        if (co->wake_at_ms <= now) {
+            *link = co->next;
+            ready_push(s, co);
+        } else {
+            if (co->wake_at_ms < nearest) nearest = co->wake_at_ms;
+            link = &co->next;
+        }
+    }
+    return nearest == UINT64_MAX ? -1 : (int)(nearest - now);
+}
+
+void co_sched_run(co_sched_t* s) {
+    struct epoll_event events[CO_MAX_EVENTS];
+    while (s->count > 0) {
+        // 只跑这一轮开始时已经就绪的协程；跑的过程中新就绪的 (co_yield) 排到下一轮，
+        // 中间先看一眼 epoll，让出 CPU 的协程不会把等 I/O 的协程饿死
+        coroutine_t* batch = s->ready_head;
+        s->ready_head = s->ready_tail = NULL;
+        while (batch) {
+            coroutine_t* co = batch;
+            batch = co->next;
+            switch_to_co(s, co);
+            if (co->done) {
+                co_recycle(s, co);
+            }
+        }
+
+        int timeout = wake_sleepers(s);
+        if (s->ready_head) {
+            timeout = 0;
+        } else if (s->count == 0) {
+            break;
+        }
+        int n = epoll_wait(s->epfd, events, CO_MAX_EVENTS, timeout);
+        if (n < 0) {
+            if (errno != EINTR) {
+                log_error("epoll_wait: %m");
+            }
+            continue;
+        }
+        for (int i = 0; i < n; i++) {
+            co_fd_t* f = &s->fds[events[i].data.fd];
+            uint32_t ev = events[i].events;
+            // 出错 / 挂断时读写两边都叫醒，让它们自己从 recv / send 的返回值里发现
+            if (f->reader && (ev & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP))) {
+                ready_push(s, f->reader);
+                f->reader = NULL;
+            }
+            if (f->writer && (ev & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+                ready_push(s, f->writer);
+                f->writer = NULL;
+            }
+        }
+        wake_sleepers(s);
+    }
+}
+
+int co_count(void) {
+    return current_sched ? current_sched->count : 0;
+}
+
+// ---------------- 协程里调用的部分 ----------------
+void co_yield(void) {
+    co_sched_t* s = current_sched;
+    ready_push(s, s->current);
+    switch_to_sched(s);
+}
+
+void co_sleep_ms(unsigned ms) {
+    co_sched_t* s = current_sched;
+    coroutine_t* co = s->current;
+    co->wake_at_ms = now_ms() + ms;
+    co->next = s->sleepers;
+    s->sleepers = co;
+    switch_to_sched(s);
+}
+
+// fd 第一次被等待时注册到 epoll：读写一起、边缘触发，之后不再 EPOLL_CTL_MOD。
+// 边缘触发不会丢事件：协程总是先试着 recv / send，失败 (EAGAIN) 了才来等，
+// 而调度器只在所有协程都挂起之后才 epoll_wait，EAGAIN 之后到的数据一定会产生一次新的通知
+void co_wait_fd(int fd, uint32_t events) {
+    co_sched_t* s = current_sched;
+    if (fd >= s->nfds) {
+        int n = s->nfds ? s->nfds : 1024;
+        while (n <= fd) n *= 2;
+        co_fd_t* fds = realloc(s->fds, sizeof(co_fd_t) * n);
+        if (!fds) {
+            die("realloc coroutine fd table failed");
+        }
+        memset(fds + s->nfds, 0, sizeof(co_fd_t) * (n - s->nfds));
+        s->fds = fds;
+        s->nfds = n;
+    }
+    co_fd_t* f = &s->fds[fd];
+    if (!f->registered) {
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.fd = fd;
+        if (epoll_ctl(s->epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+            log_error("epoll_ctl: add fd %d: %m", fd);
+            return;
+        }
+        f->registered = 1;
+    }
+    if (events & EPOLLIN) f->reader = s->current;
+    if (events & EPOLLOUT) f->writer = s->current;
+    switch_to_sched(s);
+}
+
+// 一次 I/O 没有挂起就成功了：记一笔，连续太多次就让出一下
+static inline void io_done(void) {
+    coroutine_t* co = current_sched->current;
+    if (++co->io_streak >= CO_IO_BUDGET) {
+        co_yield();
+    }
+}
+
+ssize_t co_recv(int fd, void* buf, size_t len, int flags) {
+    while (1) {
+        ssize_t n = recv(fd, buf, len, flags | MSG_DONTWAIT);
+        if (n >= 0) {
+            io_done();
+            return n;
+        }
+        if (errno == EINTR) continue;
+        // 调用者自己带了 MSG_DONTWAIT：只是看看有没有现成的数据，不挂起
+        if ((errno != EAGAIN && errno != EWOULDBLOCK) || (flags & MSG_DONTWAIT)) return -1;
+        co_wait_fd(fd, EPOLLIN);
+    }
+}
+
+ssize_t co_send(int fd, const void* buf, size_t len, int flags) {
+    size_t sent = 0;
+    while (sent < len) {
+        ssize_t n = send(fd, (const char*)buf + sent, len - sent, flags | MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n >= 0) {
+            sent += (size_t)n;
+            continue;
+        }
+        if (errno == EINTR) continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+        co_wait_fd(fd, EPOLLOUT);
+    }
+    io_done();
+    return (ssize_t)sent;
+}
+
+int co_accept4(int fd, struct sockaddr* addr, socklen_t* addrlen, int flags) {
+    while (1) {
+        int newfd = accept4(fd, addr, addrlen, flags);
+        if (newfd >= 0) {
+            io_done();
+            return newfd;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+        co_wait_fd(fd, EPOLLIN);
+    }
+}
+
+// close 会让内核把 fd 从 epoll 里摘掉；这里把等待记录也清掉，编号被复用时从头注册
+int co_close(int fd) {
+    co_sched_t* s = current_sched;
+    if (fd < s->nfds) {
+        memset(&s->fds[fd], 0, sizeof(co_fd_t));
+    }
+    return close(fd);
+}
@@ -0,0 +1,58 @@
+#ifndef COROUTINE_H
+#define COROUTINE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+// 有栈协程 + epoll 调度器
+// 每个协程有自己的栈，可以在任意深度的函数调用里挂起，所以 threaded_server.c 那种“一个连接一段直线代码”
+// 的写法可以原样保留：co_recv / co_send 在 Socket 暂时读不到、写不进时不阻塞线程，
+// 而是把当前协程挂起，切回调度器去跑别的协程，等 epoll 报告这个 fd 就绪了再切回来接着执行。
+//
+// 每个线程一个调度器 (co_sched_t)，协程只在创建它的线程里运行，调度器内部不需要任何锁。
+// 多线程时每个线程各跑一个调度器 (见 coroutine_server.c 的 -t)。
+//
+// 上下文切换：x86-64 上是手写的几条汇编 (只保存 6 个被调用者保存的寄存器和栈指针)，
+// 其他架构退回 ucontext (swapcontext 每次都要 rt_sigprocmask 系统调用，慢一个数量级)。
+// 栈：mmap 出来、最低一页设成 PROT_NONE (栈溢出直接 SIGSEGV，而不是悄悄踩坏别的内存)，
+// 协程结束后放回调度器的栈池，下一个协程直接复用。
+
+// 协程栈大小 (含一页保护页)。只有真正用到的页才占物理内存，一个连接通常只碰到头两三页
+#define CO_STACK_SIZE (64 * 1024)
+// 每个调度器的栈池最多缓存多少个空闲栈，多出来的直接 munmap
+#define CO_STACK_POOL_MAX 1024
+
+typedef struct co_sched co_sched_t;
+
+// 为当前线程创建调度器 (每个线程最多一个)
+co_sched_t* co_sched_create(void);
+// 在当前线程的调度器里创建一个协程，下一轮调度时开始运行 fn(arg)；fn 返回即协程结束
+// 可以在调度器运行之前调用，也可以在协程里调用
+int co_spawn(void (*fn)(void*), void* arg);
+// 运行调度器：轮流执行就绪的协程，都挂起了就 epoll_wait，直到所有协程结束才返回
+void co_sched_run(co_sched_t* sched);
+
+// 以下只能在协程里调用
+// 让出 CPU：排到就绪队列末尾，先让别的协程跑
+void co_yield(void);
+// 挂起 ms 毫秒
+void co_sleep_ms(unsigned ms);
+// 挂起直到 fd 上出现 events (EPOLLIN / EPOLLOUT) 或者出错、被挂断
+void co_wait_fd(int fd, uint32_t events);
+
+// 和同名系统调用一样的语义 (fd 是阻塞还是非阻塞都可以，内部总是带 MSG_DONTWAIT / 非阻塞地尝试)，
+// 只是会阻塞的时候挂起当前协程，而不是整个线程；co_recv 的调用者自己带了 MSG_DONTWAIT 时照常返回 EAGAIN
+ssize_t co_recv(int fd, void* buf, size_t len, int flags);
+// 和阻塞 Socket 上的 send 一样：全部发完才返回 (出错时返回 -1)
+ssize_t co_send(int fd, const void* buf, size_t len, int flags);
+// 监听 Socket 必须是非阻塞的
+int co_accept4(int fd, struct sockaddr* addr, socklen_t* addrlen, int flags);
+// 关闭在协程里用过的 fd：先从调度器里摘掉，再 close (fd 编号马上可能被复用)
+int co_close(int fd);
+
+// 当前线程的调度器里还活着的协程数
+int co_count(void);
+
+#endif
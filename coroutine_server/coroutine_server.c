@@ -0,0 +1,165 @@
+#define _GNU_SOURCE // accept4
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "../utils.h"
+#include "../protocol.h"
+#include "../log.h"
+#include "coroutine.h"
+
+// 连接数到上限时，接收协程隔多久再看一次有没有空位
+#define ACCEPT_RETRY_MS 10
+
+// 和 threads/threaded_server.c 的 serve_connection 一样的直线代码，
+// 只是 send / recv / close 换成了协程版本：读不到数据时挂起的是这个协程，不是整个线程
+void serve_connection(int sockfd) {
+    ProcessingState state = WAIT_FOR_MSG;
+    if (co_send(sockfd, "*", 1, 0) < 1) {
+        log_error("send: %m");
+        goto done;
+    }
+    sendbuf_t out;
+    sendbuf_init(&out, sockfd, co_send);
+    int replied = 0;
+    while(1) {
+        uint8_t buf[1024];
+        int len = co_recv(sockfd, buf, sizeof buf, replied ? MSG_DONTWAIT : 0);
+
+        if (len < 0 && replied && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            len = 0;
+        } else if (len < 0) {
+            log_debug("recv: %m");
+            break;
+        } else if (len == 0) {
+            sendbuf_flush(&out);
+            break;
+        }
+
+        size_t msgs = 0;
+        char* dst = sendbuf_reserve(&out, len);
+        if (dst) {
+            sendbuf_commit(&out, protocol_process(&state, (const char*)buf, len, dst, &msgs));
+        }
+        replied |= msgs > 0;
+        if (dst && replied && len < (int)sizeof buf) {
+            replied = 0;
+            if (sendbuf_flush(&out) < 0) dst = NULL;
+        }
+        if (!dst) {
+            log_error("send error: %m");
+            break;
+        }
+    }
+done:
+    co_close(sockfd);
+    conn_release(1);
+}
+
+static void connection_co(void* arg) {
+    serve_connection((int)(intptr_t)arg);
+}
+
+// 每个调度器一个接收协程：对应 threaded_server.c 的 main 循环，pthread_create 换成 co_spawn
+static void acceptor_co(void* arg) {
+    int listenfd = (int)(intptr_t)arg;
+    while (1) {
+        struct sockaddr_in peer_addr;
+        socklen_t peer_addr_len = sizeof(peer_addr);
+        // 准入控制：满了就先不 accept，新连接留在内核的监听队列里
+        // 不能像线程版那样 conn_acquire_wait 阻塞，那会卡住整个调度器，只能睡一会儿再看
+        if (!conn_acquire(1)) {
+            co_sleep_ms(ACCEPT_RETRY_MS);
+            continue;
+        }
+        int newsockfd = co_accept4(listenfd, (struct sockaddr*)&peer_addr, &peer_addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (newsockfd < 0) {
+            int err = errno;
+            conn_release(1);
+            if (err == EMFILE || err == ENFILE) {
+                accept_shed(listenfd);
+            } else if (err != EINTR && err != ECONNABORTED) {
+                log_error("accept: %s", strerror(err));
+            }
+            continue;
+        }
+        if (log_enabled(LOG_LEVEL_DEBUG)) {
+            report_peer_connected(&peer_addr, peer_addr_len);
+        }
+        if (co_spawn(connection_co, (void*)(intptr_t)newsockfd) != 0) {
+            // 栈分配不出来 (内存或 vm.max_map_count 到了上限)，这个连接只能放弃
+            log_error("co_spawn: out of memory");
+            close(newsockfd);
+            conn_release(1);
+        }
+    }
+}
+
+typedef struct {
+    int portnum;
+    int reuseport;
+} sched_config_t;
+
+// 一个线程一个调度器，各自 accept、各自服务自己接进来的连接，线程之间什么都不共享 (连接数上限除外)
+static void* sched_thread(void* arg) {
+    sched_config_t* config = (sched_config_t*)arg;
+    int listenfd = config->reuseport ? listen_inet_reuseport_socket(config->portnum)
+                                     : listen_inet_socket(config->portnum);
+    make_socket_non_blocking(listenfd);
+
+    co_sched_t* sched = co_sched_create();
+    if (co_spawn(acceptor_co, (void*)(intptr_t)listenfd) != 0) {
+        die("co_spawn acceptor failed");
+    }
+    co_sched_run(sched);
+    return NULL;
+}
+
+int main(int argc, char** argv) {
+    setvbuf(stdout, NULL, _IONBF, 0);
+    int portnum = 9090;
+    int log_level = LOG_LEVEL_INFO;
+    int max_conns = 0;
+    int nthreads = 1;
+    // 用法：coroutine_server [port] [-v] [-C N] [-t N]
+    //   -v 打开 DEBUG 日志 (记录每个连接的对端地址)
+    //   -C 最多同时服务 N 个连接，满了就先不 accept，默认按 ulimit -n 计算
+    //   -t 调度器线程数 (默认 1)；多于 1 个时每个线程各开一个 SO_REUSEPORT 监听 Socket，由内核分配连接
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-v") == 0) {
+            log_level = LOG_LEVEL_DEBUG;
+        } else if (strcmp(argv[i], "-C") == 0 && i + 1 < argc) {
+            max_conns = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            nthreads = atoi(argv[++i]);
+            if (nthreads < 1) nthreads = 1;
+        } else {
+            portnum = atoi(argv[i]);
+        }
+    }
+    printf("Serving on port %d with %d scheduler thread(s)\n", portnum, nthreads);
+    log_init(log_level, STDERR_FILENO);
+    conn_limit_init(max_conns);
+    printf("Max connections: %d\n", conn_limit_max());
+
+    sched_config_t config = { portnum, nthreads > 1 };
+    for (int i = 1; i < nthreads; i++) {
+        pthread_t tid;
+        int rc = pthread_create(&tid, NULL, sched_thread, &config);
+        if (rc != 0) {
+            errno = rc;
+            perror_die("pthread_create");
+        }
+        pthread_detach(tid);
+    }
+    // 主线程自己也跑一个调度器
+    sched_thread(&config);
+    return 0;
+}
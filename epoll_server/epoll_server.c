@@ -1,112 +1,1247 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <unistd.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <sched.h>
+#include <signal.h>
+#include <linux/filter.h>
 #include "../utils.h"
+#include "../outbuf.h"
+#include "../protocol.h"
+#include "../log.h"
+#include "../timer_wheel.h"
+#include "../thread_pool/thread_pool.h"
+#include "fd_table.h"
+#include "slab.h"
 
-// Epoll 最大的事件监听数，也是我们最大的客户端数组大小
+// 每次 epoll_wait 最多取回的就绪事件数 (不再限制连接数，连接数只受 ulimit -n 限制)
 #define MAX_EVENTS 12000
-// 发送缓冲区大小
-#define SENDBUF_SIZE 1024
+// Slab 每次向系统申请多少个 client_state_t (约 270KB)
+#define CLIENTS_PER_CHUNK 256
+// Multi-Reactor 模式下最多允许的 Sub-Reactor (Worker 线程) 数量
+#define MAX_REACTORS 64
+// 每次监听 Socket 就绪时最多 accept 多少个新连接
+#define ACCEPT_BATCH 64
+// 超时时间轮的精度 (毫秒)：超时都是秒级的，100ms 足够，timerfd 每秒只唤醒 10 次
+#define TIMER_TICK_MS 100
+// 输出队列为空时 write_wait_tick 的取值
+#define TICK_NONE UINT64_MAX
+// 平时每次 recv 读 1KB；大消息模式 (-L / -z) 一次读 64KB，回显也就能一次交给内核一大块
+#define RECV_BUF_SMALL 1024
+#define RECV_BUF_LARGE (64 * 1024)
+// 输出合并 (-o)：默认攒到 16KB 就发；连续这么多次推迟了却什么也没攒到，这个连接就先不再推迟
+#define COALESCE_DEFAULT_BYTES (16 * 1024)
+#define COALESCE_MAX_MISSES 4
+// 计算卸载 (-m offload)：线程池的队列长度，每轮事件循环最多攒多少个任务一起提交
+#define OFFLOAD_QUEUE_SIZE 1024
+#define OFFLOAD_BATCH 64
+// 一个卸载任务的输入缓冲区起始大小；一条消息超过 OFFLOAD_JOB_MAX 还没收完，就先把收到的部分交出去
+#define OFFLOAD_JOB_MIN 1024
+#define OFFLOAD_JOB_MAX (64 * 1024)
 
-// 定义协议状态 (状态机)
-typedef enum {
-    INITIAL_ACK,  // 状态 1: 初始连接，尚未发送欢迎字符 '*'
-    WAIT_FOR_MSG, // 状态 2: 等待消息开始符 '^'，在此状态下忽略所有其他输入
-    IN_MSG        // 状态 3: 正在接收消息，对收到的字符 +1 回显，直到收到结束符 '$'
-} ProcessingState;
+struct offload_job;
 
 // 定义每个客户端的上下文状态
 // 为什么需要这个？因为在非阻塞/事件驱动模型中，我们不能在一个函数里处理完整个客户端的交互。
-// 每次 recv 可能只收到一部分数据，所以我们需要保存每个客户端当前的进度 (state) 和待发送的数据 (buf_to_send)。
-typedef struct {
+// 每次 recv 可能只收到一部分数据，所以我们需要保存每个客户端当前的进度 (state) 和待发送的数据 (out)。
+typedef struct client_state {
     int fd;                 // 客户端 socket 文件描述符
     ProcessingState state;  // 当前协议状态
-    char buf_to_send[SENDBUF_SIZE]; // 发送缓冲区 (用于暂时存储还没发出去的数据)
-    int bytes_to_send;      // 发送缓冲区里当前有多少字节是有效的
+    int read_paused;        // 背压：待发送数据超过高水位后暂停读取
+    uint32_t interest;      // 内核里当前登记的监听事件 (缓存下来，没变化就不调用 epoll_ctl)
+    outbuf_t out;           // 输出队列 (缓冲段链表，见 outbuf.c)，不会再因为满了而丢字节
+
+    // 超时 (单位都是时间轮的 tick)：收发数据时只更新这几个时间戳，定时器到期时再算真正的截止时间
+    timer_node_t timer;        // 挂在所属 Reactor 的时间轮上
+    int got_input;             // 是否收到过数据 (之前按握手超时算，之后按空闲超时算)
+    uint64_t accepted_tick;    // 接入时间
+    uint64_t active_tick;      // 最近一次读到或发出数据
+    uint64_t write_wait_tick;  // 输出队列从什么时候开始没有进展，队列为空时为 TICK_NONE
+
+    // 输出合并 (-o)：回显先攒在输出队列里，攒够字节数或到了截止时间再一起发 (见 coalesce_output)
+    struct client_state* defer_prev;  // 挂在所属 Reactor 的推迟发送链表上
+    struct client_state* defer_next;
+    int deferred;              // 是否在推迟发送链表上
+    int deferred_reads;        // 这次推迟期间攒了几次读的回显
+    int coalesce_misses;       // 连续几次到了截止时间都只攒到一次读的回显 (白等)
+    uint64_t flush_at_us;      // 推迟发送的截止时间
+
+    // 计算卸载 (-m offload)：同一个连接同时最多一个任务在线程池里，保证回显的顺序；
+    // 这期间收完的消息攒在 job_pending 里，前一个任务回来后一起交出去
+    struct offload_job* job_pending;
+    struct offload_job* job_inflight;
 } client_state_t;
 
-// 全局数组：用于通过 fd (文件描述符) 快速找到对应的 client_state_t 指针
-// 局限性：这里简单地用 fd 作为数组下标。因为 Linux 的 fd 是从小到大分配的整数，
-// 但如果 fd 超过 1024 (MAX_EVENTS)，这个数组就会越界。
-// 生产环境改进：应该使用哈希表 (HashTable) 或红黑树 (Map) 来存储 fd -> state 的映射。
-client_state_t* clients[MAX_EVENTS]; 
+// 一个 Reactor = 一个 epoll 实例 + 一张客户端状态表 + 一个跑 epoll_wait 的线程
+// 单线程模式下只有一个 Reactor，监听 Socket 和所有客户端都挂在它上面；
+// Multi-Reactor 模式 (One Loop Per Thread) 下：
+//   - 主线程 (Main Reactor) 只负责 accept；
+//   - N 个 Sub-Reactor 各自运行独立的 epoll_wait 循环，处理分给自己的连接。
+// 连接一旦交给某个 Sub-Reactor，它的整个生命周期都只在这个线程里，所以 clients 表不需要加锁。
+// Leader/Follower 模式下则相反：只有一个 Reactor，N 个线程同时阻塞在它的 epoll_wait 上 (shared = 1)。
+typedef struct {
+    int id;
+    int epfd;
+    int listener_sockfd;    // 只有 Main Reactor 监听它，Sub-Reactor 为 -1
+    int shared;             // 是否被多个线程共享 (Leader/Follower 模式)
+    int edge_triggered;     // 是否使用边缘触发 (EPOLLET) 模式
+    int wakeup_fd;          // eventfd：主线程投递新连接后用它唤醒 epoll_wait，不用时为 -1
+
+    // 邮箱 (Mailbox)：主线程把 accept 到的 fd 放进来，Sub-Reactor 被唤醒后一次性取走
+    // 只有这里是跨线程共享的，用一把小锁保护即可 (临界区只是数组追加/交换)
+    pthread_mutex_t mailbox_lock;
+    int* mailbox;
+    int mailbox_len;
+    int mailbox_cap;
+
+    // 当前负责的连接数，主线程据此挑选最空闲的 Sub-Reactor
+    atomic_int nconns;
+
+    // 过载保护：连接数到达上限时把监听 Socket 的事件清空 (不再 accept)，有连接关闭后再恢复
+    // 关闭连接的可能是任何线程 (Sub-Reactor、Leader/Follower)，暂停 / 恢复用一把锁串起来
+    pthread_mutex_t accept_lock;
+    atomic_int accept_paused;
+
+    // 状态表：用于通过 fd (文件描述符) 快速找到对应的 client_state_t 指针
+    // 以前是写死的 clients[12000] 数组，fd >= 12000 的连接会被直接丢掉；
+    // 现在换成按需增长的两级页表 (fd_table.c)，仍然是 fd 直接下标访问，连接数只受 ulimit -n 限制。
+    fd_table_t* clients;
+    // client_state_t 对象池 (slab.c)：按 chunk 预分配，accept 时不再 malloc
+    slab_t client_slab;
+
+    // 连接超时：每个 Reactor 一个时间轮，由注册在自己 epoll 里的 timerfd 驱动
+    // 时间轮空着的时候 timerfd 不上弦，没有连接的 Reactor 不会被定时唤醒
+    // 共享模式下任何线程都可能增删定时器，用 timer_lock 保护 (非共享模式不加锁)
+    int timer_fd;           // 不启用超时时为 -1
+    int timer_armed;
+    pthread_mutex_t timer_lock;
+    timer_wheel_t wheel;
+
+    // 输出合并：推迟发送的连接按截止时间排队。推迟时长都一样，追加到队尾就是有序的，只需要看队头
+    // 只在非共享的 Reactor 上启用：共享模式下连接在线程之间换手，推迟队列得加锁，还要和 ONESHOT 的所有权配合
+    int coalesce;
+    client_state_t* defer_head;
+    client_state_t* defer_tail;
+
+    // 计算卸载：Worker 处理完的任务挂到 offload_done 这个无锁栈上，往空栈上挂的那个 Worker 写 offload_fd 叫醒 Reactor
+    // offload_batch 是这一轮事件循环里等着提交的任务，处理完所有事件后用 thread_pool_add_batch 一次交出去
+    int offload_fd;            // 不是 offload 模式时为 -1
+    _Atomic(struct offload_job*) offload_done;
+    thread_task_t offload_batch[OFFLOAD_BATCH];
+    int offload_batch_len;
 
-// 初始化客户端状态数组，全部置空
-void init_clients() {
-    for (int i = 0; i < MAX_EVENTS; i++) {
-        clients[i] = NULL;
+    pthread_t thread;
+} reactor_t;
+
+// 运行模式
+typedef enum {
+    MODE_SINGLE,  // 单线程 epoll 循环
+    MODE_MULTI,   // Multi-Reactor：1 个 accept 线程 + N 个 Sub-Reactor 线程
+    MODE_PREFORK, // 多进程：N 个 Worker 进程，各自有 SO_REUSEPORT 监听 Socket
+    MODE_LF,      // Leader/Follower：N 个线程共享同一个 epoll 实例
+    MODE_OFFLOAD  // 计算卸载：单线程 epoll 循环负责所有 I/O，完整的消息交给线程池处理
+} server_mode_t;
+
+// 是否启用边缘触发模式 (-e)，所有 Reactor 在初始化时读取
+static int use_edge_triggered = 0;
+
+// 统计信息：每个线程一份 (__thread)，不需要加锁也不会有缓存行争用
+// 用来衡量“每个请求花了多少次系统调用 / epoll_wait 唤醒”
+typedef struct {
+    unsigned long wakeups;     // epoll_wait 返回次数
+    unsigned long events;      // epoll_wait 返回的事件总数
+    unsigned long recv_calls;  // recv 调用次数
+    unsigned long send_calls;  // send 调用次数
+    unsigned long ctl_calls;   // epoll_ctl 调用次数 (不含连接建立/断开)
+    unsigned long msgs;        // 处理完的完整消息数 (收到 '$')
+    unsigned long timeouts;    // 因超时断开的连接数
+    unsigned long accept_pauses;  // 因为连接数到达上限暂停 accept 的次数
+    unsigned long deadline_flushes;  // 输出合并：到了截止时间才发出去的次数
+    unsigned long offloaded;   // 计算卸载：交给线程池的任务数
+    unsigned long offload_inline;  // 计算卸载：线程池队列满了，只好在 Reactor 线程里自己处理的任务数
+} loop_stats_t;
+
+static __thread loop_stats_t loop_stats;
+// 统计打印间隔 (毫秒)，0 表示不打印 (-s 开启)
+static int stats_interval_ms = 0;
+
+// 超时配置 (毫秒，0 表示不限制)，-T 设置
+//   握手超时：连上以后迟迟不发任何数据；
+//   空闲超时：既不发也不收；
+//   写停滞超时：有数据要发，但对方一直不读 (发送缓冲区满、输出队列没有任何进展)
+static unsigned handshake_timeout_ms = 10 * 1000;
+static unsigned idle_timeout_ms = 120 * 1000;
+static unsigned stall_timeout_ms = 30 * 1000;
+
+// 大消息模式：每次 recv 的大小 (-L / -z 时为 RECV_BUF_LARGE)，缓冲区每个线程一份
+static size_t recv_size = RECV_BUF_SMALL;
+static __thread char recv_buf[RECV_BUF_LARGE];
+// 待发送数据不少于这么多字节时用 MSG_ZEROCOPY 发送 (-z)，0 表示不用
+static size_t zerocopy_threshold = 0;
+
+// 输出合并 (-o usec[,bytes])：回显最多推迟 coalesce_us 微秒，或者攒到 coalesce_bytes 字节，0 表示不合并
+static unsigned coalesce_us = 0;
+static size_t coalesce_bytes = COALESCE_DEFAULT_BYTES;
+
+// 模拟的业务处理开销 (-w)：每条消息额外占用多少微秒 CPU，0 表示只做 +1 回显
+// 所有模式都生效：普通模式下在 Reactor 线程里原地忙等，offload 模式下在线程池的 Worker 里忙等
+static unsigned work_us = 0;
+// offload 模式的线程池
+static thread_pool_t* offload_pool = NULL;
+
+static inline int timeouts_enabled() {
+    return handshake_timeout_ms || idle_timeout_ms || stall_timeout_ms;
+}
+
+long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+uint64_t now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Sub-Reactor 列表；单线程模式下 n_sub_reactors == 0，新连接留在 Main Reactor 自己处理
+static reactor_t* sub_reactors[MAX_REACTORS];
+static int n_sub_reactors = 0;
+// 持有监听 Socket 的 Reactor：连接关闭时据此恢复被暂停的 accept
+static reactor_t* accept_reactor = NULL;
+
+// 初始化 Reactor：创建 epoll 实例、客户端状态表和对象池
+// shared = 1 表示这个 Reactor 会被多个线程同时 epoll_wait (Leader/Follower 模式)
+void reactor_init(reactor_t* r, int id, int shared) {
+    memset(r, 0, sizeof(*r));
+    r->id = id;
+    r->shared = shared;
+    r->listener_sockfd = -1;
+    r->wakeup_fd = -1;
+    r->edge_triggered = use_edge_triggered;
+    r->coalesce = coalesce_us > 0 && !shared;
+    r->offload_fd = -1;
+    atomic_init(&r->offload_done, NULL);
+
+    // epoll_create1(0) 是较新的 API，参数 0 表示使用默认标志
+    // 返回一个 epoll 文件描述符 (epfd)
+    r->epfd = epoll_create1(0);
+    if (r->epfd == -1) {
+        perror_die("epoll_create1");
+    }
+
+    pthread_mutex_init(&r->mailbox_lock, NULL);
+    atomic_init(&r->nconns, 0);
+    pthread_mutex_init(&r->accept_lock, NULL);
+    atomic_init(&r->accept_paused, 0);
+
+    r->clients = fd_table_create();
+    // 多个线程共用时，任何线程都可能 accept (分配) 或关闭 (释放)，对象池需要加锁
+    slab_init(&r->client_slab, sizeof(client_state_t), CLIENTS_PER_CHUNK, shared);
+    slab_reserve(&r->client_slab, CLIENTS_PER_CHUNK);
+
+    r->timer_fd = -1;
+    pthread_mutex_init(&r->timer_lock, NULL);
+    timer_wheel_init(&r->wheel, TIMER_TICK_MS, (uint64_t)now_ms());
+    if (timeouts_enabled()) {
+        r->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (r->timer_fd == -1) {
+            perror_die("timerfd_create");
+        }
+        // 边缘触发：共享模式下一次到期只唤醒一个线程
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.fd = r->timer_fd;
+        if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->timer_fd, &ev) == -1) {
+            perror_die("epoll_ctl: timerfd");
+        }
+    }
+}
+
+static inline void timer_lock(reactor_t* r) {
+    if (r->shared) pthread_mutex_lock(&r->timer_lock);
+}
+
+static inline void timer_unlock(reactor_t* r) {
+    if (r->shared) pthread_mutex_unlock(&r->timer_lock);
+}
+
+// 让 timerfd 每个 tick 响一次 (interval == 0 时停掉)
+static void arm_timer_fd(reactor_t* r, unsigned interval_ms) {
+    struct itimerspec its;
+    its.it_interval.tv_sec = interval_ms / 1000;
+    its.it_interval.tv_nsec = (long)(interval_ms % 1000) * 1000000L;
+    its.it_value = its.it_interval;
+    if (timerfd_settime(r->timer_fd, 0, &its, NULL) == -1) {
+        log_error("timerfd_settime: %m");
+        return;
     }
+    r->timer_armed = interval_ms != 0;
+}
+
+// 根据连接当前的时间戳算出最早的截止 tick
+// 共享模式下这里可能和处理该连接的线程并发执行，所以时间戳都用原子读写，也不去碰输出队列本身
+// 换算成 tick 时多加 1：时间戳最多落后一个 tick，宁可晚一点断开，也不能提前
+static uint64_t client_deadline(reactor_t* r, client_state_t* client) {
+    timer_wheel_t* tw = &r->wheel;
+    uint64_t deadline = TICK_NONE;
+    if (!__atomic_load_n(&client->got_input, __ATOMIC_RELAXED)) {
+        if (handshake_timeout_ms) {
+            deadline = client->accepted_tick + timer_wheel_ticks(tw, handshake_timeout_ms) + 1;
+        }
+    } else if (idle_timeout_ms) {
+        deadline = __atomic_load_n(&client->active_tick, __ATOMIC_RELAXED) + timer_wheel_ticks(tw, idle_timeout_ms) + 1;
+    }
+    uint64_t wait = __atomic_load_n(&client->write_wait_tick, __ATOMIC_RELAXED);
+    if (stall_timeout_ms && wait != TICK_NONE) {
+        uint64_t stall = wait + timer_wheel_ticks(tw, stall_timeout_ms) + 1;
+        if (stall < deadline) deadline = stall;
+    }
+    if (deadline == TICK_NONE) {
+        // 当前状态下没有适用的超时 (比如关掉了空闲超时)，过一会儿再来看一眼
+        unsigned longest = handshake_timeout_ms;
+        if (idle_timeout_ms > longest) longest = idle_timeout_ms;
+        if (stall_timeout_ms > longest) longest = stall_timeout_ms;
+        deadline = timer_wheel_now(tw) + timer_wheel_ticks(tw, longest);
+    }
+    return deadline;
+}
+
+// 收到数据：只记一下时间 (懒更新)，不动时间轮
+static inline void client_touch_read(reactor_t* r, client_state_t* client) {
+    if (r->timer_fd == -1) return;
+    __atomic_store_n(&client->active_tick, timer_wheel_now(&r->wheel), __ATOMIC_RELAXED);
+    __atomic_store_n(&client->got_input, 1, __ATOMIC_RELAXED);
+}
+
+// 发送之后：队列空了就不算写停滞；发出去了一些就重新计时；一点没发出去则保持原来的起点
+static inline void client_touch_write(reactor_t* r, client_state_t* client, int progressed) {
+    if (r->timer_fd == -1) return;
+    uint64_t now = timer_wheel_now(&r->wheel);
+    if (progressed) {
+        __atomic_store_n(&client->active_tick, now, __ATOMIC_RELAXED);
+    }
+    if (client->out.len == 0) {
+        __atomic_store_n(&client->write_wait_tick, TICK_NONE, __ATOMIC_RELAXED);
+    } else if (progressed || client->write_wait_tick == TICK_NONE) {
+        __atomic_store_n(&client->write_wait_tick, now, __ATOMIC_RELAXED);
+    }
+}
+
+static void on_client_timer(timer_node_t* node, void* arg);
+
+// 新连接：记下接入时间，挂到时间轮上 (先按握手超时)
+void client_timer_start(reactor_t* r, client_state_t* client) {
+    if (r->timer_fd == -1) return;
+    timer_lock(r);
+    if (!r->timer_armed) {
+        // 时间轮空闲期间没人推进时间，先追到现在 (轮子是空的，直接跳过去)
+        timer_wheel_advance(&r->wheel, (uint64_t)now_ms(), on_client_timer, r);
+    }
+    uint64_t now = timer_wheel_now(&r->wheel);
+    client->got_input = 0;
+    client->accepted_tick = now;
+    client->active_tick = now;
+    client->write_wait_tick = TICK_NONE;
+    timer_add(&r->wheel, &client->timer, client_deadline(r, client));
+    if (!r->timer_armed) {
+        arm_timer_fd(r, TIMER_TICK_MS);
+    }
+    timer_unlock(r);
 }
 
 // 获取或创建客户端状态
 // 如果是新连接，会分配内存；如果是旧连接，直接返回。
-client_state_t* get_client_state(int fd) {
-    // 安全检查：防止 fd 越界导致程序崩溃
-    if (fd >= MAX_EVENTS) return NULL;
-    
-    // 如果这个 fd 还没有对应的状态对象，说明是第一次访问，进行初始化
-    if (clients[fd] == NULL) {
-        clients[fd] = (client_state_t*)malloc(sizeof(client_state_t));
-        clients[fd]->fd = fd;
-        clients[fd]->state = INITIAL_ACK; // 默认初始状态
-        clients[fd]->bytes_to_send = 0;   // 初始没有数据要发
+client_state_t* get_client_state(reactor_t* r, int fd) {
+    client_state_t* client = fd_table_get(r->clients, fd);
+
+    // 如果这个 fd 还没有对应的状态对象，说明是第一次访问，从对象池里取一个并初始化
+    if (client == NULL) {
+        client = (client_state_t*)slab_alloc(&r->client_slab);
+        client->fd = fd;
+        client->state = INITIAL_ACK; // 默认初始状态
+        client->read_paused = 0;
+        client->interest = 0;
+        outbuf_init(&client->out);   // 初始没有数据要发
+        timer_node_init(&client->timer);
+        client->deferred = 0;
+        client->deferred_reads = 0;
+        client->coalesce_misses = 0;
+        client->job_pending = NULL;
+        client->job_inflight = NULL;
+        fd_table_set(r->clients, fd, client);
+    }
+    return client;
+}
+
+// ---------------- 计算卸载 (-m offload) ----------------
+// Reactor 线程仍然做所有的 Socket I/O 和分帧 ('^' ... '$')，只把收完的消息体交给线程池处理；
+// Worker 处理完不碰 Socket，把结果挂回 Reactor 的完成队列。处理再慢也只占着 Worker，
+// 其他连接的读写不会被拖住；Worker 也永远不会阻塞在 Socket 上。
+// 一个任务 = 一个连接上连续的若干条消息体 (不含 '^' / '$')，buf 前一半是输入，后一半是输出
+typedef struct offload_job {
+    struct offload_job* next;  // 完成队列里的下一个
+    reactor_t* reactor;
+    client_state_t* client;    // 只有 Reactor 线程读写；连接在任务回来之前关掉了就置为 NULL
+    char* buf;
+    size_t cap;                // 输入、输出各 cap 字节
+    size_t len;                // 输入字节数
+    size_t out_len;            // 输出字节数 (Worker 写)
+    size_t msgs;               // 输入里收完的消息数 (最后一段可能是还没收完的消息的前半部分)
+} offload_job_t;
+
+static offload_job_t* offload_job_new(reactor_t* r, client_state_t* client) {
+    offload_job_t* job = xmalloc(sizeof(offload_job_t));
+    job->next = NULL;
+    job->reactor = r;
+    job->client = client;
+    job->cap = OFFLOAD_JOB_MIN;
+    job->buf = xmalloc(job->cap * 2);
+    job->len = 0;
+    job->out_len = 0;
+    job->msgs = 0;
+    return job;
+}
+
+static void offload_job_free(offload_job_t* job) {
+    free(job->buf);
+    free(job);
+}
+
+static void offload_job_append(offload_job_t* job, const char* data, size_t n) {
+    if (job->len + n > job->cap) {
+        size_t cap = job->cap;
+        while (cap < job->len + n) cap *= 2;
+        // 输出那一半还没用过，只需要保留输入
+        char* buf = realloc(job->buf, cap * 2);
+        if (!buf) {
+            die("realloc offload job failed");
+        }
+        job->buf = buf;
+        job->cap = cap;
+    }
+    memcpy(job->buf + job->len, data, n);
+    job->len += n;
+}
+
+// 还没交出去的输入有多少 (背压用)
+static inline size_t offload_backlog(const client_state_t* client) {
+    return client->job_pending ? client->job_pending->len : 0;
+}
+
+// 原地忙等 us 微秒，模拟 CPU 密集的业务处理 (-w)
+static void burn_cpu_us(uint64_t us) {
+    uint64_t end = now_us() + us;
+    while (now_us() < end) {
+    }
+}
+
+// 真正的处理：消息体逐字节 +1 (复用 protocol.c 的向量内核：IN_MSG 状态下输入里没有 '$'，整段都是回显)
+// 换成别的业务处理只需要改这里，它只能看 job 的输入、写 job 的输出
+static void offload_handle(offload_job_t* job) {
+    ProcessingState st = IN_MSG;
+    job->out_len = protocol_process(&st, job->buf, job->len, job->buf + job->cap, NULL);
+    if (work_us && job->msgs) {
+        burn_cpu_us(job->msgs * work_us);
+    }
+}
+
+// Worker 线程：处理完挂到完成队列 (多生产者、单消费者的无锁栈)
+// 只有把任务挂到空栈上的那个 Worker 才写 eventfd：栈不空说明 Reactor 已经被叫过、还没来取，
+// 它取的时候会把这个任务一起带走 (Reactor 先读 eventfd 再摘整个栈，见 reactor_drain_offload)
+static void offload_run(void* arg) {
+    offload_job_t* job = (offload_job_t*)arg;
+    reactor_t* r = job->reactor;
+    offload_handle(job);
+
+    offload_job_t* head = atomic_load_explicit(&r->offload_done, memory_order_relaxed);
+    do {
+        job->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&r->offload_done, &head, job, memory_order_release,
+                                                    memory_order_relaxed));
+    if (head == NULL) {
+        uint64_t one = 1;
+        if (write(r->offload_fd, &one, sizeof(one)) != sizeof(one) && errno != EAGAIN) {
+            log_error("write offload eventfd: %m");
+        }
+    }
+}
+
+void reactor_flush_offload(reactor_t* r);
+
+// 连接上没有任务在跑、攒的输入里有收完的消息 (或者一条消息大到 OFFLOAD_JOB_MAX 还没收完) 就交出去
+// 先放进这一轮的批次里，reactor_flush_offload 统一提交
+static void offload_submit(reactor_t* r, client_state_t* client) {
+    offload_job_t* job = client->job_pending;
+    if (client->job_inflight || job == NULL || (job->msgs == 0 && job->len < OFFLOAD_JOB_MAX)) return;
+    if (r->offload_batch_len == OFFLOAD_BATCH) {
+        reactor_flush_offload(r);
     }
-    return clients[fd];
+    client->job_pending = NULL;
+    client->job_inflight = job;
+    r->offload_batch[r->offload_batch_len].function = offload_run;
+    r->offload_batch[r->offload_batch_len].argument = job;
+    r->offload_batch_len++;
+}
+
+// 分帧：把消息体追加到连接的 job_pending，消息外面的字节照协议忽略
+// client->state 沿用协议状态机的 WAIT_FOR_MSG / IN_MSG
+static void offload_input(reactor_t* r, client_state_t* client, const char* in, size_t len) {
+    size_t i = 0;
+    while (i < len) {
+        if (client->state != IN_MSG) {
+            const char* caret = memchr(in + i, '^', len - i);
+            if (caret == NULL) break;
+            i = (size_t)(caret - in) + 1;
+            client->state = IN_MSG;
+            continue;
+        }
+        const char* dollar = memchr(in + i, '$', len - i);
+        size_t n = dollar ? (size_t)(dollar - (in + i)) : len - i;
+        if (client->job_pending == NULL) {
+            client->job_pending = offload_job_new(r, client);
+        }
+        offload_job_append(client->job_pending, in + i, n);
+        i += n;
+        if (dollar) {
+            i++;
+            client->state = WAIT_FOR_MSG;
+            client->job_pending->msgs++;
+            loop_stats.msgs++;
+        }
+    }
+    offload_submit(r, client);
+}
+
+// 连接要关了：还没交出去的直接丢掉；在 Worker 手里的不能释放，只断开它和连接的联系，回来时再释放
+static void offload_detach(client_state_t* client) {
+    if (client->job_pending) {
+        offload_job_free(client->job_pending);
+        client->job_pending = NULL;
+    }
+    if (client->job_inflight) {
+        client->job_inflight->client = NULL;
+        client->job_inflight = NULL;
+    }
+}
+
+// 把连接从推迟发送队列上摘下来 (要发了，或者连接要关了)
+// expired = 1 表示是到了截止时间才发：这期间只攒到一次读的回显，说明推迟是白等，记一次 miss
+static void defer_cancel(reactor_t* r, client_state_t* client, int expired) {
+    if (!client->deferred) return;
+    if (client->defer_prev) {
+        client->defer_prev->defer_next = client->defer_next;
+    } else {
+        r->defer_head = client->defer_next;
+    }
+    if (client->defer_next) {
+        client->defer_next->defer_prev = client->defer_prev;
+    } else {
+        r->defer_tail = client->defer_prev;
+    }
+    client->deferred = 0;
+    if (expired && client->deferred_reads <= 1) {
+        client->coalesce_misses++;
+    } else {
+        client->coalesce_misses = 0;
+    }
+    client->deferred_reads = 0;
+}
+
+// 处理完一次读之后决定：回显现在就发，还是先攒着 (返回 1，挂到推迟发送队列上)
+// more_input：这次 recv 把缓冲区读满了，Socket 里多半还有数据 (对方在流水线式地连续发)
+// 自适应：
+//   - 攒够 coalesce_bytes 就发；
+//   - 没有更多输入、消息也完整了 (一问一答，对方正在等回复)：马上发，不增加任何延迟；
+//   - 推迟总是白等 (连续 COALESCE_MAX_MISSES 次)：这个连接先不推迟，再看到满读才重新尝试
+static int coalesce_output(reactor_t* r, client_state_t* client, int more_input) {
+    if (!r->coalesce || client->out.len == 0 || client->out.len >= coalesce_bytes) return 0;
+    if (!more_input && client->state != IN_MSG) return 0;
+    if (client->coalesce_misses >= COALESCE_MAX_MISSES) {
+        if (more_input) client->coalesce_misses--;
+        return 0;
+    }
+    client->deferred_reads++;
+    if (!client->deferred) {
+        client->flush_at_us = now_us() + coalesce_us;
+        client->deferred = 1;
+        client->defer_next = NULL;
+        client->defer_prev = r->defer_tail;
+        if (r->defer_tail) {
+            r->defer_tail->defer_next = client;
+        } else {
+            r->defer_head = client;
+        }
+        r->defer_tail = client;
+    }
+    return 1;
 }
 
 // 释放客户端状态内存
 // 当连接断开时调用，防止内存泄漏
-void free_client_state(int fd) {
-    if (fd < MAX_EVENTS && clients[fd] != NULL) {
-        free(clients[fd]);
-        clients[fd] = NULL;
+// 对象归还给 slab 的空闲链表，而不是 free 给系统
+void free_client_state(reactor_t* r, int fd) {
+    client_state_t* client = fd_table_get(r->clients, fd);
+    if (client != NULL) {
+        fd_table_set(r->clients, fd, NULL);
+        // 共享模式下时间轮可能正在另一个线程里处理这个连接，摘定时器必须在持锁时完成，
+        // 而且要在 close(fd) 之前：到期回调对 fd 做 shutdown 时，fd 一定还没被关闭、复用
+        if (r->timer_fd != -1) {
+            timer_lock(r);
+            timer_del(&r->wheel, &client->timer);
+            timer_unlock(r);
+        }
+        defer_cancel(r, client, 0);
+        offload_detach(client);
+        if (outbuf_zerocopy_busy(&client->out)) {
+            outbuf_zerocopy_complete(&client->out, fd);
+        }
+        if (outbuf_zerocopy_busy(&client->out)) {
+            // 还有 zerocopy 发出去的数据对方没确认，内核仍引用着这些缓冲段。
+            // 它们马上要回到缓冲段池给别的连接用，不能再让内核拿去重传：
+            // 设 SO_LINGER = 0，close() 时直接发 RST 并当场丢掉发送队列 (反正这个连接已经不要了)
+            struct linger lg = {1, 0};
+            setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+        }
+        outbuf_free(&client->out);
+        slab_free(&r->client_slab, client);
     }
 }
 
-int main(int argc, char** argv) {
-    // 设置标准输出为无缓冲，方便调试信息实时显示
-    setvbuf(stdout, NULL, _IONBF, 0);
-    
-    int portnum = 9090;
-    if (argc >= 2) portnum = atoi(argv[1]);
-    printf("Serving on port %d\n", portnum);
+// 监听 Socket 平时登记的事件 (共享 epoll 和 -e 模式下是边缘触发，见 create_main_reactor)
+static inline uint32_t listener_events(reactor_t* r) {
+    return (r->shared || r->edge_triggered) ? EPOLLIN | EPOLLET : EPOLLIN;
+}
 
-    // 创建监听 Socket (bind + listen)
-    // 详细实现在 utils.c 中
-    int listener_sockfd = listen_inet_socket(portnum);
-    
-    // 关键步骤：必须将监听 Socket 设为非阻塞
-    // 否则 accept() 可能会阻塞整个线程
-    make_socket_non_blocking(listener_sockfd);
+// 连接数到上限了：把监听 Socket 的事件清空 (仍然留在 epoll 里，恢复时只需一次 MOD)
+// 新连接在内核的监听队列里排队 (队列满了内核会丢掉 SYN，客户端自己重传)，
+// 已经接进来的连接不用再和 accept 抢 CPU，延迟保持平稳。
+static void pause_accept(reactor_t* r) {
+    pthread_mutex_lock(&r->accept_lock);
+    if (!atomic_load(&r->accept_paused)) {
+        struct epoll_event ev;
+        ev.events = 0;
+        ev.data.fd = r->listener_sockfd;
+        if (epoll_ctl(r->epfd, EPOLL_CTL_MOD, r->listener_sockfd, &ev) == -1) {
+            log_error("epoll_ctl: pause listener: %m");
+        }
+        atomic_store(&r->accept_paused, 1);
+        loop_stats.accept_pauses++;
+        log_debug("connection limit %d reached, accept paused", conn_limit_max());
+    }
+    pthread_mutex_unlock(&r->accept_lock);
+}
 
-    init_clients();
+// 有名额了：重新监听新连接。MOD 会让内核重新检查一次，监听队列里积压的连接会立刻报上来
+static void resume_accept(reactor_t* r) {
+    pthread_mutex_lock(&r->accept_lock);
+    if (atomic_load(&r->accept_paused) && conn_active() < conn_limit_max()) {
+        struct epoll_event ev;
+        ev.events = listener_events(r);
+        ev.data.fd = r->listener_sockfd;
+        if (epoll_ctl(r->epfd, EPOLL_CTL_MOD, r->listener_sockfd, &ev) == -1) {
+            log_error("epoll_ctl: resume listener: %m");
+        }
+        atomic_store(&r->accept_paused, 0);
+        log_debug("accept resumed");
+    }
+    pthread_mutex_unlock(&r->accept_lock);
+}
 
-    // 1. 创建 epoll 实例
-    // epoll_create1(0) 是较新的 API，参数 0 表示使用默认标志
-    // 返回一个 epoll 文件描述符 (epfd)
-    int epfd = epoll_create1(0);
-    if (epfd == -1) {
-        perror_die("epoll_create1");
+// 一个连接结束 (正常关闭，或者刚 accept 就失败了)：归还名额，必要时恢复 accept
+// 平时 accept 没有暂停，这里只有一次原子读，不碰锁
+static void reactor_conn_closed(reactor_t* r) {
+    atomic_fetch_sub(&r->nconns, 1);
+    conn_release(1);
+    if (accept_reactor && atomic_load(&accept_reactor->accept_paused)) {
+        resume_accept(accept_reactor);
     }
+}
 
-    // 2. 将 listener (监听 Socket) 加入 epoll 监控
-    // 我们关心的事件是 EPOLLIN (有新连接进来，相当于可读)
-    struct epoll_event ev;
-    ev.events = EPOLLIN; 
-    ev.data.fd = listener_sockfd; // 用户数据，这里存 fd，方便后续知道是哪个 Socket 就绪
-    
-    // EPOLL_CTL_ADD: 添加监控事件
-    if (epoll_ctl(epfd, EPOLL_CTL_ADD, listener_sockfd, &ev) == -1) {
-        perror_die("epoll_ctl: listener");
+// 断开一个客户端：从 epoll 中移除、释放状态、关闭 fd
+// 顺序很重要：必须先释放状态再 close。一旦 close，这个 fd 编号可能立刻被别的线程 accept 复用，
+// 如果那时旧状态还挂在 clients[fd] 上，新连接就会拿到一个马上要被 free 的指针。
+void close_client(reactor_t* r, int fd) {
+    epoll_ctl(r->epfd, EPOLL_CTL_DEL, fd, NULL);
+    free_client_state(r, fd);
+    close(fd);
+    reactor_conn_closed(r);
+}
+
+// 共享 epoll 时，客户端 fd 一律加 EPOLLONESHOT：
+// 事件一旦被某个线程取走，内核就把这个 fd 禁用，直到该线程处理完再用 EPOLL_CTL_MOD 重新武装。
+// 这样同一个连接在任意时刻只会被一个线程处理，client_state_t 不需要加锁。
+static inline uint32_t reactor_oneshot(reactor_t* r) {
+    return r->shared ? EPOLLONESHOT : 0;
+}
+
+// 边缘触发模式下，客户端 fd 一次性注册 EPOLLIN | EPOLLOUT | EPOLLET，之后不再修改
+// (EPOLLOUT 在边缘触发下只在“不可写 -> 可写”时通知一次，不会像水平触发那样忙轮询)
+static inline uint32_t reactor_client_events(reactor_t* r) {
+    uint32_t events = EPOLLIN | EPOLLOUT | reactor_oneshot(r);
+    if (r->edge_triggered) events |= EPOLLET;
+    return events;
+}
+
+// 水平触发下“应该”监听的事件：没有背压就读，有待发送数据才写
+// 共享 epoll 的边缘触发也得这样算：每次 EPOLL_CTL_MOD 重新武装 ONESHOT 时内核都会重新检查就绪状态，
+// 一直挂着 EPOLLOUT 的话，空闲连接 (发送缓冲区总是可写) 会被立刻再报一次，所有线程陷入空转
+static inline uint32_t client_wanted_events(reactor_t* r, client_state_t* client) {
+    if (r->edge_triggered && !r->shared) return reactor_client_events(r);
+    uint32_t events = reactor_oneshot(r);
+    if (r->edge_triggered) events |= EPOLLET;
+    if (!client->read_paused) events |= EPOLLIN;
+    // 推迟发送期间不监听 EPOLLOUT，否则水平触发下 Socket 一直可写，马上就会被叫醒
+    if (client->out.len > 0 && !client->deferred) events |= EPOLLOUT;
+    return events;
+}
+
+// 把内核里的监听事件同步成 client_wanted_events()
+// 缓存了上一次登记的 interest，没变化就直接返回 —— 大部分请求 (读完立刻写完) 一次 epoll_ctl 都不用调
+// 例外：共享 epoll 用了 EPOLLONESHOT，每处理完一次事件都必须 MOD 重新武装，没法省
+void update_interest(reactor_t* r, client_state_t* client) {
+    uint32_t wanted = client_wanted_events(r, client);
+    if (wanted == client->interest && !r->shared) {
+        return;
+    }
+    struct epoll_event ev_mod;
+    ev_mod.data.fd = client->fd;
+    ev_mod.events = wanted;
+    loop_stats.ctl_calls++;
+    epoll_ctl(r->epfd, EPOLL_CTL_MOD, client->fd, &ev_mod);
+    client->interest = wanted;
+}
+
+int flush_client(reactor_t* r, client_state_t* client);
+
+// 把一个已经 accept 的连接挂到 Reactor 上 (只能在该 Reactor 自己的线程里调用)
+void reactor_add_client(reactor_t* r, int fd) {
+    // 初始化该客户端的状态结构体
+    client_state_t* client = get_client_state(r, fd);
+
+    // 立即发送 '*' (乐观发送)：新连接的发送缓冲区是空的，直接 send 几乎一定成功，
+    // 不必先注册 EPOLLOUT、等一轮 epoll_wait 再发。
+    // 必须在 EPOLL_CTL_ADD 之前做：共享 epoll 时，ADD 一返回别的线程就可能拿到这个 fd 的事件
+    if (zerocopy_threshold && outbuf_enable_zerocopy(&client->out, fd, zerocopy_threshold) < 0) {
+        log_debug("fd %d: SO_ZEROCOPY not supported: %m", fd);
+    }
+    if (r->coalesce) {
+        // 输出由我们自己合并，发出去的时候就是该发的时候：关掉 Nagle，
+        // 否则截止时间到了发出的那一小段后面，剩下的回显会被 Nagle 扣到对方 ACK (对方延迟确认时要 40ms)
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    outbuf_append(&client->out, "*", 1);
+    client->state = WAIT_FOR_MSG;
+    client_timer_start(r, client);
+    if (flush_client(r, client) < 0) {
+        free_client_state(r, fd);
+        close(fd);
+        reactor_conn_closed(r);
+        return;
+    }
+
+    // 将新客户端 Socket 加入 epoll 监控
+    // 水平触发下 '*' 发完了就只监听 EPOLLIN；没发完才加上 EPOLLOUT
+    struct epoll_event ev_client;
+    ev_client.events = client_wanted_events(r, client);
+    ev_client.data.fd = fd;
+    client->interest = ev_client.events;
+
+    if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, fd, &ev_client) == -1) {
+        log_error("epoll_ctl: add client: %m");
+        free_client_state(r, fd);
+        close(fd);
+        reactor_conn_closed(r);
+    }
+}
+
+// 把新连接投递到 Sub-Reactor 的邮箱里，再写 eventfd 唤醒它
+// 注意：不能在主线程里直接操作 Sub-Reactor 的 clients 表，那会和 Worker 线程产生竞争
+void reactor_post_client(reactor_t* r, int fd) {
+    pthread_mutex_lock(&r->mailbox_lock);
+    if (r->mailbox_len == r->mailbox_cap) {
+        int new_cap = r->mailbox_cap ? r->mailbox_cap * 2 : 64;
+        int* new_box = realloc(r->mailbox, sizeof(int) * new_cap);
+        if (!new_box) {
+            die("realloc mailbox failed");
+        }
+        r->mailbox = new_box;
+        r->mailbox_cap = new_cap;
+    }
+    r->mailbox[r->mailbox_len++] = fd;
+    pthread_mutex_unlock(&r->mailbox_lock);
+
+    // eventfd 是一个内核计数器：write 会把值累加上去并让它变为可读
+    // 多次 write 只会产生一次唤醒，Sub-Reactor 一次取走所有积压的连接
+    uint64_t one = 1;
+    if (write(r->wakeup_fd, &one, sizeof(one)) != sizeof(one) && errno != EAGAIN) {
+        log_error("write eventfd: %m");
+    }
+}
+
+// Sub-Reactor 被 eventfd 唤醒后，取走邮箱里的所有新连接
+void reactor_drain_mailbox(reactor_t* r) {
+    uint64_t counter;
+    // 读 eventfd 会把计数器清零，否则它会一直处于可读状态 (水平触发下会忙轮询)
+    if (read(r->wakeup_fd, &counter, sizeof(counter)) < 0 && errno != EAGAIN) {
+        log_error("read eventfd: %m");
+    }
+
+    // 在锁内只做一次数组交换，真正的 epoll_ctl 放到锁外面做，缩短临界区
+    pthread_mutex_lock(&r->mailbox_lock);
+    int* pending = r->mailbox;
+    int npending = r->mailbox_len;
+    r->mailbox = NULL;
+    r->mailbox_len = 0;
+    r->mailbox_cap = 0;
+    pthread_mutex_unlock(&r->mailbox_lock);
+
+    for (int i = 0; i < npending; i++) {
+        reactor_add_client(r, pending[i]);
+    }
+    free(pending);
+}
+
+// 最少连接数 (Least Connections) 负载均衡：挑当前连接最少的 Sub-Reactor
+reactor_t* pick_sub_reactor() {
+    reactor_t* best = sub_reactors[0];
+    int best_load = atomic_load(&best->nconns);
+    for (int i = 1; i < n_sub_reactors; i++) {
+        int load = atomic_load(&sub_reactors[i]->nconns);
+        if (load < best_load) {
+            best = sub_reactors[i];
+            best_load = load;
+        }
+    }
+    return best;
+}
+
+// 情况 A: 监听 Socket 就绪 -> 说明有新客户端连接
+// 每次就绪事件一口气 accept 一批 (accept4 直接拿到非阻塞 fd)，但最多 ACCEPT_BATCH 个，
+// 防止连接风暴时一直在 accept、已有连接的读写被饿死。
+// 没取完的部分：水平触发下 epoll_wait 下一轮会再报；边缘触发 (共享 epoll 或 -e 模式) 下不会再有通知，
+// 所以用 EPOLL_CTL_MOD 重新武装一次，队列里还有连接时内核会立刻再把它放回就绪链表。
+// 准入控制：accept 之前先按连接上限预占名额，一个名额都没有就暂停 accept
+void handle_accept(reactor_t* r) {
+    int fds[ACCEPT_BATCH];
+    int drained;
+    int want = conn_acquire(ACCEPT_BATCH);
+    if (want == 0) {
+        pause_accept(r);
+        // 暂停的同时可能正好有连接关闭 (它看到的还是“没暂停”，不会来恢复)，自己再检查一次
+        resume_accept(r);
+        return;
+    }
+    int n = accept_batch(r->listener_sockfd, fds, want, &drained);
+    conn_release(want - n);
+
+    for (int i = 0; i < n; i++) {
+        if (n_sub_reactors == 0) {
+            // 单线程 / Leader-Follower 模式：自己处理
+            atomic_fetch_add(&r->nconns, 1);
+            reactor_add_client(r, fds[i]);
+        } else {
+            // Multi-Reactor 模式：交给最空闲的 Sub-Reactor
+            // 先在这里计数，防止同一批 accept 全都挤到同一个 Worker 上
+            reactor_t* sub = pick_sub_reactor();
+            atomic_fetch_add(&sub->nconns, 1);
+            reactor_post_client(sub, fds[i]);
+        }
+    }
+
+    if (!drained && n == want && want < ACCEPT_BATCH) {
+        // 名额用完了，监听队列里可能还有连接：先暂停，等有连接关闭再接
+        pause_accept(r);
+        resume_accept(r);
+    } else if (!drained && n == ACCEPT_BATCH && (r->shared || r->edge_triggered)) {
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.fd = r->listener_sockfd;
+        loop_stats.ctl_calls++;
+        if (epoll_ctl(r->epfd, EPOLL_CTL_MOD, r->listener_sockfd, &ev) == -1) {
+            log_error("epoll_ctl: rearm listener: %m");
+        }
+    }
+}
+
+// 把收到的数据喂给状态机，回显内容直接写进输出队列的尾段
+// 尾段剩多少空间就喂多少输入 (输出不会比输入多)，写满了再挂新段
+// offload 模式下这里只分帧，回显等线程池处理完再进输出队列
+void process_input(reactor_t* r, client_state_t* client, const char* buffer, int len) {
+    if (r->offload_fd != -1) {
+        offload_input(r, client, buffer, (size_t)len);
+        return;
+    }
+    size_t off = 0;
+    while (off < (size_t)len) {
+        size_t avail, msgs = 0;
+        char* out = outbuf_reserve(&client->out, &avail);
+        size_t chunk = (size_t)len - off < avail ? (size_t)len - off : avail;
+        outbuf_commit(&client->out, protocol_process(&client->state, buffer + off, chunk, out, &msgs));
+        loop_stats.msgs += msgs;
+        if (work_us && msgs) {
+            burn_cpu_us(msgs * work_us);
+        }
+        off += chunk;
+    }
+}
+
+// 把输出队列一直发到空，或者发到内核缓冲区满 (EAGAIN) 为止，每次都是一次 writev 带走多段
+// 返回 0 表示正常，-1 表示连接出错需要关闭
+int flush_client(reactor_t* r, client_state_t* client) {
+    int progressed = 0;
+    while (client->out.len > 0) {
+        loop_stats.send_calls++;
+        ssize_t sent = outbuf_writev(&client->out, client->fd);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return -1;
+        }
+        progressed = 1;
+    }
+    client_touch_write(r, client, progressed);
+    return 0;
+}
+
+// 根据输出队列长度更新背压状态
+// offload 模式下还要看攒着没交出去的输入：前一个任务还没回来，又攒够了 OFFLOAD_JOB_MAX 就先不读了
+static inline void update_backpressure(client_state_t* client) {
+    if (client->out.len >= OUTBUF_HIGH_WATER || offload_backlog(client) >= OFFLOAD_JOB_MAX) {
+        client->read_paused = 1;
+    } else if (client->read_paused && client->out.len <= OUTBUF_LOW_WATER) {
+        client->read_paused = 0;
+    }
+}
+
+// zerocopy 的完成通知放在 socket 的错误队列里，内核用 EPOLLERR 报告 (不管监听了什么事件都会报)
+// 读完通知、回收缓冲段之后把 EPOLLERR 去掉；没读到通知说明是真的出错了，留给后面走关闭流程
+static inline void reap_zerocopy(client_state_t* client, uint32_t* events) {
+    if ((*events & EPOLLERR) && outbuf_zerocopy_busy(&client->out) &&
+        outbuf_zerocopy_complete(&client->out, client->fd) > 0) {
+        *events &= ~EPOLLERR;
+    }
+}
+
+// 情况 B (边缘触发版)：内核只在状态“变化”时通知一次，所以每次都必须把能做的事一次做完
+//   - 读：一直 recv 到 EAGAIN，否则剩下的数据不会再有通知，连接就“卡住”了；
+//   - 写：一直 writev 到输出队列空或 EAGAIN，EAGAIN 之后内核会在可写时再通知一次 EPOLLOUT；
+//   - 不需要 EPOLL_CTL_MOD：EPOLLIN | EPOLLOUT 在注册时就一直开着 (共享模式下 ONESHOT 仍需重新武装)。
+void handle_client_event_et(reactor_t* r, client_state_t* client, uint32_t events) {
+    int fd = client->fd;
+    reap_zerocopy(client, &events);
+    int want_read = (events & (EPOLLIN | EPOLLERR | EPOLLHUP)) != 0;
+    int got_input = 0;
+
+    while (1) {
+        while (want_read && !client->read_paused) {
+            loop_stats.recv_calls++;
+            int valread = recv(fd, recv_buf, recv_size, 0);
+
+            if (valread < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    want_read = 0; // 读干净了
+                    break;
+                }
+                close_client(r, fd);
+                return;
+            }
+            if (valread == 0) {
+                // 对方关闭连接
+                close_client(r, fd);
+                return;
+            }
+
+            client_touch_read(r, client);
+            process_input(r, client, recv_buf, valread);
+            got_input = 1;
+
+            // 边读边发：每处理完一段就把回显发出去，腾出输出队列再继续读
+            // 开了输出合并就先攒着，读到 EAGAIN 或者攒够 coalesce_bytes 再发
+            if (!r->coalesce || client->out.len >= coalesce_bytes) {
+                defer_cancel(r, client, 0);
+                if (flush_client(r, client) < 0) {
+                    close_client(r, fd);
+                    return;
+                }
+            }
+            update_backpressure(client);
+        }
+
+        // 可写通知 (包括新连接上的第一次 EPOLLOUT，用来发送 '*')
+        // 输入已经读干净了，只有消息还没收完时才会继续推迟 (见 coalesce_output)
+        if (!(got_input && coalesce_output(r, client, 0))) {
+            defer_cancel(r, client, 0);
+            if (flush_client(r, client) < 0) {
+                close_client(r, fd);
+                return;
+            }
+        }
+
+        // 背压解除：暂停期间到达的数据在边缘触发下不会再有新的 EPOLLIN 通知，必须主动再读一轮
+        int was_paused = client->read_paused;
+        update_backpressure(client);
+        if (was_paused && !client->read_paused) {
+            want_read = 1;
+            continue;
+        }
+        break;
+    }
+
+    // 边缘触发下监听事件从不变化，只有共享模式需要重新武装 ONESHOT
+    update_interest(r, client);
+}
+
+// 情况 B: 普通客户端 Socket 就绪 -> 有数据读或写
+void handle_client_event(reactor_t* r, int fd, uint32_t events) {
+    client_state_t* client = get_client_state(r, fd);
+
+    if (r->edge_triggered) {
+        handle_client_event_et(r, client, events);
+        return;
+    }
+    reap_zerocopy(client, &events);
+    int got_input = 0, more_input = 0;
+
+    // B.1: 处理可读事件 (EPOLLIN) -> 客户端发来了数据
+    if (events & EPOLLIN) {
+        loop_stats.recv_calls++;
+        int valread = recv(fd, recv_buf, recv_size, 0);
+
+        if (valread <= 0) {
+            // recv 返回 0 表示对方关闭连接，返回 -1 表示出错
+            close_client(r, fd);
+            return; // 这个客户端处理完了，跳过后面逻辑
+        }
+
+        // 收到数据，喂给状态机处理
+        client_touch_read(r, client);
+        process_input(r, client, recv_buf, valread);
+        got_input = 1;
+        more_input = (size_t)valread == recv_size;
+    } else if (events & (EPOLLERR | EPOLLHUP)) {
+        // 暂停读取期间连接出错或被超时 shutdown：没有 EPOLLIN 可报，直接关掉
+        close_client(r, fd);
+        return;
+    }
+
+    // 特殊逻辑：如果是刚连接 (INITIAL_ACK)，需要先发送 '*'
+    // 已经在 accept 时处理了，这里移除。
+    if (client->state == INITIAL_ACK) {
+        // 这个状态理论上不再进入了，除非发送失败重置
+        outbuf_append(&client->out, "*", 1);
+        client->state = WAIT_FOR_MSG;
+    }
+
+    // B.2: 发送 (乐观发送)
+    // 不必等 EPOLLOUT：刚产生的回显直接试着发。Socket 的发送缓冲区通常是空的，一次 writev 就能发完，
+    // 省掉了“注册 EPOLLOUT -> epoll_wait 返回 -> 再 send -> 再取消 EPOLLOUT”这一整轮往返。
+    // 只有短写或 EAGAIN (内核缓冲区满了) 时，剩下的数据才留到 EPOLLOUT 时再发。
+    // 输出合并 (-o)：对方在流水线式地连续发时，回显先攒着，等下一轮读完一起发 (见 coalesce_output)
+    if (client->out.len > 0 && !(got_input && coalesce_output(r, client, more_input))) {
+        defer_cancel(r, client, 0);
+        // 一次 writev 把输出队列里的多个段一起发出去，发完的段直接回收，不再 memmove
+        loop_stats.send_calls++;
+        ssize_t sent = outbuf_writev(&client->out, fd);
+        if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            log_error("send error: %m");
+            close_client(r, fd);
+            return;
+        }
+        client_touch_write(r, client, sent > 0);
+    }
+
+    // 背压：输出队列堆到高水位就先不读了 (去掉 EPOLLIN)，等发到低水位以下再恢复
+    update_backpressure(client);
+
+    // 关键优化：动态调整 Epoll 监听事件
+    // 为什么要这样做？
+    // 如果缓冲区是空的，我们不应该监听 EPOLLOUT，否则 epoll_wait 会一直立即返回 (忙轮询)，因为 Socket 通常一直是可写的。
+    // 只有当输出队列里有数据时，我们才告诉内核：“我想写，请在可写时通知我”。
+    // 共享模式下这一步同时是“交还所有权”：MOD 之后其他线程才能再拿到这个 fd 的事件
+    update_interest(r, client);
+}
+
+// 时间轮里的定时器到期：先按连接最新的时间戳重新算截止时间 (懒更新)，
+// 活跃的连接只是换个位置重新挂上；真正超时的才断开
+static void on_client_timer(timer_node_t* node, void* arg) {
+    reactor_t* r = (reactor_t*)arg;
+    client_state_t* client = (client_state_t*)((char*)node - offsetof(client_state_t, timer));
+    uint64_t deadline = client_deadline(r, client);
+    if (deadline > timer_wheel_now(&r->wheel)) {
+        timer_add(&r->wheel, node, deadline);
+        return;
     }
 
+    loop_stats.timeouts++;
+    log_debug("client fd %d timed out (%s)", client->fd,
+              __atomic_load_n(&client->write_wait_tick, __ATOMIC_RELAXED) != TICK_NONE ? "write stall"
+              : __atomic_load_n(&client->got_input, __ATOMIC_RELAXED) ? "idle" : "handshake");
+    if (r->shared) {
+        // 共享模式下这个连接可能正被别的线程处理，不能在这里释放它的状态
+        // shutdown 之后 fd 上会报 EPOLLIN/EPOLLHUP，由拿到事件的线程走正常的关闭流程
+        shutdown(client->fd, SHUT_RDWR);
+    } else {
+        close_client(r, client->fd);
+    }
+}
+
+// timerfd 可读：把时间轮推进到现在，处理到期的定时器
+void reactor_handle_timer(reactor_t* r) {
+    uint64_t expirations;
+    if (read(r->timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+        log_error("read timerfd: %m");
+    }
+    timer_lock(r);
+    timer_wheel_advance(&r->wheel, (uint64_t)now_ms(), on_client_timer, r);
+    if (r->wheel.count == 0 && r->timer_armed) {
+        arm_timer_fd(r, 0);
+    }
+    timer_unlock(r);
+}
+
+// 输出合并：把已经到了截止时间的推迟发送都发出去 (每轮事件处理完之后调用)
+void reactor_flush_deferred(reactor_t* r) {
+    if (r->defer_head == NULL) return;
+    uint64_t now = now_us();
+    while (r->defer_head && r->defer_head->flush_at_us <= now) {
+        client_state_t* client = r->defer_head;
+        defer_cancel(r, client, 1);
+        loop_stats.deadline_flushes++;
+        if (flush_client(r, client) < 0) {
+            close_client(r, client->fd);
+            continue;
+        }
+        update_backpressure(client);
+        update_interest(r, client);
+    }
+}
+
+// 计算卸载：一个任务处理完了 (在 Worker 里，或者队列满了在 Reactor 线程里自己处理的)
+// 回显追加到输出队列，攒着的下一批交出去，然后像处理完一次读一样：发送、更新背压和监听事件
+static void offload_complete(reactor_t* r, offload_job_t* job) {
+    client_state_t* client = job->client;
+    if (client == NULL) {
+        // 连接在任务回来之前就关了
+        offload_job_free(job);
+        return;
+    }
+    outbuf_append(&client->out, job->buf + job->cap, job->out_len);
+    client->job_inflight = NULL;
+    offload_job_free(job);
+    offload_submit(r, client);
+
+    int was_paused = client->read_paused;
+    if (flush_client(r, client) < 0) {
+        close_client(r, client->fd);
+        return;
+    }
+    update_backpressure(client);
+    if (r->edge_triggered && was_paused && !client->read_paused) {
+        // 边缘触发：暂停期间到达的数据不会再有 EPOLLIN 通知，主动读一轮
+        handle_client_event_et(r, client, EPOLLIN);
+        return;
+    }
+    update_interest(r, client);
+}
+
+// offload_fd 可读：取走 Worker 挂回来的所有任务
+// 必须先读 eventfd 再摘栈：之后挂上来的任务看到的是空栈，会再写一次 eventfd，不会漏掉
+void reactor_drain_offload(reactor_t* r) {
+    uint64_t counter;
+    if (read(r->offload_fd, &counter, sizeof(counter)) < 0 && errno != EAGAIN) {
+        log_error("read offload eventfd: %m");
+    }
+    offload_job_t* job = atomic_exchange_explicit(&r->offload_done, NULL, memory_order_acquire);
+    // 栈是后进先出的，反过来按完成的先后处理
+    offload_job_t* fifo = NULL;
+    while (job) {
+        offload_job_t* next = job->next;
+        job->next = fifo;
+        fifo = job;
+        job = next;
+    }
+    while (fifo) {
+        offload_job_t* next = fifo->next;
+        offload_complete(r, fifo);
+        fifo = next;
+    }
+}
+
+// 把这一轮攒下的任务一次交给线程池 (每轮事件处理完之后调用，攒满 OFFLOAD_BATCH 个时也会提前调用)
+// 一次 CAS 抢下一串槽位、只唤醒一次，比每条消息一次 thread_pool_add 省
+// 队列满了交不出去的就在这里自己处理：相当于暂时退回单线程模式，Reactor 慢下来，对客户端也是一种背压
+void reactor_flush_offload(reactor_t* r) {
+    while (r->offload_batch_len > 0) {
+        // 先拷出来：下面自己处理的任务完成时可能又往批次里加新任务
+        thread_task_t tasks[OFFLOAD_BATCH];
+        int n = r->offload_batch_len;
+        memcpy(tasks, r->offload_batch, sizeof(thread_task_t) * n);
+        r->offload_batch_len = 0;
+
+        int queued = thread_pool_add_batch(offload_pool, tasks, n);
+        if (queued < 0) queued = 0;
+        loop_stats.offloaded += queued;
+        for (int i = queued; i < n; i++) {
+            offload_job_t* job = (offload_job_t*)tasks[i].argument;
+            loop_stats.offload_inline++;
+            offload_handle(job);
+            offload_complete(r, job);
+        }
+    }
+}
+
+// epoll_wait 的超时只能精确到毫秒，输出合并的截止时间通常不到 1 毫秒：
+// 需要微秒时用 epoll_pwait2 (Linux 5.11+)，内核不支持就退回 epoll_wait 并向上取整到毫秒
+static int epoll_wait_us(int epfd, struct epoll_event* events, int maxevents, long timeout_us) {
+    static int have_pwait2 = 1;
+    if (timeout_us > 0 && timeout_us % 1000 != 0 && have_pwait2) {
+        struct timespec ts = {timeout_us / 1000000, (timeout_us % 1000000) * 1000};
+        int n = epoll_pwait2(epfd, events, maxevents, &ts, NULL);
+        if (n >= 0 || errno != ENOSYS) return n;
+        have_pwait2 = 0;
+    }
+    return epoll_wait(epfd, events, maxevents, timeout_us < 0 ? -1 : (int)((timeout_us + 999) / 1000));
+}
+
+// 记录并清零当前线程的统计数据
+void report_loop_stats(reactor_t* r) {
+    loop_stats_t* st = &loop_stats;
+    double msgs = st->msgs ? (double)st->msgs : 1.0;
+    log_info("[reactor %d] msgs=%lu wakeups=%lu events=%lu timeouts=%lu accept_pauses=%lu deadline_flushes=%lu offloaded=%lu inline=%lu conns=%d/%d | per msg: epoll_wait=%.2f recv=%.2f send=%.2f epoll_ctl=%.2f",
+           r->id, st->msgs, st->wakeups, st->events, st->timeouts, st->accept_pauses, st->deadline_flushes,
+           st->offloaded, st->offload_inline, conn_active(), conn_limit_max(),
+           st->wakeups / msgs, st->recv_calls / msgs, st->send_calls / msgs, st->ctl_calls / msgs);
+    memset(st, 0, sizeof(*st));
+}
+
+// 事件循环：单线程模式下的唯一循环，也是每个 Sub-Reactor 线程的主体
+void* reactor_run(void* arg) {
+    reactor_t* r = (reactor_t*)arg;
+
     // 准备一个数组，用来接收 epoll_wait 返回的就绪事件
     // 只有“发生了事件”的 Socket 会被内核填入这个数组
-    struct epoll_event events[MAX_EVENTS];
+    // 数组较大 (~140KB)，放在堆上，避免撑爆线程栈
+    struct epoll_event* events = xmalloc(sizeof(struct epoll_event) * MAX_EVENTS);
+    long next_report = stats_interval_ms > 0 ? now_ms() + stats_interval_ms : 0;
 
     while (1) {
         // 3. 等待事件发生 (核心阻塞点)
@@ -116,12 +1251,33 @@ int main(int argc, char** argv) {
         // MAX_EVENTS: 数组大小
         // -1: 超时时间，-1 表示无限等待，直到有事件发生
         // 返回值 n: 实际上有多少个 Socket 就绪了
-        int n = epoll_wait(epfd, events, MAX_EVENTS, -1);
-        
+        // 开启统计时，最多睡到下一次打印的时间点；有推迟发送的连接时，最多睡到最早的截止时间
+        long timeout_us = -1;
+        if (stats_interval_ms > 0) {
+            long now = now_ms();
+            if (now >= next_report) {
+                report_loop_stats(r);
+                next_report = now + stats_interval_ms;
+            }
+            timeout_us = (next_report - now) * 1000;
+        }
+        if (r->defer_head) {
+            uint64_t now = now_us();
+            long left = r->defer_head->flush_at_us > now ? (long)(r->defer_head->flush_at_us - now) : 0;
+            if (timeout_us < 0 || left < timeout_us) timeout_us = left;
+        }
+        int n = epoll_wait_us(r->epfd, events, MAX_EVENTS, timeout_us);
+
         if (n == -1) {
-            perror("epoll_wait");
+            if (errno != EINTR) {
+                log_error("epoll_wait: %m");
+            }
             continue;
         }
+        if (n > 0) {
+            loop_stats.wakeups++;
+            loop_stats.events += n;
+        }
 
         // 4. 处理就绪事件
         // Epoll 的优势：这里只需要遍历前 n 个元素 (O(k))
@@ -129,136 +1285,421 @@ int main(int argc, char** argv) {
         for (int i = 0; i < n; i++) {
             int fd = events[i].data.fd;
 
-            // 情况 A: 监听 Socket 就绪 -> 说明有新客户端连接
-            if (fd == listener_sockfd) {
-                struct sockaddr_in peer_addr;
-                socklen_t peer_addr_len = sizeof(peer_addr);
-                int new_socket = accept(listener_sockfd, (struct sockaddr*)&peer_addr, &peer_addr_len);
-                
-                if (new_socket < 0) {
-                    perror("accept");
+            if (fd == r->listener_sockfd) {
+                handle_accept(r);
+            } else if (fd == r->wakeup_fd) {
+                reactor_drain_mailbox(r);
+            } else if (fd == r->timer_fd) {
+                reactor_handle_timer(r);
+            } else if (fd == r->offload_fd) {
+                reactor_drain_offload(r);
+            } else {
+                handle_client_event(r, fd, events[i].events);
+            }
+        }
+        reactor_flush_deferred(r);
+        reactor_flush_offload(r);
+    }
+    free(events);
+    return NULL;
+}
+
+// 启动一个 Sub-Reactor：创建 eventfd，注册到它自己的 epoll 里，然后开线程跑事件循环
+void start_sub_reactor(reactor_t* r) {
+    // EFD_NONBLOCK：读空的 eventfd 返回 EAGAIN 而不是阻塞
+    r->wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (r->wakeup_fd == -1) {
+        perror_die("eventfd");
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = r->wakeup_fd;
+    if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->wakeup_fd, &ev) == -1) {
+        perror_die("epoll_ctl: eventfd");
+    }
+
+    if (pthread_create(&r->thread, NULL, reactor_run, r) != 0) {
+        die("pthread_create failed for sub-reactor %d", r->id);
+    }
+}
+
+// offload 模式：给 Reactor 挂上完成通知用的 eventfd，创建 N 个 Worker 的线程池
+void start_offload(reactor_t* r, int nthreads) {
+    r->offload_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (r->offload_fd == -1) {
+        perror_die("eventfd");
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = r->offload_fd;
+    if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->offload_fd, &ev) == -1) {
+        perror_die("epoll_ctl: offload eventfd");
+    }
+
+    offload_pool = thread_pool_create(nthreads, OFFLOAD_QUEUE_SIZE);
+    if (offload_pool == NULL) {
+        die("thread_pool_create failed");
+    }
+}
+
+// 创建 Main Reactor，并把监听 Socket 挂上去
+// shared = 1 表示这个 Reactor 会被多个线程同时 epoll_wait (Leader/Follower 模式)
+reactor_t* create_main_reactor(int listener_sockfd, int shared) {
+    // 关键步骤：必须将监听 Socket 设为非阻塞
+    // 否则 accept() 可能会阻塞整个线程
+    make_socket_non_blocking(listener_sockfd);
+
+    // 1. 创建 Main Reactor (内部创建 epoll 实例)
+    reactor_t* main_reactor = xmalloc(sizeof(reactor_t));
+    reactor_init(main_reactor, 0, shared);
+    main_reactor->listener_sockfd = listener_sockfd;
+    accept_reactor = main_reactor;
+
+    // 2. 将 listener (监听 Socket) 加入 epoll 监控
+    // 我们关心的事件是 EPOLLIN (有新连接进来，相当于可读)
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = listener_sockfd; // 用户数据，这里存 fd，方便后续知道是哪个 Socket 就绪
+
+    // -e 模式：监听 Socket 也用边缘触发，一次通知 accept 到 EAGAIN
+    if (main_reactor->edge_triggered) {
+        ev.events |= EPOLLET;
+    }
+
+    // 共享 epoll 时的惊群问题：
+    // 水平触发的监听 Socket 在被某个线程取走事件后会立刻重新放回就绪链表，内核随即再唤醒一个线程，
+    // 于是一个新连接会把好几个线程都叫起来抢 accept，只有一个能抢到。
+    // 注意 EPOLLEXCLUSIVE 在这里帮不上忙：它只在同一个 fd 被加入“多个 epoll 实例”时起作用，
+    // 而这里只有一个实例、监听 Socket 上也只挂了一个等待项。
+    // 改用边缘触发 (EPOLLET)：每批新连接只产生一次通知，只唤醒一个线程，由它 accept 到 EAGAIN。
+    if (shared) {
+        ev.events |= EPOLLET;
+    }
+
+    // EPOLL_CTL_ADD: 添加监控事件
+    if (epoll_ctl(main_reactor->epfd, EPOLL_CTL_ADD, listener_sockfd, &ev) == -1) {
+        perror_die("epoll_ctl: listener");
+    }
+    return main_reactor;
+}
+
+// ---------------- Prefork 多进程模式 (Nginx 风格) ----------------
+// Master 进程不处理任何连接，只负责：
+//   1. 为每个 Worker 预先创建一个 SO_REUSEPORT 监听 Socket (同一个端口、同一个 reuseport 组)；
+//   2. fork 出 N 个 Worker，每个 Worker 绑定到一个 CPU，跑单线程 epoll 循环；
+//   3. Worker 崩溃后，用同一个监听 Socket 重新 fork 一个替补。
+// 为什么监听 Socket 由 Master 创建？
+// reuseport 组里的 socket 是按加入顺序编号的 (0..N-1)，BPF 程序返回的就是这个编号。
+// Master 一直持有所有监听 Socket，Worker 挂掉重启后编号不变，CPU 引流关系也就不会乱。
+
+static pid_t worker_pids[MAX_REACTORS];
+static int worker_listeners[MAX_REACTORS];
+static int n_workers = 0;
+static volatile sig_atomic_t master_stopping = 0;
+
+void on_master_signal(int sig) {
+    (void)sig;
+    master_stopping = 1;
+}
+
+// 给 reuseport 组挂一个经典 BPF (cBPF) 程序：返回值 = 处理这个 SYN 的 CPU 编号 % N
+// 网卡 RSS/RPS 决定了连接落在哪个 CPU 上，我们让同一个 CPU 上的 Worker 去 accept 它，
+// 这样从软中断、协议栈到用户态处理，这个连接的数据都留在同一个 CPU 的缓存里。
+void attach_reuseport_cpu_bpf(int sockfd, int ngroups) {
+    struct sock_filter code[] = {
+        // A = 当前 CPU 编号 (内核辅助字段 SKF_AD_CPU)
+        { BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU },
+        // A = A % ngroups (Worker 数可能少于 CPU 数)
+        { BPF_ALU | BPF_MOD | BPF_K, 0, 0, (uint32_t)ngroups },
+        // 返回 A：reuseport 组内 socket 的下标
+        { BPF_RET | BPF_A, 0, 0, 0 },
+    };
+    struct sock_fprog prog = {
+        .len = sizeof(code) / sizeof(code[0]),
+        .filter = code,
+    };
+    // 挂在组里任意一个 socket 上，整个 reuseport 组都会生效
+    if (setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) < 0) {
+        perror_die("setsockopt SO_ATTACH_REUSEPORT_CBPF");
+    }
+}
+
+// Worker 进程：绑到第 slot 个 CPU，只留自己的监听 Socket，跑单线程 epoll 循环
+void run_prefork_worker(int slot) {
+    // 子进程不需要 Master 的信号处理逻辑
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+
+    // Worker 数多于 CPU 数时，多个 Worker 共享一个 CPU
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int cpu = slot % (ncpus < 1 ? 1 : (int)ncpus);
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    if (sched_setaffinity(0, sizeof(cpus), &cpus) == -1) {
+        log_warn("sched_setaffinity: %m");
+    }
+
+    // 关掉其他 Worker 的监听 Socket：它们仍然被 Master 持有，不会离开 reuseport 组
+    for (int i = 0; i < n_workers; i++) {
+        if (i != slot) close(worker_listeners[i]);
+    }
+
+    log_info("Worker %d (pid %d) pinned to CPU %d", slot, getpid(), cpu);
+    reactor_t* r = create_main_reactor(worker_listeners[slot], 0);
+    reactor_run(r);
+    exit(EXIT_SUCCESS);
+}
+
+pid_t spawn_prefork_worker(int slot) {
+    pid_t pid = fork();
+    if (pid == -1) {
+        log_error("fork: %m");
+        return -1;
+    }
+    if (pid == 0) {
+        run_prefork_worker(slot);
+    }
+    return pid;
+}
+
+void run_prefork(int portnum, int nworkers, int steer_by_cpu) {
+    n_workers = nworkers;
+
+    // 按顺序创建监听 Socket，第 i 个就是 reuseport 组里的第 i 号
+    for (int i = 0; i < nworkers; i++) {
+        worker_listeners[i] = listen_inet_reuseport_socket(portnum);
+    }
+    if (steer_by_cpu) {
+        attach_reuseport_cpu_bpf(worker_listeners[0], nworkers);
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_master_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    for (int i = 0; i < nworkers; i++) {
+        worker_pids[i] = spawn_prefork_worker(i);
+    }
+    printf("Prefork mode: master pid %d, %d workers%s\n", getpid(), nworkers,
+           steer_by_cpu ? ", CPU-steered by reuseport BPF" : "");
+
+    // Master 的主循环：等子进程退出，谁挂了就重启谁
+    while (!master_stopping) {
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid == -1) {
+            if (errno == EINTR) continue;
+            log_error("waitpid: %m");
+            break;
+        }
+        for (int i = 0; i < nworkers; i++) {
+            if (worker_pids[i] != pid) continue;
+            if (WIFSIGNALED(status)) {
+                log_warn("Worker %d (pid %d) killed by signal %d, restarting",
+                        i, pid, WTERMSIG(status));
+            } else {
+                log_warn("Worker %d (pid %d) exited with status %d, restarting",
+                        i, pid, WEXITSTATUS(status));
+            }
+            // 防止 Worker 一启动就崩溃时 Master 疯狂 fork
+            sleep(1);
+            if (!master_stopping) {
+                worker_pids[i] = spawn_prefork_worker(i);
+            }
+            break;
+        }
+    }
+
+    // 收到 SIGINT/SIGTERM：通知所有 Worker 退出，并回收它们
+    for (int i = 0; i < nworkers; i++) {
+        if (worker_pids[i] > 0) kill(worker_pids[i], SIGTERM);
+    }
+    while (waitpid(-1, NULL, 0) > 0 || errno == EINTR) {
+    }
+}
+
+void usage(const char* prog) {
+    fprintf(stderr,
+            "Usage: %s [-m single|multi|prefork|lf|offload] [-t N] [-c] [-e] [-s secs] [-T h,i,w] [-C N] [-L] [-z bytes] [-o usec[,bytes]] [-w usec] [-v] [port]\n"
+            "  -m single   单线程 epoll 循环 (默认)\n"
+            "  -m multi    Multi-Reactor：主线程 accept，N 个 Sub-Reactor 线程各跑一个 epoll 循环\n"
+            "  -m prefork  多进程：Master fork N 个 Worker，每个 Worker 有自己的 SO_REUSEPORT 监听 Socket\n"
+            "  -m lf       Leader/Follower：N 个线程共享同一个 epoll 实例，客户端 fd 使用 EPOLLONESHOT\n"
+            "  -m offload  计算卸载：单线程 epoll 循环做所有 I/O，收完的消息交给 N 个 Worker 的线程池处理\n"
+            "  -t N        线程数 / Worker 进程数 (multi、lf、offload 默认 4，prefork 默认 CPU 核数，最多 %d)\n"
+            "  -c          prefork 模式下挂载 reuseport BPF，把连接引到收到它的那个 CPU 上的 Worker\n"
+            "  -e          边缘触发 (EPOLLET)：accept/recv/send 都一直做到 EAGAIN，不再每次 EPOLL_CTL_MOD\n"
+            "  -s secs     每隔 secs 秒打印每个线程的统计：每条消息对应的 epoll_wait/recv/send/epoll_ctl 次数\n"
+            "  -C N        最多同时接受 N 个连接 (prefork 下是每个 Worker)，到上限后暂停 accept (默认按 ulimit -n 计算)\n"
+            "  -T h,i,w    连接超时 (秒)：握手 h、空闲 i、写停滞 w，0 表示不限制 (默认 10,120,30)\n"
+            "  -L          大消息模式：每次 recv 读 64KB (默认 1KB)\n"
+            "  -z bytes    大消息模式 + MSG_ZEROCOPY：待发送数据不少于 bytes 字节时零拷贝发送 (建议 16384)\n"
+            "  -o usec[,bytes]  输出合并：流水线式输入的回显最多推迟 usec 微秒或攒到 bytes 字节 (默认 16384) 再发，\n"
+            "              一问一答的连接不推迟 (lf、offload 模式下不生效)\n"
+            "  -w usec     模拟业务处理：每条消息额外忙等 usec 微秒 CPU (offload 模式下在 Worker 里忙等)\n"
+            "  -v          DEBUG 日志：记录每个新连接的对端地址 (默认关闭)\n",
+            prog, MAX_REACTORS);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char** argv) {
+    // 设置标准输出为无缓冲，启动信息实时显示
+    // 运行期间的日志都走 log.c 的异步日志 (stderr)，不会再在 I/O 路径上逐行 write
+    setvbuf(stdout, NULL, _IONBF, 0);
+
+    int portnum = 9090;
+    server_mode_t mode = MODE_SINGLE;
+    int nthreads = 0;
+    int steer_by_cpu = 0;
+    int log_level = LOG_LEVEL_INFO;
+    int max_conns = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "m:t:ces:T:C:Lz:o:w:vh")) != -1) {
+        switch (opt) {
+            case 'm':
+                if (strcmp(optarg, "single") == 0) {
+                    mode = MODE_SINGLE;
+                } else if (strcmp(optarg, "multi") == 0) {
+                    mode = MODE_MULTI;
+                } else if (strcmp(optarg, "prefork") == 0) {
+                    mode = MODE_PREFORK;
+                } else if (strcmp(optarg, "lf") == 0) {
+                    mode = MODE_LF;
+                } else if (strcmp(optarg, "offload") == 0) {
+                    mode = MODE_OFFLOAD;
                 } else {
-                    // 必须把新连接也设为非阻塞，否则 recv/send 会阻塞主循环
-                    make_socket_non_blocking(new_socket);
-                    printf("New connection, socket fd is %d\n", new_socket);
-                    
-                    // 将新客户端 Socket 加入 epoll 监控
-                    struct epoll_event ev_client;
-                    ev_client.events = EPOLLIN | EPOLLOUT; // 初始监听读写，因为要发 '*'
-                    ev_client.data.fd = new_socket;
-                    if (epoll_ctl(epfd, EPOLL_CTL_ADD, new_socket, &ev_client) == -1) {
-                        perror("epoll_ctl: add client");
-                        close(new_socket);
-                    } else {
-                        // 初始化该客户端的状态结构体
-                        client_state_t* client = get_client_state(new_socket);
-                        // 立即准备发送 '*'
-                        if (client->bytes_to_send < SENDBUF_SIZE) {
-                            client->buf_to_send[client->bytes_to_send++] = '*';
-                            client->state = WAIT_FOR_MSG; 
-                        }
-                    }
-                }
-            } 
-            // 情况 B: 普通客户端 Socket 就绪 -> 有数据读或写
-            else {
-                client_state_t* client = get_client_state(fd);
-                if (!client) continue; // 异常保护：找不到状态则跳过
-
-                // B.1: 处理可读事件 (EPOLLIN) -> 客户端发来了数据
-                if (events[i].events & EPOLLIN) {
-                    char buffer[1024];
-                    int valread = recv(fd, buffer, 1024, 0);
-
-                    if (valread <= 0) {
-                        // recv 返回 0 表示对方关闭连接，返回 -1 表示出错
-                        // if (valread == 0) {
-                        //    printf("Host disconnected, fd %d\n", fd);
-                        // } else {
-                        //    perror("recv error");
-                        // }
-                        
-                        // 清理工作：
-                        epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
-                        close(fd);
-                        free_client_state(fd);
-                        continue; // 这个客户端处理完了，跳过后面逻辑
-                    }
-
-                    // 收到数据，喂给状态机处理
-                    for (int k = 0; k < valread; k++) {
-                        char input = buffer[k];
-                        switch (client->state) {
-                            case INITIAL_ACK:
-                                client->state = WAIT_FOR_MSG;
-                                // fallthrough
-                            case WAIT_FOR_MSG:
-                                if (input == '^') client->state = IN_MSG;
-                                break;
-                            case IN_MSG:
-                                if (input == '$') {
-                                    client->state = WAIT_FOR_MSG;
-                                } else {
-                                    if (client->bytes_to_send < SENDBUF_SIZE) {
-                                        client->buf_to_send[client->bytes_to_send++] = input + 1;
-                                    }
-                                }
-                                break;
-                        }
-                    }
-                }
-                
-                // 特殊逻辑：如果是刚连接 (INITIAL_ACK)，需要先发送 '*'
-                // 已经在 accept 时处理了，这里移除。
-                if (client->state == INITIAL_ACK) {
-                    // 这个状态理论上不再进入了，除非发送失败重置
-                    if (client->bytes_to_send < SENDBUF_SIZE) {
-                        client->buf_to_send[client->bytes_to_send++] = '*';
-                        client->state = WAIT_FOR_MSG;
-                    }
+                    usage(argv[0]);
                 }
+                break;
+            case 't':
+                nthreads = atoi(optarg);
+                if (nthreads < 1 || nthreads > MAX_REACTORS) usage(argv[0]);
+                break;
+            case 'c':
+                steer_by_cpu = 1;
+                break;
+            case 'e':
+                use_edge_triggered = 1;
+                break;
+            case 's':
+                stats_interval_ms = atoi(optarg) * 1000;
+                if (stats_interval_ms <= 0) usage(argv[0]);
+                break;
+            case 'T': {
+                int h, i, w;
+                if (sscanf(optarg, "%d,%d,%d", &h, &i, &w) != 3 || h < 0 || i < 0 || w < 0) usage(argv[0]);
+                handshake_timeout_ms = (unsigned)h * 1000;
+                idle_timeout_ms = (unsigned)i * 1000;
+                stall_timeout_ms = (unsigned)w * 1000;
+                break;
+            }
+            case 'C':
+                max_conns = atoi(optarg);
+                if (max_conns < 1) usage(argv[0]);
+                break;
+            case 'L':
+                recv_size = RECV_BUF_LARGE;
+                break;
+            case 'z':
+                zerocopy_threshold = (size_t)atol(optarg);
+                if (zerocopy_threshold < OUTBUF_SEG_SIZE) usage(argv[0]);
+                recv_size = RECV_BUF_LARGE;
+                break;
+            case 'o': {
+                int us, bytes = COALESCE_DEFAULT_BYTES;
+                int got = sscanf(optarg, "%d,%d", &us, &bytes);
+                if (got < 1 || us <= 0 || bytes <= 0 || bytes > OUTBUF_HIGH_WATER) usage(argv[0]);
+                coalesce_us = (unsigned)us;
+                coalesce_bytes = (size_t)bytes;
+                break;
+            }
+            case 'w':
+                if (atoi(optarg) < 0) usage(argv[0]);
+                work_us = (unsigned)atoi(optarg);
+                break;
+            case 'v':
+                log_level = LOG_LEVEL_DEBUG;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    // 兼容旧用法：第一个非选项参数仍然是端口号
+    if (optind < argc) portnum = atoi(argv[optind]);
+    printf("Serving on port %d\n", portnum);
+    // prefork 的 Worker 是 fork 出来的，log.c 会在子进程里重新启动刷盘线程
+    log_init(log_level, STDERR_FILENO);
+    // 连接上限 (和备用 fd) 是按进程算的：prefork 的每个 Worker 各有一份
+    conn_limit_init(max_conns);
+    printf("Max connections: %d\n", conn_limit_max());
+    if (zerocopy_threshold) {
+        printf("MSG_ZEROCOPY for sends >= %zu bytes\n", zerocopy_threshold);
+    }
+    if (coalesce_us) {
+        if (mode == MODE_LF || mode == MODE_OFFLOAD) {
+            printf("Output coalescing is not supported in %s mode, ignored\n",
+                   mode == MODE_LF ? "leader/follower" : "offload");
+            coalesce_us = 0;
+        } else {
+            printf("Output coalescing: up to %u us or %zu bytes\n", coalesce_us, coalesce_bytes);
+        }
+    }
 
-                // B.2: 处理可写事件 (EPOLLOUT) -> 内核缓冲区空闲，可以发送数据
-                // 只有当 events 包含 EPOLLOUT 时才执行
-                if (events[i].events & EPOLLOUT) {
-                    if (client->bytes_to_send > 0) {
-                        // 尝试发送缓冲区里的数据
-                        int sent = send(fd, client->buf_to_send, client->bytes_to_send, 0);
-                        if (sent < 0) {
-                            perror("send error");
-                            
-                            // 清理工作
-                            epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
-                            close(fd);
-                            free_client_state(fd);
-                            continue;
-                        }
-                        // 发送成功，更新缓冲区 (移动剩余数据到头部)
-                        if (sent > 0) {
-                            int remaining = client->bytes_to_send - sent;
-                            memmove(client->buf_to_send, client->buf_to_send + sent, remaining);
-                            client->bytes_to_send -= sent;
-                        }
-                    }
-                }
+    if (mode == MODE_PREFORK) {
+        if (nthreads == 0) {
+            // 默认每个 CPU 核一个 Worker
+            long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+            nthreads = ncpus < 1 ? 1 : (ncpus > MAX_REACTORS ? MAX_REACTORS : (int)ncpus);
+        }
+        run_prefork(portnum, nthreads, steer_by_cpu);
+        return 0;
+    }
 
-                // 关键优化：动态调整 Epoll 监听事件 (EPOLL_CTL_MOD)
-                // 为什么要这样做？
-                // 如果缓冲区是空的，我们不应该监听 EPOLLOUT，否则 epoll_wait 会一直立即返回 (忙轮询)，因为 Socket 通常一直是可写的。
-                // 只有当 buf_to_send 里有数据时，我们才告诉内核：“我想写，请在可写时通知我”。
-                struct epoll_event ev_mod;
-                ev_mod.data.fd = fd;
-                ev_mod.events = EPOLLIN; // 读事件永远监听
-                
-                if (client->bytes_to_send > 0) {
-                    ev_mod.events |= EPOLLOUT; // 只有有数据发时，才追加写事件监听
-                }
-                
-                // 更新内核中的监听规则
-                epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev_mod);
+    // 创建监听 Socket (bind + listen)
+    // 详细实现在 utils.c 中
+    int listener_sockfd = listen_inet_socket(portnum);
+    reactor_t* main_reactor = create_main_reactor(listener_sockfd, mode == MODE_LF);
+
+    if (mode == MODE_MULTI) {
+        if (nthreads == 0) nthreads = 4;
+        // One Loop Per Thread：启动 N 个 Sub-Reactor，主线程只做 accept + 分发
+        for (int i = 0; i < nthreads; i++) {
+            sub_reactors[i] = xmalloc(sizeof(reactor_t));
+            reactor_init(sub_reactors[i], i + 1, 0);
+            start_sub_reactor(sub_reactors[i]);
+        }
+        n_sub_reactors = nthreads;
+        printf("Multi-Reactor mode: 1 acceptor + %d sub-reactors\n", nthreads);
+    } else if (mode == MODE_LF) {
+        if (nthreads == 0) nthreads = 4;
+        // Leader/Follower：N 个线程 (含主线程) 都阻塞在同一个 epoll 上，谁被唤醒谁处理
+        // 不做静态分片，热点连接不会把某一个线程拖垮，其他线程照样能接手别的连接
+        for (int i = 1; i < nthreads; i++) {
+            pthread_t tid;
+            if (pthread_create(&tid, NULL, reactor_run, main_reactor) != 0) {
+                die("pthread_create failed for leader/follower thread %d", i);
             }
+            pthread_detach(tid);
         }
+        printf("Leader/Follower mode: %d threads sharing one epoll instance\n", nthreads);
+    } else if (mode == MODE_OFFLOAD) {
+        if (nthreads == 0) nthreads = 4;
+        // 单线程 Reactor 做所有 I/O，消息处理交给线程池
+        start_offload(main_reactor, nthreads);
+        printf("Offload mode: 1 reactor + %d pool workers\n", nthreads);
     }
-    close(epfd);
+    if (work_us) {
+        printf("Simulated handler cost: %u us per message\n", work_us);
+    }
+
+    reactor_run(main_reactor);
+
+    close(main_reactor->epfd);
     return 0;
 }
@@ -0,0 +1,82 @@
+#include "fd_table.h"
+#include "../utils.h"
+#include <stdlib.h>
+#include <string.h>
+
+// 初始目录覆盖 16 页 = 16384 个 fd，之后按需翻倍
+#define FD_TABLE_INITIAL_PAGES 16
+
+static fd_table_dir_t* fd_table_dir_alloc(int npages) {
+    fd_table_dir_t* dir = xmalloc(sizeof(fd_table_dir_t) + sizeof(fd_table_page_t*) * npages);
+    dir->retired = NULL;
+    dir->npages = npages;
+    for (int i = 0; i < npages; i++) {
+        atomic_init(&dir->pages[i], NULL);
+    }
+    return dir;
+}
+
+fd_table_t* fd_table_create(void) {
+    fd_table_t* t = xmalloc(sizeof(fd_table_t));
+    atomic_init(&t->dir, fd_table_dir_alloc(FD_TABLE_INITIAL_PAGES));
+    pthread_mutex_init(&t->grow_lock, NULL);
+    return t;
+}
+
+// 确保 fd 所在的页存在，返回这一页
+static fd_table_page_t* fd_table_page_for(fd_table_t* t, int fd) {
+    int page_idx = fd >> FD_TABLE_PAGE_SHIFT;
+    fd_table_dir_t* dir = atomic_load_explicit(&t->dir, memory_order_acquire);
+    if (page_idx < dir->npages) {
+        fd_table_page_t* page = atomic_load_explicit(&dir->pages[page_idx], memory_order_acquire);
+        if (page) return page;
+    }
+
+    // 慢路径：需要扩目录或者分配新页
+    pthread_mutex_lock(&t->grow_lock);
+    dir = atomic_load_explicit(&t->dir, memory_order_relaxed);
+    if (page_idx >= dir->npages) {
+        int npages = dir->npages;
+        while (npages <= page_idx) npages *= 2;
+
+        fd_table_dir_t* bigger = fd_table_dir_alloc(npages);
+        for (int i = 0; i < dir->npages; i++) {
+            atomic_init(&bigger->pages[i], atomic_load_explicit(&dir->pages[i], memory_order_relaxed));
+        }
+        bigger->retired = dir;
+        atomic_store_explicit(&t->dir, bigger, memory_order_release);
+        dir = bigger;
+    }
+
+    fd_table_page_t* page = atomic_load_explicit(&dir->pages[page_idx], memory_order_relaxed);
+    if (!page) {
+        page = xmalloc(sizeof(fd_table_page_t));
+        memset(page, 0, sizeof(*page));
+        atomic_store_explicit(&dir->pages[page_idx], page, memory_order_release);
+    }
+    pthread_mutex_unlock(&t->grow_lock);
+    return page;
+}
+
+// 同一个 fd 的槽位只会被当前拥有这个连接的线程写，所以槽位本身不需要原子操作
+void fd_table_set(fd_table_t* t, int fd, void* value) {
+    if (fd < 0) return;
+    fd_table_page_t* page = fd_table_page_for(t, fd);
+    page->slots[fd & (FD_TABLE_PAGE_SIZE - 1)] = value;
+}
+
+void fd_table_destroy(fd_table_t* t) {
+    if (t == NULL) return;
+    fd_table_dir_t* dir = atomic_load(&t->dir);
+    // 页只挂在最新的目录上释放一次；旧目录里的页指针都是它的子集
+    for (int i = 0; i < dir->npages; i++) {
+        free(atomic_load(&dir->pages[i]));
+    }
+    while (dir) {
+        fd_table_dir_t* next = dir->retired;
+        free(dir);
+        dir = next;
+    }
+    pthread_mutex_destroy(&t->grow_lock);
+    free(t);
+}
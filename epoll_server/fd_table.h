@@ -0,0 +1,47 @@
+#ifndef FD_TABLE_H
+#define FD_TABLE_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+// fd -> 指针 的映射表 (两级页表)
+// 为什么不用一个大数组？fd 的上限取决于 ulimit -n，写死成 12000 会把更大的 fd 直接丢掉；
+// 为什么不用哈希表？fd 是从小到大紧凑分配的整数，直接下标访问最快，也最省缓存。
+// 所以折中成两级：页目录 -> 页 (每页 1024 个槽位，8KB)，按需分配页，目录不够时翻倍扩容。
+// 查找只是两次数组下标，没有任何锁；只有扩容 (很少发生) 才加锁。
+
+#define FD_TABLE_PAGE_SHIFT 10
+#define FD_TABLE_PAGE_SIZE (1 << FD_TABLE_PAGE_SHIFT)
+
+typedef struct {
+    void* slots[FD_TABLE_PAGE_SIZE];
+} fd_table_page_t;
+
+// 页目录：扩容时整体换成一个更大的新目录
+// 旧目录不能马上释放 (别的线程可能正在读它)，挂到 retired 链表上，销毁整张表时再统一释放
+typedef struct fd_table_dir {
+    struct fd_table_dir* retired;
+    int npages;
+    _Atomic(fd_table_page_t*) pages[];
+} fd_table_dir_t;
+
+typedef struct {
+    _Atomic(fd_table_dir_t*) dir;
+    pthread_mutex_t grow_lock;  // 只保护扩容 (分配新页 / 换目录)
+} fd_table_t;
+
+fd_table_t* fd_table_create(void);
+void fd_table_set(fd_table_t* t, int fd, void* value);
+void fd_table_destroy(fd_table_t* t);
+
+// 查找：不存在返回 NULL (热路径，内联展开)
+static inline void* fd_table_get(fd_table_t* t, int fd) {
+    fd_table_dir_t* dir = atomic_load_explicit(&t->dir, memory_order_acquire);
+    int page_idx = fd >> FD_TABLE_PAGE_SHIFT;
+    if (fd < 0 || page_idx >= dir->npages) return NULL;
+    fd_table_page_t* page = atomic_load_explicit(&dir->pages[page_idx], memory_order_acquire);
+    if (!page) return NULL;
+    return page->slots[fd & (FD_TABLE_PAGE_SIZE - 1)];
+}
+
+#endif
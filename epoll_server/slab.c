@@ -0,0 +1,85 @@
+#include "slab.h"
+#include "../utils.h"
+#include <stdlib.h>
+
+#define SLAB_ALIGN 64
+
+// 向系统再要一个 chunk，切好后全部挂到空闲链表上 (调用者持有锁)
+static void slab_grow(slab_t* slab) {
+    // chunk 头部也占一个缓存行，保证后面每个对象都是 64 字节对齐的
+    size_t bytes = SLAB_ALIGN + slab->obj_size * slab->objs_per_chunk;
+    void* mem = NULL;
+    if (posix_memalign(&mem, SLAB_ALIGN, bytes) != 0) {
+        die("slab: posix_memalign(%zu) failed", bytes);
+    }
+
+    slab_chunk_t* chunk = mem;
+    chunk->next = slab->chunks;
+    slab->chunks = chunk;
+    slab->nchunks++;
+
+    // 倒着挂，这样分配顺序和内存地址顺序一致
+    char* base = (char*)mem + SLAB_ALIGN;
+    for (int i = slab->objs_per_chunk - 1; i >= 0; i--) {
+        void* obj = base + (size_t)i * slab->obj_size;
+        *(void**)obj = slab->free_list;
+        slab->free_list = obj;
+    }
+}
+
+void slab_init(slab_t* slab, size_t obj_size, int objs_per_chunk, int thread_safe) {
+    if (obj_size < sizeof(void*)) obj_size = sizeof(void*);
+    slab->obj_size = (obj_size + SLAB_ALIGN - 1) & ~(size_t)(SLAB_ALIGN - 1);
+    slab->objs_per_chunk = objs_per_chunk;
+    slab->free_list = NULL;
+    slab->chunks = NULL;
+    slab->nchunks = 0;
+    slab->in_use = 0;
+    slab->thread_safe = thread_safe;
+    pthread_mutex_init(&slab->lock, NULL);
+}
+
+// 预先准备好至少 nobjs 个空闲对象，避免运行时第一次遇到连接高峰才去要内存
+void slab_reserve(slab_t* slab, size_t nobjs) {
+    if (slab->thread_safe) pthread_mutex_lock(&slab->lock);
+    while (slab->nchunks * slab->objs_per_chunk < slab->in_use + nobjs) {
+        slab_grow(slab);
+    }
+    if (slab->thread_safe) pthread_mutex_unlock(&slab->lock);
+}
+
+void* slab_alloc(slab_t* slab) {
+    if (slab->thread_safe) pthread_mutex_lock(&slab->lock);
+    if (slab->free_list == NULL) {
+        slab_grow(slab);
+    }
+    void* obj = slab->free_list;
+    slab->free_list = *(void**)obj;
+    slab->in_use++;
+    if (slab->thread_safe) pthread_mutex_unlock(&slab->lock);
+    return obj;
+}
+
+void slab_free(slab_t* slab, void* obj) {
+    if (obj == NULL) return;
+    if (slab->thread_safe) pthread_mutex_lock(&slab->lock);
+    *(void**)obj = slab->free_list;
+    slab->free_list = obj;
+    slab->in_use--;
+    if (slab->thread_safe) pthread_mutex_unlock(&slab->lock);
+}
+
+// chunk 只在销毁时整体归还给系统
+void slab_destroy(slab_t* slab) {
+    slab_chunk_t* chunk = slab->chunks;
+    while (chunk) {
+        slab_chunk_t* next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    slab->chunks = NULL;
+    slab->free_list = NULL;
+    slab->nchunks = 0;
+    slab->in_use = 0;
+    pthread_mutex_destroy(&slab->lock);
+}
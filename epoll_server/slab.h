@@ -0,0 +1,34 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+// 固定大小对象的 Slab 分配器
+// 每次 accept 都 malloc/free 一个 client_state_t 既慢又容易产生碎片。
+// Slab 一次向系统要一大块 (chunk)，切成等长的对象；释放的对象挂回空闲链表 (free list)，
+// 下次分配直接从链表头摘走，O(1)，不进 malloc。
+// 对象按 64 字节 (一个缓存行) 对齐，避免两个连接的状态挤在同一个缓存行里。
+
+typedef struct slab_chunk {
+    struct slab_chunk* next;   // 所有 chunk 串成链表，销毁时统一释放
+} slab_chunk_t;
+
+typedef struct {
+    size_t obj_size;           // 对齐后的对象大小
+    int objs_per_chunk;        // 每个 chunk 切多少个对象
+    void* free_list;           // 空闲对象链表 (对象的前 8 字节存 next 指针)
+    slab_chunk_t* chunks;
+    size_t nchunks;
+    size_t in_use;             // 当前已分配出去的对象数
+    int thread_safe;           // 多个线程共用同一个 slab 时才需要加锁
+    pthread_mutex_t lock;
+} slab_t;
+
+void slab_init(slab_t* slab, size_t obj_size, int objs_per_chunk, int thread_safe);
+void slab_reserve(slab_t* slab, size_t nobjs);
+void* slab_alloc(slab_t* slab);
+void slab_free(slab_t* slab, void* obj);
+void slab_destroy(slab_t* slab);
+
+#endif
@@ -0,0 +1,435 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include "../utils.h"
+#include "../outbuf.h"
+#include "../protocol.h"
+#include "../log.h"
+#include "uring.h"
+
+// io_uring 版本的服务器 (协议和 epoll_server.c 完全一样)
+//
+// epoll 是“就绪通知”：内核告诉你 fd 可读了，你再自己去 recv / send，每一步都是一次系统调用。
+// io_uring 是“完成通知”：把操作本身提交给内核，内核做完了把结果放进完成队列 (CQ)。
+// 稳态下整个循环只剩一个系统调用：io_uring_enter (顺带提交新请求 + 等待完成事件)。
+//   - 多发 accept (IORING_ACCEPT_MULTISHOT)：提交一次，之后每来一个连接产生一个 CQE；
+//   - 多发 recv (IORING_RECV_MULTISHOT) + 提供缓冲区环：每个连接提交一次 recv，
+//     数据到了内核自己从缓冲区环里挑一块填进去，CQE 里带上缓冲区编号，用完还回环里；
+//   - 链式 send (IOSQE_IO_LINK)：输出队列里的多个段各提交一个 send，链起来保证按顺序发出，
+//     加 MSG_WAITALL 让内核把每段发完才算完成 (短写时内核自己等可写再继续，不会打断链)。
+
+// 提交队列深度 / 完成队列深度
+#define SQ_ENTRIES 4096
+#define CQ_ENTRIES 16384
+// 提供缓冲区环：多少块、每块多大 (所有连接共享，收到的数据马上拷进输出队列，缓冲区立刻归还)
+#define RECV_BUF_COUNT 1024
+#define RECV_BUF_SIZE 4096
+#define RECV_BGID 0
+// 一次最多把输出队列里的多少段链成一串 send
+#define MAX_SEND_LINK 16
+// 剩余名额不超过这个数时不用多发 accept (要比监听队列长，见 update_accept)
+#define ACCEPT_MULTISHOT_ROOM 256
+
+// CQE 的 user_data：连接指针 (malloc 至少 16 字节对齐) 的低 2 位存操作类型
+enum {
+    OP_ACCEPT = 0,
+    OP_RECV = 1,
+    OP_SEND = 2,
+    OP_CANCEL = 3,
+};
+#define OP_MASK 3ull
+
+typedef struct {
+    int fd;
+    ProcessingState state;
+    outbuf_t out;
+    int recv_armed;    // 多发 recv 还在内核里挂着
+    int send_pending;  // 还没完成的 send 个数 (同一时刻只有一串链式 send 在飞)
+    int read_paused;   // 背压：输出队列超过高水位时取消 recv，降到低水位以下再重新提交
+    int closing;       // 已经 shutdown，等所有在飞的操作都完成后再 close + 释放
+} conn_t;
+
+typedef struct {
+    unsigned long wakeups;  // io_uring_enter 返回次数
+    unsigned long cqes;
+    unsigned long msgs;
+} loop_stats_t;
+
+static uring_t ring;
+static uring_buf_ring_t recv_bufs;
+static int listener_fd;
+static loop_stats_t loop_stats;
+static int stats_interval_ms = 0;
+// 过载保护：accept 请求是否还挂在内核里、是不是多发的、是否正在取消
+static int accept_armed = 0;
+static int accept_multishot = 0;
+static int accept_cancelling = 0;
+
+static struct io_uring_sqe* get_sqe(void) {
+    struct io_uring_sqe* sqe = uring_get_sqe(&ring);
+    if (!sqe) {
+        die("io_uring SQ full");
+    }
+    return sqe;
+}
+
+static inline uint64_t make_user_data(conn_t* c, int op) {
+    return (uint64_t)(uintptr_t)c | (uint64_t)op;
+}
+
+static void arm_accept(int multishot) {
+    struct io_uring_sqe* sqe = get_sqe();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listener_fd;
+    sqe->ioprio = multishot ? IORING_ACCEPT_MULTISHOT : 0;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = make_user_data(NULL, OP_ACCEPT);
+    accept_armed = 1;
+    accept_multishot = multishot;
+}
+
+// 准入控制：每接进一个连接 / 关掉一个连接后调用，根据剩余名额决定怎么 accept
+//   - 名额充足：多发 accept，内核每来一个连接就产生一个 CQE；
+//   - 名额不多了：多发 accept 一口气会把监听队列里的连接全接出来 (提交取消请求之前就可能已经接了)，
+//     所以先取消它，改成一次只接一个的普通 accept；
+//   - 没有名额：不提交 accept，新连接留在内核的监听队列里排队，有连接关闭后再提交。
+static void update_accept(void) {
+    int room = conn_limit_max() - conn_active();
+    if (accept_armed) {
+        if (accept_multishot && !accept_cancelling && room <= ACCEPT_MULTISHOT_ROOM) {
+            struct io_uring_sqe* sqe = get_sqe();
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->fd = -1;
+            sqe->addr = make_user_data(NULL, OP_ACCEPT);
+            sqe->user_data = make_user_data(NULL, OP_CANCEL);
+            accept_cancelling = 1;
+        }
+        return;
+    }
+    if (room > 0) {
+        arm_accept(room > ACCEPT_MULTISHOT_ROOM);
+    } else {
+        log_debug("connection limit %d reached, accept paused", conn_limit_max());
+    }
+}
+
+// 多发 recv：不指定缓冲区，由内核从 RECV_BGID 组里挑
+static void arm_recv(conn_t* c) {
+    struct io_uring_sqe* sqe = get_sqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = c->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = RECV_BGID;
+    sqe->user_data = make_user_data(c, OP_RECV);
+    c->recv_armed = 1;
+}
+
+// 背压：取消这个连接挂着的多发 recv，被取消的 recv 会以 -ECANCELED 结束
+static void cancel_recv(conn_t* c) {
+    struct io_uring_sqe* sqe = get_sqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = make_user_data(c, OP_RECV);
+    sqe->user_data = make_user_data(NULL, OP_CANCEL);
+}
+
+// 把输出队列开头的若干段链成一串 send 提交
+// 在这串 send 全部完成之前不会再提交新的 (否则两串之间的先后顺序没有保证)
+static void start_send(conn_t* c) {
+    if (c->send_pending > 0 || c->out.len == 0 || c->closing) {
+        return;
+    }
+    struct iovec iov[MAX_SEND_LINK];
+    int n = outbuf_peek(&c->out, iov, MAX_SEND_LINK);
+    for (int i = 0; i < n; i++) {
+        struct io_uring_sqe* sqe = get_sqe();
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = c->fd;
+        sqe->addr = (uint64_t)(uintptr_t)iov[i].iov_base;
+        sqe->len = (uint32_t)iov[i].iov_len;
+        sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+        if (i + 1 < n) {
+            sqe->flags = IOSQE_IO_LINK;
+        }
+        sqe->user_data = make_user_data(c, OP_SEND);
+        c->send_pending++;
+    }
+}
+
+// 所有在飞的操作都回来以后才能释放：CQE 里带的是 conn 指针，提前 free 就成了悬空指针
+static void maybe_free_conn(conn_t* c) {
+    if (!c->closing || c->recv_armed || c->send_pending > 0) {
+        return;
+    }
+    close(c->fd);
+    outbuf_free(&c->out);
+    free(c);
+    conn_release(1);
+    update_accept();
+}
+
+// shutdown 会让挂着的多发 recv 以 0 (EOF) 结束、在飞的 send 以错误结束，之后再走 maybe_free_conn
+static void close_conn(conn_t* c) {
+    if (!c->closing) {
+        c->closing = 1;
+        shutdown(c->fd, SHUT_RDWR);
+    }
+    maybe_free_conn(c);
+}
+
+static void handle_accept(struct io_uring_cqe* cqe) {
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        // 这个 accept 请求结束了 (单发的接完一个，多发的出错或者被 update_accept 取消)，
+        // 下面的 update_accept 按剩余名额重新提交
+        accept_armed = 0;
+        accept_cancelling = 0;
+    }
+    if (cqe->res < 0) {
+        if (cqe->res == -EMFILE || cqe->res == -ENFILE) {
+            // fd 用完了：丢掉排在最前面的连接，免得它一直挂在监听队列里
+            accept_shed(listener_fd);
+        } else if (cqe->res != -ECANCELED) {
+            log_error("accept: %s", strerror(-cqe->res));
+        }
+        update_accept();
+        return;
+    }
+    if (!conn_acquire(1)) {
+        // 取消生效之前多发 accept 多接进来的连接 (很少见)：超过上限，只能直接关掉
+        close(cqe->res);
+        log_warn("connection limit reached, dropped a new connection");
+        update_accept();
+        return;
+    }
+    update_accept();
+
+    conn_t* c = xmalloc(sizeof(conn_t));
+    c->fd = cqe->res;
+    c->state = WAIT_FOR_MSG;
+    outbuf_init(&c->out);
+    c->recv_armed = 0;
+    c->send_pending = 0;
+    c->read_paused = 0;
+    c->closing = 0;
+    log_debug("New connection, socket fd is %d", c->fd);
+
+    // 握手的 '*' 和第一个 recv 一起提交，不需要单独等一轮
+    outbuf_append(&c->out, "*", 1);
+    start_send(c);
+    arm_recv(c);
+}
+
+// 把收到的数据喂给状态机，回显内容直接写进输出队列的尾段 (同 epoll_server.c 的 process_input)
+static void process_input(conn_t* c, const char* buffer, size_t len) {
+    size_t off = 0;
+    while (off < len) {
+        size_t avail, msgs = 0;
+        char* out = outbuf_reserve(&c->out, &avail);
+        size_t chunk = len - off < avail ? len - off : avail;
+        outbuf_commit(&c->out, protocol_process(&c->state, buffer + off, chunk, out, &msgs));
+        loop_stats.msgs += msgs;
+        off += chunk;
+    }
+}
+
+static void handle_recv(conn_t* c, struct io_uring_cqe* cqe) {
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        c->recv_armed = 0;
+    }
+
+    if (cqe->res > 0) {
+        uint16_t bid = (uint16_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        if (!c->closing) {
+            process_input(c, uring_buf_ring_buf(&recv_bufs, bid), (size_t)cqe->res);
+        }
+        // 数据已经拷进输出队列，缓冲区马上还回环里
+        uring_buf_ring_add(&recv_bufs, bid);
+        uring_buf_ring_advance(&recv_bufs);
+    } else if (cqe->res == 0 || (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -ECANCELED)) {
+        // 对端关闭或出错
+        if (cqe->res < 0 && !c->closing) {
+            log_error("recv: %s", strerror(-cqe->res));
+        }
+        close_conn(c);
+        return;
+    }
+
+    if (c->closing) {
+        maybe_free_conn(c);
+        return;
+    }
+
+    start_send(c);
+
+    // 背压：客户端只发不收时输出队列会越堆越长，超过高水位就把 recv 取消掉
+    if (c->out.len >= OUTBUF_HIGH_WATER) {
+        if (!c->read_paused) {
+            c->read_paused = 1;
+            if (c->recv_armed) {
+                cancel_recv(c);
+            }
+        }
+    } else if (!c->recv_armed && !c->read_paused) {
+        // 多发 recv 结束了 (通常是缓冲区环暂时被用光 -ENOBUFS)，重新提交
+        arm_recv(c);
+    }
+}
+
+static void handle_send(conn_t* c, struct io_uring_cqe* cqe) {
+    c->send_pending--;
+    if (cqe->res < 0) {
+        // 链里前面的 send 失败了，后面的会以 -ECANCELED 结束
+        if (cqe->res != -ECANCELED && cqe->res != -EPIPE && cqe->res != -ECONNRESET) {
+            log_error("send: %s", strerror(-cqe->res));
+        }
+        close_conn(c);
+        return;
+    }
+    outbuf_consume(&c->out, (size_t)cqe->res);
+
+    if (c->closing) {
+        maybe_free_conn(c);
+        return;
+    }
+    if (c->send_pending == 0) {
+        // 这一串发完了，发送期间又攒下的回显接着发
+        start_send(c);
+        if (c->read_paused && c->out.len <= OUTBUF_LOW_WATER) {
+            c->read_paused = 0;
+            if (!c->recv_armed) {
+                arm_recv(c);
+            }
+        }
+    }
+}
+
+static long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+static void report_loop_stats(void) {
+    double msgs = loop_stats.msgs ? (double)loop_stats.msgs : 1.0;
+    log_info("[io_uring] msgs=%lu io_uring_enter=%lu cqes=%lu | per msg: io_uring_enter=%.3f cqes=%.2f",
+             loop_stats.msgs, ring.enter_calls, loop_stats.cqes,
+             ring.enter_calls / msgs, loop_stats.cqes / msgs);
+    memset(&loop_stats, 0, sizeof(loop_stats));
+    ring.enter_calls = 0;
+}
+
+static void run_loop(void) {
+    long next_report = stats_interval_ms > 0 ? now_ms() + stats_interval_ms : 0;
+    while (1) {
+        int timeout = -1;
+        if (stats_interval_ms > 0) {
+            long left = next_report - now_ms();
+            timeout = left > 0 ? (int)left : 0;
+        }
+        // 一次系统调用：提交上一轮攒下的所有 SQE，并等至少一个完成事件
+        int ret = uring_submit_and_wait(&ring, 1, timeout);
+        if (ret < 0 && ret != -EINTR && ret != -ETIME && ret != -EBUSY) {
+            log_error("io_uring_enter: %s", strerror(-ret));
+        }
+        loop_stats.wakeups++;
+
+        unsigned head = uring_cq_head(&ring);
+        struct io_uring_cqe* cqe;
+        while ((cqe = uring_peek_cqe(&ring, &head)) != NULL) {
+            head++;
+            loop_stats.cqes++;
+            conn_t* c = (conn_t*)(uintptr_t)(cqe->user_data & ~OP_MASK);
+            switch (cqe->user_data & OP_MASK) {
+                case OP_ACCEPT:
+                    handle_accept(cqe);
+                    break;
+                case OP_RECV:
+                    handle_recv(c, cqe);
+                    break;
+                case OP_SEND:
+                    handle_send(c, cqe);
+                    break;
+                case OP_CANCEL:
+                    break;
+            }
+            // 处理过程中可能还会往 SQ 里塞新请求，CQ 的 head 按批归还即可
+        }
+        uring_cq_advance(&ring, head);
+
+        if (stats_interval_ms > 0 && now_ms() >= next_report) {
+            report_loop_stats();
+            next_report = now_ms() + stats_interval_ms;
+        }
+    }
+}
+
+static void usage(const char* prog) {
+    fprintf(stderr,
+            "Usage: %s [-s secs] [-C N] [-v] [port]\n"
+            "  -s secs     每隔 secs 秒打印一次统计：每条消息对应的 io_uring_enter 次数和完成事件数\n"
+            "  -C N        最多同时接受 N 个连接，到上限后取消多发 accept (默认按 ulimit -n 计算)\n"
+            "  -v          DEBUG 日志：记录每个新连接 (默认关闭)\n",
+            prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char** argv) {
+    setvbuf(stdout, NULL, _IONBF, 0);
+
+    int portnum = 9090;
+    int log_level = LOG_LEVEL_INFO;
+    int max_conns = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:C:vh")) != -1) {
+        switch (opt) {
+            case 's':
+                stats_interval_ms = atoi(optarg) * 1000;
+                if (stats_interval_ms <= 0) usage(argv[0]);
+                break;
+            case 'C':
+                max_conns = atoi(optarg);
+                if (max_conns < 1) usage(argv[0]);
+                break;
+            case 'v':
+                log_level = LOG_LEVEL_DEBUG;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (optind < argc) portnum = atoi(argv[optind]);
+    printf("Serving on port %d\n", portnum);
+    log_init(log_level, STDERR_FILENO);
+    conn_limit_init(max_conns);
+
+    listener_fd = listen_inet_socket(portnum);
+
+    // SINGLE_ISSUER + DEFER_TASKRUN (6.1+)：只有这一个线程提交，完成事件的收尾工作推迟到 io_uring_enter 里做，
+    // 不再用 IPI 打断正在跑的用户态代码。老内核不认识这两个 flag，去掉重试。
+    int rc = uring_init(&ring, SQ_ENTRIES, CQ_ENTRIES, IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN);
+    if (rc == -EINVAL) {
+        rc = uring_init(&ring, SQ_ENTRIES, CQ_ENTRIES, 0);
+    }
+    if (rc < 0) {
+        errno = -rc;
+        perror_die("io_uring_setup");
+    }
+    if ((rc = uring_setup_buf_ring(&ring, &recv_bufs, RECV_BGID, RECV_BUF_COUNT, RECV_BUF_SIZE)) < 0) {
+        // 提供缓冲区环需要 5.19+
+        errno = -rc;
+        perror_die("IORING_REGISTER_PBUF_RING");
+    }
+
+    update_accept();
+    run_loop();
+    return 0;
+}
@@ -0,0 +1,185 @@
+#include "uring.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+int uring_init(uring_t* u, unsigned entries, unsigned cq_entries, unsigned flags) {
+    memset(u, 0, sizeof(*u));
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = flags;
+    if (cq_entries) {
+        // 1 万个连接时完成事件可能一下子来很多，CQ 开大一点，少走内核的溢出链表
+        p.flags |= IORING_SETUP_CQSIZE;
+        p.cq_entries = cq_entries;
+    }
+
+    int fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (fd < 0) {
+        return -errno;
+    }
+    u->ring_fd = fd;
+    u->features = p.features;
+
+    // 两个环各自的大小：偏移量都是内核在 params 里告诉我们的
+    u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    // 5.4 以后 SQ 和 CQ 在同一块映射里，映射一次就够了
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (u->cq_ring_size > u->sq_ring_size) u->sq_ring_size = u->cq_ring_size;
+        u->cq_ring_size = u->sq_ring_size;
+    }
+
+    u->sq_ring_ptr = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (u->sq_ring_ptr == MAP_FAILED) {
+        goto fail;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        u->cq_ring_ptr = u->sq_ring_ptr;
+    } else {
+        u->cq_ring_ptr = mmap(NULL, u->cq_ring_size, PROT_READ | PROT_WRITE,
+                              MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (u->cq_ring_ptr == MAP_FAILED) {
+            goto fail;
+        }
+    }
+    u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) {
+        goto fail;
+    }
+
+    char* sq = u->sq_ring_ptr;
+    u->sq_head = (unsigned*)(sq + p.sq_off.head);
+    u->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    u->sq_mask = *(unsigned*)(sq + p.sq_off.ring_mask);
+    u->sq_entries = p.sq_entries;
+    u->sq_array = (unsigned*)(sq + p.sq_off.array);
+    // SQ 环里放的是 SQE 的下标；我们按顺序使用 SQE，所以下标表就是恒等映射，初始化一次即可
+    for (unsigned i = 0; i < p.sq_entries; i++) {
+        u->sq_array[i] = i;
+    }
+
+    char* cq = u->cq_ring_ptr;
+    u->cq_head = (unsigned*)(cq + p.cq_off.head);
+    u->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    u->cq_mask = *(unsigned*)(cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    return 0;
+
+fail:;
+    int err = -errno;
+    uring_exit(u);
+    return err;
+}
+
+void uring_exit(uring_t* u) {
+    if (u->sqes && u->sqes != MAP_FAILED) {
+        munmap(u->sqes, u->sqes_size);
+    }
+    if (u->cq_ring_ptr && u->cq_ring_ptr != MAP_FAILED && u->cq_ring_ptr != u->sq_ring_ptr) {
+        munmap(u->cq_ring_ptr, u->cq_ring_size);
+    }
+    if (u->sq_ring_ptr && u->sq_ring_ptr != MAP_FAILED) {
+        munmap(u->sq_ring_ptr, u->sq_ring_size);
+    }
+    if (u->ring_fd > 0) {
+        close(u->ring_fd);
+    }
+    memset(u, 0, sizeof(*u));
+}
+
+struct io_uring_sqe* uring_get_sqe(uring_t* u) {
+    unsigned head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+    if (u->sqe_tail - head >= u->sq_entries) {
+        // SQ 满了：先把手上的交给内核 (非 SQPOLL 模式下 io_uring_enter 返回时内核已经全部取走)
+        uring_submit_and_wait(u, 0, -1);
+        head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+        if (u->sqe_tail - head >= u->sq_entries) {
+            return NULL;
+        }
+    }
+    struct io_uring_sqe* sqe = &u->sqes[u->sqe_tail & u->sq_mask];
+    u->sqe_tail++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+int uring_submit_and_wait(uring_t* u, unsigned wait_nr, int timeout_ms) {
+    unsigned to_submit = u->sqe_tail - u->sqe_head;
+    if (to_submit) {
+        // release：内核看到新的 tail 时，SQE 的内容一定已经写好了
+        __atomic_store_n(u->sq_tail, u->sqe_tail, __ATOMIC_RELEASE);
+        u->sqe_head = u->sqe_tail;
+    }
+
+    unsigned flags = 0;
+    if (wait_nr > 0) {
+        flags |= IORING_ENTER_GETEVENTS;
+    }
+    void* arg = NULL;
+    size_t argsz = 0;
+    struct io_uring_getevents_arg ext;
+    struct __kernel_timespec ts;
+    if (timeout_ms >= 0 && wait_nr > 0 && (u->features & IORING_FEAT_EXT_ARG)) {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+        memset(&ext, 0, sizeof(ext));
+        ext.ts = (uint64_t)(uintptr_t)&ts;
+        flags |= IORING_ENTER_EXT_ARG;
+        arg = &ext;
+        argsz = sizeof(ext);
+    }
+
+    u->enter_calls++;
+    int ret = (int)syscall(__NR_io_uring_enter, u->ring_fd, to_submit, wait_nr, flags, arg, argsz);
+    return ret < 0 ? -errno : ret;
+}
+
+int uring_setup_buf_ring(uring_t* u, uring_buf_ring_t* r, uint16_t bgid, unsigned nbufs, unsigned buf_size) {
+    memset(r, 0, sizeof(*r));
+    // 缓冲区环本身必须页对齐，用 mmap 分配最省事
+    size_t ring_size = nbufs * sizeof(struct io_uring_buf);
+    void* ring = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (ring == MAP_FAILED) {
+        return -errno;
+    }
+    char* bufs = mmap(NULL, (size_t)nbufs * buf_size, PROT_READ | PROT_WRITE,
+                      MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (bufs == MAP_FAILED) {
+        int err = -errno;
+        munmap(ring, ring_size);
+        return err;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)ring;
+    reg.ring_entries = nbufs;
+    reg.bgid = bgid;
+    if (syscall(__NR_io_uring_register, u->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        int err = -errno;
+        munmap(bufs, (size_t)nbufs * buf_size);
+        munmap(ring, ring_size);
+        return err;
+    }
+
+    r->br = ring;
+    r->bufs = bufs;
+    r->nbufs = nbufs;
+    r->mask = nbufs - 1;
+    r->buf_size = buf_size;
+    r->bgid = bgid;
+    // 一开始所有缓冲区都交给内核
+    for (unsigned i = 0; i < nbufs; i++) {
+        uring_buf_ring_add(r, (uint16_t)i);
+    }
+    uring_buf_ring_advance(r);
+    return 0;
+}
@@ -0,0 +1,105 @@
+#ifndef URING_H
+#define URING_H
+
+// 极简 io_uring 封装：直接用 io_uring_setup / io_uring_enter / io_uring_register 三个系统调用，
+// 不依赖 liburing (系统里没装也能编译)。只实现了这个服务器用得到的部分：
+//   - SQ / CQ 两个共享环的 mmap 与提交 / 收割；
+//   - 提供缓冲区环 (provided buffer ring, IORING_REGISTER_PBUF_RING)，给多发 recv 用。
+//
+// 提交队列 (SQ)：用户态写 SQE、推进 tail，内核消费、推进 head；
+// 完成队列 (CQ)：内核写 CQE、推进 tail，用户态消费、推进 head。
+// 两边都是单生产者 / 单消费者，只需要 acquire / release 内存序，不需要锁。
+
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/io_uring.h>
+
+typedef struct {
+    int ring_fd;
+    unsigned features;
+
+    // SQ
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned* sq_array;
+    struct io_uring_sqe* sqes;
+    unsigned sqe_tail;     // 已经填好、还没交给内核的 SQE 写到哪了
+    unsigned sqe_head;     // 交给内核的 SQE 到哪了
+
+    // CQ
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe* cqes;
+
+    void* sq_ring_ptr;
+    size_t sq_ring_size;
+    void* cq_ring_ptr;
+    size_t cq_ring_size;
+    size_t sqes_size;
+
+    unsigned long enter_calls;  // io_uring_enter 调用次数 (统计用)
+} uring_t;
+
+// 提供缓冲区环：nbufs 个 buf_size 字节的缓冲区，内核收数据时自己挑一个空闲的用，
+// 通过 CQE 的 flags 告诉我们用的是哪个 (bid)，用完再还回来
+typedef struct {
+    struct io_uring_buf_ring* br;
+    char* bufs;
+    unsigned nbufs;
+    unsigned mask;
+    unsigned buf_size;
+    uint16_t bgid;
+    uint16_t tail;   // 本地维护的 tail，uring_buf_ring_advance 时才对内核可见
+} uring_buf_ring_t;
+
+// 建环。flags 是 IORING_SETUP_*，cq_entries 为 0 表示用内核默认 (2 * entries)
+// 失败返回 -errno (比如旧内核不认识某个 flag 时返回 -EINVAL，调用方可以去掉 flag 重试)
+int uring_init(uring_t* u, unsigned entries, unsigned cq_entries, unsigned flags);
+void uring_exit(uring_t* u);
+
+// 取一个空的 SQE (已清零)。SQ 满了会先把已有的提交给内核再取
+struct io_uring_sqe* uring_get_sqe(uring_t* u);
+
+// 把填好的 SQE 交给内核，并至少等到 wait_nr 个完成事件
+// timeout_ms >= 0 时最多等这么久 (需要 IORING_FEAT_EXT_ARG)。返回值同 io_uring_enter
+int uring_submit_and_wait(uring_t* u, unsigned wait_nr, int timeout_ms);
+
+// 收割 CQE：peek 拿到下一个 (没有就返回 NULL)，处理完用 cq_advance 一次性归还
+static inline struct io_uring_cqe* uring_peek_cqe(uring_t* u, unsigned* head) {
+    unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+    if (*head == tail) return NULL;
+    return &u->cqes[*head & u->cq_mask];
+}
+
+static inline void uring_cq_advance(uring_t* u, unsigned head) {
+    __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+}
+
+static inline unsigned uring_cq_head(uring_t* u) {
+    return *u->cq_head;
+}
+
+// 注册一个提供缓冲区环 (组号 bgid)，nbufs 必须是 2 的幂。成功返回 0，失败返回 -errno
+int uring_setup_buf_ring(uring_t* u, uring_buf_ring_t* r, uint16_t bgid, unsigned nbufs, unsigned buf_size);
+
+// 把缓冲区 bid 还给内核 (先在本地排队，uring_buf_ring_advance 时一次性发布)
+static inline void uring_buf_ring_add(uring_buf_ring_t* r, uint16_t bid) {
+    struct io_uring_buf* buf = &r->br->bufs[r->tail & r->mask];
+    buf->addr = (uint64_t)(uintptr_t)(r->bufs + (size_t)bid * r->buf_size);
+    buf->len = r->buf_size;
+    buf->bid = bid;
+    r->tail++;
+}
+
+static inline void uring_buf_ring_advance(uring_buf_ring_t* r) {
+    __atomic_store_n(&r->br->tail, r->tail, __ATOMIC_RELEASE);
+}
+
+static inline char* uring_buf_ring_buf(uring_buf_ring_t* r, uint16_t bid) {
+    return r->bufs + (size_t)bid * r->buf_size;
+}
+
+#endif
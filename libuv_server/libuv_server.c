@@ -1,37 +1,210 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <uv.h>
 #include "../utils.h"
+#include "../outbuf.h"
+#include "../protocol.h"
+#include "../log.h"
+#include "../timer_wheel.h"
 
 #define DEFAULT_PORT 9090
 #define BACKLOG 1024
-// 发送缓冲区大小
-#define SEND_BUF_SIZE 1024
-
-typedef enum {
-    INITIAL_ACK,  // 状态 1: 初始连接，尚未发送欢迎字符 '*'
-    WAIT_FOR_MSG, // 状态 2: 等待消息开始符 '^'，在此状态下忽略所有其他输入
-    IN_MSG        // 状态 3: 正在接收消息，对收到的字符 +1 回显，直到收到结束符 '$'
-} ProcessingState;
+// 一次 uv_write 最多带多少个缓冲段
+#define MAX_WRITE_BUFS 64
+// 超时时间轮的精度 (毫秒)
+#define TIMER_TICK_MS 100
+// 输出队列为空时 write_wait_tick 的取值
+#define TICK_NONE UINT64_MAX
 
 typedef struct {
     ProcessingState state;
-    char sendbuf[SEND_BUF_SIZE];
-    int sendbuf_end;
+    // 输出队列 (缓冲段链表，见 outbuf.c)：不会因为满了而丢字节
+    outbuf_t out;
+    // 已经交给 uv_write、还没写完的字节数
+    // 这部分数据在 on_wrote_buf 之前必须保持不动，所以只在写完后才从队头 consume
+    size_t inflight;
+    // 背压：待发送数据超过高水位时 uv_read_stop，降到低水位以下再 uv_read_start
+    int read_paused;
     uv_tcp_t* client;
+
+    // 超时 (单位是时间轮的 tick)：回调里只更新时间戳，定时器到期时再算真正的截止时间
+    timer_node_t timer;
+    int got_input;             // 是否收到过数据 (之前按握手超时算，之后按空闲超时算)
+    uint64_t accepted_tick;
+    uint64_t active_tick;      // 最近一次读到数据或写完数据
+    uint64_t write_wait_tick;  // 输出队列从什么时候开始没有进展，队列为空时为 TICK_NONE
 } peer_state_t;
 
+// 连接超时 (毫秒，0 表示不限制)，-T h,i,w 设置，含义同 epoll_server
+static unsigned handshake_timeout_ms = 10 * 1000;
+static unsigned idle_timeout_ms = 120 * 1000;
+static unsigned stall_timeout_ms = 30 * 1000;
+// 所有连接共用一个时间轮 (libuv 只有一个事件循环线程)，由一个周期性的 uv_timer 推进
+// 时间轮空着的时候停掉 uv_timer，没有连接时事件循环不会被定时唤醒
+static timer_wheel_t wheel;
+static uv_timer_t wheel_timer;
+static int timeouts_enabled = 0;
+
+// 过载保护：连接数到上限时记下监听句柄，先不 uv_accept，等有连接关闭再接 (见 on_peer_connected)
+static uv_stream_t* deferred_server = NULL;
+
+void accept_peer(uv_stream_t* server_stream);
+
 void on_wrote_buf(uv_write_t* req, int status);
+void on_read(uv_stream_t *client, ssize_t nread, const uv_buf_t* buf);
 
 void alloc_buffer(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
     buf->base = (char*)xmalloc(suggested_size);
     buf->len = suggested_size;
 }
 
+// 连接彻底关闭后，释放它的状态和输出队列
+// 每个走到 accept_peer 的连接都占了一个名额，在这里归还；之前因为满了没接的连接现在可以接了
+void on_client_closed(uv_handle_t* handle) {
+    peer_state_t* peerstate = (peer_state_t*) handle->data;
+    if (peerstate) {
+        timer_del(&wheel, &peerstate->timer);
+        outbuf_free(&peerstate->out);
+        free(peerstate);
+    }
+    free(handle);
+
+    conn_release(1);
+    if (deferred_server && conn_acquire(1)) {
+        uv_stream_t* server_stream = deferred_server;
+        deferred_server = NULL;
+        log_debug("accept resumed");
+        accept_peer(server_stream);
+    }
+}
+
+void close_peer(peer_state_t* peerstate) {
+    if (!uv_is_closing((uv_handle_t*)peerstate->client)) {
+        uv_close((uv_handle_t*)peerstate->client, on_client_closed);
+    }
+}
+
+// 根据连接当前的时间戳算出最早的截止 tick
+// 换算成 tick 时多加 1：时间戳最多落后一个 tick，宁可晚一点断开，也不能提前
+static uint64_t peer_deadline(peer_state_t* peerstate) {
+    uint64_t deadline = TICK_NONE;
+    if (!peerstate->got_input) {
+        if (handshake_timeout_ms) {
+            deadline = peerstate->accepted_tick + timer_wheel_ticks(&wheel, handshake_timeout_ms) + 1;
+        }
+    } else if (idle_timeout_ms) {
+        deadline = peerstate->active_tick + timer_wheel_ticks(&wheel, idle_timeout_ms) + 1;
+    }
+    if (stall_timeout_ms && peerstate->write_wait_tick != TICK_NONE) {
+        uint64_t stall = peerstate->write_wait_tick + timer_wheel_ticks(&wheel, stall_timeout_ms) + 1;
+        if (stall < deadline) deadline = stall;
+    }
+    if (deadline == TICK_NONE) {
+        // 当前状态下没有适用的超时，过一会儿再来看一眼
+        unsigned longest = handshake_timeout_ms;
+        if (idle_timeout_ms > longest) longest = idle_timeout_ms;
+        if (stall_timeout_ms > longest) longest = stall_timeout_ms;
+        deadline = timer_wheel_now(&wheel) + timer_wheel_ticks(&wheel, longest);
+    }
+    return deadline;
+}
+
+// 定时器到期：活跃的连接按新的截止时间重新挂上 (懒更新)，真正超时的才关闭
+static void on_peer_timer(timer_node_t* node, void* arg) {
+    (void)arg;
+    peer_state_t* peerstate = (peer_state_t*)((char*)node - offsetof(peer_state_t, timer));
+    uint64_t deadline = peer_deadline(peerstate);
+    if (deadline > timer_wheel_now(&wheel)) {
+        timer_add(&wheel, node, deadline);
+        return;
+    }
+    log_debug("client timed out (%s)",
+              peerstate->write_wait_tick != TICK_NONE ? "write stall"
+              : peerstate->got_input ? "idle" : "handshake");
+    close_peer(peerstate);
+}
+
+void on_wheel_tick(uv_timer_t* handle) {
+    timer_wheel_advance(&wheel, uv_now(handle->loop), on_peer_timer, NULL);
+    if (wheel.count == 0) {
+        uv_timer_stop(handle);
+    }
+}
+
+// 新连接：记下接入时间，挂到时间轮上 (先按握手超时)
+void peer_timer_start(peer_state_t* peerstate) {
+    timer_node_init(&peerstate->timer);
+    if (!timeouts_enabled) return;
+    if (!uv_is_active((uv_handle_t*)&wheel_timer)) {
+        // 时间轮空闲期间没人推进时间，先追到现在，再让 uv_timer 每个 tick 响一次
+        timer_wheel_advance(&wheel, uv_now(wheel_timer.loop), on_peer_timer, NULL);
+        uv_timer_start(&wheel_timer, on_wheel_tick, TIMER_TICK_MS, TIMER_TICK_MS);
+    }
+    uint64_t now = timer_wheel_now(&wheel);
+    peerstate->got_input = 0;
+    peerstate->accepted_tick = now;
+    peerstate->active_tick = now;
+    peerstate->write_wait_tick = TICK_NONE;
+    timer_add(&wheel, &peerstate->timer, peer_deadline(peerstate));
+}
+
+// 把输出队列里的数据 (最多 MAX_WRITE_BUFS 段) 一次交给 uv_write
+// 同一时刻只有一个写请求在飞：新产生的回显先排在队列里，等这次写完再一起发
+void start_write(peer_state_t* peerstate, uv_write_cb cb) {
+    if (peerstate->inflight > 0 || peerstate->out.len == 0) {
+        return;
+    }
+
+    struct iovec iov[MAX_WRITE_BUFS];
+    uv_buf_t bufs[MAX_WRITE_BUFS];
+    int nbufs = outbuf_peek(&peerstate->out, iov, MAX_WRITE_BUFS);
+    for (int i = 0; i < nbufs; i++) {
+        bufs[i] = uv_buf_init(iov[i].iov_base, iov[i].iov_len);
+        peerstate->inflight += iov[i].iov_len;
+    }
+
+    // 开始等待对方收数据：写停滞超时从现在算起 (上一次写完时队列不空的话，保持原来的起点)
+    if (peerstate->write_wait_tick == TICK_NONE) {
+        peerstate->write_wait_tick = timer_wheel_now(&wheel);
+    }
+
+    uv_write_t *req = (uv_write_t*)xmalloc(sizeof(uv_write_t));
+    req->data = peerstate;
+    // uv_write 会复制 bufs 数组本身，数组放在栈上没问题；但 bufs 指向的数据要一直有效到回调
+    int rc;
+    if ((rc = uv_write(req, (uv_stream_t*)peerstate->client, bufs, nbufs, cb)) < 0) {
+        log_error("uv_write: %s", uv_strerror(rc));
+        peerstate->inflight = 0;
+        free(req);
+        close_peer(peerstate);
+    }
+}
+
+// 写请求完成：从队头丢掉已经写出去的数据
+// 返回 0 表示正常；写出错 (包括连接关闭时被取消) 返回 -1
+int finish_write(uv_write_t* req, int status) {
+    peer_state_t* peerstate = (peer_state_t*) req->data;
+    free(req);
+    if (status) {
+        if (status != UV_ECANCELED) {
+            log_error("Write error: %s", uv_strerror(status));
+            close_peer(peerstate);
+        }
+        return -1;
+    }
+    outbuf_consume(&peerstate->out, peerstate->inflight);
+    peerstate->inflight = 0;
+    // 写完一批：算作一次活动；队列里还有数据的话写停滞超时重新计时
+    peerstate->active_tick = timer_wheel_now(&wheel);
+    peerstate->write_wait_tick = peerstate->out.len > 0 ? peerstate->active_tick : TICK_NONE;
+    return 0;
+}
+
 void on_write(uv_write_t* req, int status) {
     if (status < 0) {
-        fprintf(stderr, "Write error %s\n", uv_err_name(status));
+        log_error("Write error %s", uv_err_name(status));
     }
     char *base = (char*) req->data;
     free(base);
@@ -78,10 +251,10 @@ void on_read(uv_stream_t *client, ssize_t nread, const uv_buf_t* buf) {
     }*/
 
     if (nread < 0) {
-        if (nread == UV_EOF) {
-            fprintf(stderr, "Read error %s\n", uv_err_name(nread));
+        if (nread != UV_EOF) {
+            log_error("Read error %s", uv_err_name(nread));
         }
-        uv_close((uv_handle_t*) client, NULL);
+        close_peer(peerstate);
         if (buf->base) {
             free(buf->base);
         }
@@ -91,66 +264,46 @@ void on_read(uv_stream_t *client, ssize_t nread, const uv_buf_t* buf) {
         if (buf->base) free(buf->base);
         return;
     }
-    // 状态机处理逻辑
-    for (int i = 0;i < nread; ++i) {
-
-        // 探针 2: 看看状态怎么变
-        //printf("DEBUG: Char='%c' State=%d -> ", buf->base[i], peerstate->state);
-        
-        switch (peerstate->state) {
-            case INITIAL_ACK:
-                // 理论上不会收到这个状态，因为我们在 on_peer_connected 就发了 '*' 并转为 WAIT_FOR_MSG
-                // 但如果客户端发得太快，可能会有问题吗？不会，因为我们还没有开始 uv_read_start
-                break;
-            case WAIT_FOR_MSG:
-                if (buf->base[i] == '^') {
-                    peerstate->state = IN_MSG;
-                }
-                break;
-            case IN_MSG:
-                if (buf->base[i] == '$') {
-                    peerstate->state = WAIT_FOR_MSG;
-                } else {
-                    if (peerstate->sendbuf_end >= SEND_BUF_SIZE) {
-                        fprintf(stderr, "Send buffer overflow\n");
-                        continue;
-                    }
-                    peerstate->sendbuf[peerstate->sendbuf_end++] = buf->base[i] + 1;
-                }
-                break;
-        }
+    // 只记一下时间 (懒更新)，不动时间轮
+    peerstate->got_input = 1;
+    peerstate->active_tick = timer_wheel_now(&wheel);
+
+    // 状态机处理逻辑 (见 protocol.c)，回显内容直接写进输出队列的尾段
+    // 尾段剩多少空间就喂多少输入 (输出不会比输入多)，写满了再挂新段
+    // 正在飞的写请求只引用了尾段里已提交的那部分，往后追加不会影响它
+    // INITIAL_ACK 不会出现在这里：on_peer_connected 发完 '*' 才开始 uv_read_start
+    size_t off = 0;
+    while (off < (size_t)nread) {
+        size_t avail;
+        char* out = outbuf_reserve(&peerstate->out, &avail);
+        size_t chunk = (size_t)nread - off < avail ? (size_t)nread - off : avail;
+        outbuf_commit(&peerstate->out, protocol_process(&peerstate->state, buf->base + off, chunk, out, NULL));
+        off += chunk;
     }
-    if (peerstate->sendbuf_end > 0) {
-        // 探针 3: 看看是不是要发送了
-        //printf("DEBUG: Sending %d bytes...\n", peerstate->sendbuf_end);
-
-        uv_buf_t writebuf = uv_buf_init(peerstate->sendbuf, peerstate->sendbuf_end);
-        uv_write_t *req = (uv_write_t*)xmalloc(sizeof(uv_write_t));
-        req->data = peerstate;
+    if (buf->base) free(buf->base);
 
-        if (uv_write(req, client, &writebuf, 1, on_wrote_buf) < 0) {
-            die("uv_write failed");
-        }
+    // 探针 3: 看看是不是要发送了
+    //printf("DEBUG: Sending %zu bytes...\n", peerstate->out.len);
+    start_write(peerstate, on_wrote_buf);
 
-        // 暂停读取 (Stop Reading)
-        // 我现在要去发数据了，Buffer 被占用了。
-        // 在发完之前 (on_wrote_buf 被调用之前)，别再给我塞新数据了！
+    // 背压 (Backpressure)：客户端只发不收时，输出队列会越堆越长
+    // 超过高水位就暂停读取，等 on_wrote_buf 把队列发到低水位以下再恢复
+    // (以前是每次写都 uv_read_stop，读写完全串行；现在只有真的堆积时才停)
+    if (!peerstate->read_paused && peerstate->out.len >= OUTBUF_HIGH_WATER) {
+        peerstate->read_paused = 1;
         uv_read_stop(client);
     }
-    if (buf->base) free(buf->base);
 }
 
 void on_wrote_init_ack(uv_write_t* req, int status) {
-    if (status) {
-        die("on_wrote_init_ack: %s", uv_err_name(status));
-    }
-
     // req->data 里存的是 peerstate
     peer_state_t *peerstate = (peer_state_t*) req->data;
+    if (finish_write(req, status) < 0) {
+        return;
+    }
 
     // 注意：这里把 peerstate->client 转成 uv_stream_t*
     uv_read_start((uv_stream_t*)peerstate->client, alloc_buffer, on_read);
-    free(req);
 }
 /*0 .
 
@@ -181,10 +334,22 @@ void on_peer_connected(uv_stream_t* server_stream, int status) {
 
 void on_peer_connected(uv_stream_t* server_stream, int status) {
     if (status < 0) {
-        fprintf(stderr, "Peer connection error: %s\n", uv_strerror(status));
+        log_error("Peer connection error: %s", uv_strerror(status));
+        return;
+    }
+    // 准入控制：名额用完时不调用 uv_accept。libuv 发现回调里没有 accept，会自己把监听 Socket
+    // 从 epoll 里拿掉 (uv__io_stop)，直到下一次 uv_accept 才重新监听，新连接就在内核的监听队列里排队。
+    // (fd 用完的情况 libuv 内部已经用备用 fd 处理了：accept 出来立刻关掉，和 utils.c 的 accept_shed 一样)
+    if (!conn_acquire(1)) {
+        deferred_server = server_stream;
+        log_debug("connection limit %d reached, accept paused", conn_limit_max());
         return;
     }
+    accept_peer(server_stream);
+}
 
+// 已经占好名额，接下 libuv 手上的那个连接
+void accept_peer(uv_stream_t* server_stream) {
     uv_tcp_t* client = (uv_tcp_t*)xmalloc(sizeof(uv_tcp_t));
     uv_tcp_init(uv_default_loop(), client);
 
@@ -192,61 +357,84 @@ void on_peer_connected(uv_stream_t* server_stream, int status) {
     client->data = NULL;
 
     if(uv_accept(server_stream, (uv_stream_t*)client) == 0) {
-        printf("New client accepted!\n");
+        // libuv 内部已经是 accept4(SOCK_NONBLOCK|SOCK_CLOEXEC) 循环取到 EAGAIN，这里只需别每个连接都 printf
+        log_debug("New client accepted!");
 
         // 初始化 Peer State (协议状态)
         peer_state_t* peerstate = (peer_state_t*)xmalloc(sizeof(peer_state_t));
         // 发送完 '*' 后，状态直接变为 WAIT_FOR_MSG，等待客户端发 '^'
         peerstate->state = WAIT_FOR_MSG; 
-        peerstate->sendbuf[0] = '*';
-        peerstate->sendbuf_end = 1;
+        outbuf_init(&peerstate->out);
+        outbuf_append(&peerstate->out, "*", 1);
+        peerstate->inflight = 0;
+        peerstate->read_paused = 0;
         peerstate->client = client;// 反向引用
+        peer_timer_start(peerstate);
         // 把 state 挂载到 client 上，方便以后随时取用
         // 上下文传递，Libuv 只会把 client (那个 uv_tcp_t* 指针) 传出来
         // on_read 被调用时，无法确定client是哪一个客户端，以及状态
         // client->data把任何关于这个客户端的信息 （比如 peer_state_t ）塞进去
         client->data = peerstate;
 
-        uv_buf_t write_buf = uv_buf_init(peerstate->sendbuf, peerstate->sendbuf_end);
-        uv_write_t *req = (uv_write_t*)xmalloc(sizeof(uv_write_t));
-        req->data = peerstate;
-
-        int rc;
-        if ((rc = uv_write(req, (uv_stream_t*)client, &write_buf, 1, on_wrote_init_ack)) < 0) {
-            die("uv_write: %s", uv_strerror(rc));
-        }
+        start_write(peerstate, on_wrote_init_ack);
     } else {
-        uv_close((uv_handle_t*)client, NULL);
+        uv_close((uv_handle_t*)client, on_client_closed);
     }
 }
 
 void on_wrote_buf(uv_write_t* req, int status) {
-    if (status) {
-        die("Write error: %s\n", uv_strerror(status));
-    }
     // 拿出上下文
     peer_state_t* peerstate = (peer_state_t*) req->data;
-    // 关键点 1：重置 Buffer 指针
-    // 因为写完了，Buffer 空了，下次可以从头开始写了
-    peerstate->sendbuf_end = 0;
-    // 关键点 2：重新开始读取 (Resume Reading)
-    // 之前为了保护 Buffer，我们暂停了读取，现在可以继续了
-    uv_read_start((uv_stream_t*)peerstate->client, alloc_buffer, on_read);
-    // 释放请求对象 (注意：peerstate 不能释放)
-    free(req);
+    // 关键点 1：把写完的数据从队头丢掉，发完的缓冲段回收 (同时释放请求对象，peerstate 不能释放)
+    if (finish_write(req, status) < 0) {
+        return;
+    }
+    // 关键点 2：这次写的过程中又攒下的回显，接着发
+    start_write(peerstate, on_wrote_buf);
+    // 关键点 3：背压解除，重新开始读取 (Resume Reading)
+    if (peerstate->read_paused && peerstate->out.len <= OUTBUF_LOW_WATER) {
+        peerstate->read_paused = 0;
+        uv_read_start((uv_stream_t*)peerstate->client, alloc_buffer, on_read);
+    }
 }
 
 int main(int argc, char **argv) {
 
     int portnum = DEFAULT_PORT;
-    if (argc > 2) {
-        portnum = atoi(argv[1]);
+    int log_level = LOG_LEVEL_INFO;
+    int max_conns = 0;
+    // 用法：libuv_server [port] [-v] [-T h,i,w] [-C N]
+    //   -v 打开 DEBUG 日志 (记录每个新连接)
+    //   -C 最多同时接受 N 个连接，满了就先不 accept (默认按 ulimit -n 计算)
+    //   -T 连接超时 (秒)：握手 h、空闲 i、写停滞 w，0 表示不限制 (默认 10,120,30)
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-v") == 0) {
+            log_level = LOG_LEVEL_DEBUG;
+        } else if (strcmp(argv[i], "-T") == 0 && i + 1 < argc) {
+            int h, idle, w;
+            if (sscanf(argv[++i], "%d,%d,%d", &h, &idle, &w) != 3 || h < 0 || idle < 0 || w < 0) {
+                die("usage: %s [port] [-v] [-T handshake,idle,stall]", argv[0]);
+            }
+            handshake_timeout_ms = (unsigned)h * 1000;
+            idle_timeout_ms = (unsigned)idle * 1000;
+            stall_timeout_ms = (unsigned)w * 1000;
+        } else if (strcmp(argv[i], "-C") == 0 && i + 1 < argc) {
+            max_conns = atoi(argv[++i]);
+        } else {
+            portnum = atoi(argv[i]);
+        }
     }
     printf("Serving on port %d\n", portnum);
+    log_init(log_level, STDERR_FILENO);
+    conn_limit_init(max_conns);
 
     int rc; // 用于接收返回值 (return code)
     uv_tcp_t server_stream; // 用于存储服务器的 TCP 句柄;
 
+    timeouts_enabled = handshake_timeout_ms || idle_timeout_ms || stall_timeout_ms;
+    timer_wheel_init(&wheel, TIMER_TICK_MS, uv_now(uv_default_loop()));
+    uv_timer_init(uv_default_loop(), &wheel_timer);
+
     // TODO: 1. Initialize TCP handle (uv_tcp_init)
     if ((rc = uv_tcp_init(uv_default_loop(), &server_stream))) {
         die("uv_tcp_init: %s", uv_strerror(rc));
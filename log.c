@@ -0,0 +1,332 @@
+#define _GNU_SOURCE
+#include "log.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+// 每个线程的环能放多少条记录 (必须是 2 的幂)；一条 256 字节，一个环 64KB
+#define LOG_RING_SIZE 256
+// 一条消息正文最多多长 (超出截断)，凑成 256 字节的记录
+#define LOG_MSG_MAX 240
+// 刷盘线程攒够这么多字节就 write 一次
+#define LOG_FLUSH_BUF (64 * 1024)
+// 所有环都空的时候刷盘线程睡多久
+#define LOG_IDLE_SLEEP_MS 5
+// 至少隔多少秒汇报一次丢弃 / 限流计数
+#define LOG_REPORT_INTERVAL_SEC 5
+
+typedef struct {
+    uint64_t ts_ns;  // CLOCK_REALTIME，纳秒
+    int32_t tid;
+    uint16_t level;
+    uint16_t len;
+    char msg[LOG_MSG_MAX];
+} log_record_t;
+
+// 单生产者 (所属线程) / 单消费者 (刷盘线程) 环形缓冲区
+// head 只由生产者写，tail 只由消费者写，分别放在不同的缓存行上，互相不会伪共享
+typedef struct log_ring {
+    _Atomic uint32_t head __attribute__((aligned(64)));
+    int32_t tid;
+    uint32_t rate_window;  // 限流窗口 (当前秒)
+    uint32_t rate_count;   // 这一秒已经写了多少条
+
+    _Atomic uint32_t tail __attribute__((aligned(64)));
+
+    // 丢弃计数：生产者累加，刷盘线程读取
+    _Atomic unsigned long dropped __attribute__((aligned(64)));
+    _Atomic unsigned long limited;
+    // 线程退出后环不释放，置 0 留给下一个新线程复用 (环的个数只和同时在写日志的线程数有关)
+    atomic_int in_use;
+    struct log_ring* next;  // 全局链表，只增不减，next 在挂上去之后不再修改
+
+    log_record_t records[LOG_RING_SIZE];
+} log_ring_t;
+
+int log_min_level = LOG_LEVEL_OFF;
+
+static int log_fd = STDERR_FILENO;
+static int rate_limit = 1000;
+static long utc_offset_sec = 0;
+
+static _Atomic(log_ring_t*) rings = NULL;
+static __thread log_ring_t* my_ring = NULL;
+static pthread_key_t ring_key;
+
+static int started = 0;
+static atomic_int stopping = 0;
+static pthread_t flusher;
+
+static const char* level_names[] = {"DEBUG", "INFO ", "WARN ", "ERROR"};
+
+// 线程退出时 (pthread_key 析构) 把环交还出去；里面还没刷的记录刷盘线程照样会取走
+static void ring_release(void* arg) {
+    log_ring_t* r = arg;
+    atomic_store_explicit(&r->in_use, 0, memory_order_release);
+}
+
+static log_ring_t* ring_acquire(void) {
+    log_ring_t* r;
+    for (r = atomic_load_explicit(&rings, memory_order_acquire); r; r = r->next) {
+        int expected = 0;
+        if (atomic_compare_exchange_strong(&r->in_use, &expected, 1)) {
+            break;
+        }
+    }
+    if (!r) {
+        void* mem;
+        if (posix_memalign(&mem, 64, sizeof(log_ring_t)) != 0) {
+            die("posix_memalign log ring failed");
+        }
+        memset(mem, 0, sizeof(log_ring_t));
+        r = mem;
+        atomic_store(&r->in_use, 1);
+        // 无锁头插：只有刷盘线程遍历，且节点永不摘除，所以不存在 ABA
+        r->next = atomic_load_explicit(&rings, memory_order_relaxed);
+        while (!atomic_compare_exchange_weak_explicit(&rings, &r->next, r,
+                                                      memory_order_release, memory_order_relaxed)) {
+        }
+    }
+    r->tid = (int32_t)syscall(SYS_gettid);
+    r->rate_window = 0;
+    r->rate_count = 0;
+    pthread_setspecific(ring_key, r);
+    my_ring = r;
+    return r;
+}
+
+void log_write(int level, const char* fmt, ...) {
+    // %m 要用调用者的 errno，而且写日志本身不能改掉它 (调用者后面可能还要判断)
+    int saved_errno = errno;
+    log_ring_t* r = my_ring;
+    if (!r) {
+        r = ring_acquire();
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    if (rate_limit > 0) {
+        if ((uint32_t)ts.tv_sec != r->rate_window) {
+            r->rate_window = (uint32_t)ts.tv_sec;
+            r->rate_count = 0;
+        }
+        if (++r->rate_count > (uint32_t)rate_limit) {
+            atomic_fetch_add_explicit(&r->limited, 1, memory_order_relaxed);
+            errno = saved_errno;
+            return;
+        }
+    }
+
+    uint32_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+    if (head - tail == LOG_RING_SIZE) {
+        // 环满了：刷盘线程跟不上，宁可丢日志也不能让事件循环等
+        atomic_fetch_add_explicit(&r->dropped, 1, memory_order_relaxed);
+        errno = saved_errno;
+        return;
+    }
+
+    log_record_t* rec = &r->records[head & (LOG_RING_SIZE - 1)];
+    rec->ts_ns = (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+    rec->tid = r->tid;
+    rec->level = (uint16_t)level;
+
+    va_list args;
+    va_start(args, fmt);
+    errno = saved_errno;
+    int n = vsnprintf(rec->msg, LOG_MSG_MAX, fmt, args);
+    va_end(args);
+    if (n < 0) {
+        n = 0;
+    } else if (n >= LOG_MSG_MAX) {
+        n = LOG_MSG_MAX - 1;
+    }
+    rec->len = (uint16_t)n;
+
+    // release：刷盘线程看到新的 head 时，记录内容一定已经写完了
+    atomic_store_explicit(&r->head, head + 1, memory_order_release);
+    errno = saved_errno;
+}
+
+static void write_all(const char* buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(log_fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return;  // 日志写不出去也没有别的地方可以报告了
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+}
+
+// 把时间戳格式化成 "2026-01-02 03:04:05.123456"
+// 不用 localtime_r：它内部要加时区锁，fork 时如果刷盘线程正好拿着这把锁，子进程就会死锁。
+// 时区偏移在 log_init 时取一次 (不跟随夏令时切换)，这里按公历纯算术换算。
+static int format_time(char* out, size_t size, uint64_t ts_ns) {
+    long long secs = (long long)(ts_ns / 1000000000ull) + utc_offset_sec;
+    long usec = (long)(ts_ns % 1000000000ull / 1000);
+    long long days = secs / 86400;
+    long sod = (long)(secs % 86400);
+
+    // civil_from_days (Howard Hinnant)
+    days += 719468;
+    long long era = days / 146097;
+    long doe = (long)(days - era * 146097);
+    long yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    long doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    long mp = (5 * doy + 2) / 153;
+    long day = doy - (153 * mp + 2) / 5 + 1;
+    long month = mp < 10 ? mp + 3 : mp - 9;
+    long long year = yoe + era * 400 + (month <= 2);
+
+    return snprintf(out, size, "%04lld-%02ld-%02ld %02ld:%02ld:%02ld.%06ld",
+                    year, month, day, sod / 3600, sod / 60 % 60, sod % 60, usec);
+}
+
+// 把所有环里现有的记录取出来写掉，返回取出的条数
+static size_t drain_rings(char* buf) {
+    size_t used = 0, nrecords = 0;
+    for (log_ring_t* r = atomic_load_explicit(&rings, memory_order_acquire); r; r = r->next) {
+        uint32_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+        uint32_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+        for (; tail != head; tail++) {
+            // 一行最长：时间 26 + 级别 5 + tid + 正文 + 若干分隔符，留足 LOG_MSG_MAX + 64
+            if (LOG_FLUSH_BUF - used < LOG_MSG_MAX + 64) {
+                write_all(buf, used);
+                used = 0;
+            }
+            const log_record_t* rec = &r->records[tail & (LOG_RING_SIZE - 1)];
+            used += format_time(buf + used, LOG_FLUSH_BUF - used, rec->ts_ns);
+            used += snprintf(buf + used, LOG_FLUSH_BUF - used, " %s [%d] ",
+                             level_names[rec->level], rec->tid);
+            memcpy(buf + used, rec->msg, rec->len);
+            used += rec->len;
+            buf[used++] = '\n';
+            nrecords++;
+        }
+        // 记录已经拷出来了，槽位可以还给生产者
+        atomic_store_explicit(&r->tail, tail, memory_order_release);
+    }
+    if (used > 0) {
+        write_all(buf, used);
+    }
+    return nrecords;
+}
+
+// 汇报自上次以来丢掉 / 限流掉的条数
+static void report_drops(unsigned long* last_dropped, unsigned long* last_limited) {
+    unsigned long dropped = 0, limited = 0;
+    for (log_ring_t* r = atomic_load_explicit(&rings, memory_order_acquire); r; r = r->next) {
+        dropped += atomic_load_explicit(&r->dropped, memory_order_relaxed);
+        limited += atomic_load_explicit(&r->limited, memory_order_relaxed);
+    }
+    if (dropped != *last_dropped || limited != *last_limited) {
+        char line[128];
+        int n = snprintf(line, sizeof(line), "log: %lu records dropped (ring full), %lu suppressed (rate limit)\n",
+                         dropped - *last_dropped, limited - *last_limited);
+        write_all(line, (size_t)n);
+        *last_dropped = dropped;
+        *last_limited = limited;
+    }
+}
+
+static void* flusher_main(void* arg) {
+    (void)arg;
+    char* buf = xmalloc(LOG_FLUSH_BUF);
+    unsigned long last_dropped = 0, last_limited = 0;
+    time_t last_report = time(NULL);
+
+    for (;;) {
+        // 先读 stopping 再取：看到停止标志之后还会完整地再取一遍，停止前写进来的记录不会漏
+        int stop = atomic_load(&stopping);
+        size_t n = drain_rings(buf);
+
+        time_t now = time(NULL);
+        if (stop || now - last_report >= LOG_REPORT_INTERVAL_SEC) {
+            report_drops(&last_dropped, &last_limited);
+            last_report = now;
+        }
+        if (stop) {
+            break;
+        }
+        if (n == 0) {
+            struct timespec idle = {0, LOG_IDLE_SLEEP_MS * 1000000L};
+            nanosleep(&idle, NULL);
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+static void start_flusher(void) {
+    atomic_store(&stopping, 0);
+    int rc = pthread_create(&flusher, NULL, flusher_main, NULL);
+    if (rc != 0) {
+        errno = rc;
+        perror_die("pthread_create log flusher");
+    }
+}
+
+// fork 之后子进程里只剩调用 fork 的那个线程，刷盘线程没了，要重新起一个
+// 环里拷过来的记录由父进程负责写，子进程直接丢掉；其他线程的环在子进程里已经没有主人了
+static void after_fork_child(void) {
+    if (!started) return;
+    for (log_ring_t* r = atomic_load(&rings); r; r = r->next) {
+        atomic_store(&r->tail, atomic_load(&r->head));
+        if (r != my_ring) {
+            atomic_store(&r->in_use, 0);
+        }
+    }
+    if (my_ring) {
+        my_ring->tid = (int32_t)syscall(SYS_gettid);
+    }
+    start_flusher();
+}
+
+void log_init(int level, int fd) {
+    if (!started) {
+        started = 1;
+        log_fd = fd;
+
+        time_t now = time(NULL);
+        struct tm tm;
+        localtime_r(&now, &tm);
+        utc_offset_sec = tm.tm_gmtoff;
+
+        if (pthread_key_create(&ring_key, ring_release) != 0) {
+            die("pthread_key_create failed");
+        }
+        pthread_atfork(NULL, NULL, after_fork_child);
+        start_flusher();
+        atexit(log_shutdown);
+    }
+    log_min_level = level;
+}
+
+void log_set_level(int level) {
+    log_min_level = level;
+}
+
+void log_set_rate_limit(int per_sec) {
+    rate_limit = per_sec;
+}
+
+void log_shutdown(void) {
+    if (!started || atomic_exchange(&stopping, 1)) {
+        return;
+    }
+    pthread_join(flusher, NULL);
+    log_min_level = LOG_LEVEL_OFF;
+}
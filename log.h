@@ -0,0 +1,56 @@
+#ifndef LOG_H
+#define LOG_H
+
+// 异步日志 (给 I/O 线程用的 printf / perror 替代品)
+//
+// 调用线程只做一件事：把一条定长记录 (时间戳 + 级别 + 格式化好的消息) 放进自己线程的 SPSC 环形缓冲区，
+// 不加锁、不做系统调用；后台线程定期把所有环里的记录取出来，拼上时间和级别前缀，攒成一大块再 write 一次。
+//   - 环满了就丢弃并计数，绝不阻塞事件循环；
+//   - 每个线程每秒最多写 N 条 (log_set_rate_limit，默认 1000)，超出的同样只计数；
+//   - 丢弃 / 限流的条数由后台线程定期汇报一行。
+// 级别低于当前阈值时，宏展开后只剩一次比较 (一个可预测的分支)，参数都不会被求值。
+// 同一线程的日志保持顺序；不同线程之间按刷盘线程轮询环的顺序输出，不保证严格按时间排序。
+//
+// 用法：log_init(LOG_LEVEL_INFO, STDERR_FILENO) 之后用 log_info("peer %s connected", host)。
+// 格式串支持 glibc 的 %m (等价于 strerror(errno))，可以直接替代 perror。
+
+typedef enum {
+    LOG_LEVEL_DEBUG,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_ERROR,
+    LOG_LEVEL_OFF
+} log_level_t;
+
+// 当前阈值。log_init 之前是 LOG_LEVEL_OFF，所有日志宏都是空操作
+extern int log_min_level;
+
+#define log_enabled(level) __builtin_expect((level) >= log_min_level, 0)
+
+#define log_at(level, ...)                     \
+    do {                                       \
+        if (log_enabled(level)) {              \
+            log_write((level), __VA_ARGS__);   \
+        }                                      \
+    } while (0)
+
+#define log_debug(...) log_at(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define log_info(...)  log_at(LOG_LEVEL_INFO, __VA_ARGS__)
+#define log_warn(...)  log_at(LOG_LEVEL_WARN, __VA_ARGS__)
+#define log_error(...) log_at(LOG_LEVEL_ERROR, __VA_ARGS__)
+
+// 启动后台刷盘线程，之后级别 >= level 的日志写到 fd；重复调用只会修改级别
+// 进程正常退出 (exit / 从 main 返回) 时会自动把剩下的日志刷出去
+void log_init(int level, int fd);
+void log_set_level(int level);
+
+// 每个线程每秒最多写多少条，0 表示不限 (默认 1000)
+void log_set_rate_limit(int per_sec);
+
+// 别直接调用，用上面的宏 (宏里已经判断过级别了)
+void log_write(int level, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+
+// 停掉后台线程并把环里剩下的记录全部写出去
+void log_shutdown(void);
+
+#endif
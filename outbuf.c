@@ -0,0 +1,265 @@
+#include "outbuf.h"
+#include "utils.h"
+#include "log.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+
+// 一次 writev 最多带多少段 (64 段 = 256KB，远小于 IOV_MAX)
+#define OUTBUF_MAX_IOV 64
+// 每个线程的缓冲段池里最多缓存多少个空闲段 (4MB)，多出来的直接还给系统
+#define OUTBUF_POOL_MAX 1024
+
+// 缓冲段池：每个线程一份 (__thread)，分配和回收都不需要加锁
+// 在一个线程里分配、在另一个线程里释放 (Leader/Follower) 也没关系，只是换了个池子而已
+static __thread outbuf_seg_t* seg_pool = NULL;
+static __thread int seg_pool_count = 0;
+
+static outbuf_seg_t* seg_alloc(void) {
+    outbuf_seg_t* seg = seg_pool;
+    if (seg) {
+        seg_pool = seg->next;
+        seg_pool_count--;
+    } else {
+        seg = xmalloc(sizeof(outbuf_seg_t));
+    }
+    seg->next = NULL;
+    seg->start = 0;
+    seg->end = 0;
+    seg->zc_used = 0;
+    return seg;
+}
+
+static void seg_release(outbuf_seg_t* seg) {
+    if (seg_pool_count >= OUTBUF_POOL_MAX) {
+        free(seg);
+        return;
+    }
+    seg->next = seg_pool;
+    seg_pool = seg;
+    seg_pool_count++;
+}
+
+void outbuf_init(outbuf_t* ob) {
+    ob->head = NULL;
+    ob->tail = NULL;
+    ob->len = 0;
+    ob->zc_threshold = 0;
+    ob->zc_head = NULL;
+    ob->zc_tail = NULL;
+    ob->zc_held = 0;
+    ob->zc_next = 0;
+    ob->zc_done = 0;
+    ob->zc_early = 0;
+}
+
+static void seg_release_list(outbuf_seg_t* seg) {
+    while (seg) {
+        outbuf_seg_t* next = seg->next;
+        seg_release(seg);
+        seg = next;
+    }
+}
+
+void outbuf_free(outbuf_t* ob) {
+    seg_release_list(ob->head);
+    seg_release_list(ob->zc_head);
+    outbuf_init(ob);
+}
+
+// 序号为 id 的 zerocopy 发送是否已经完成 (序号是 32 位计数器，按回绕比较)
+static inline int zc_completed(const outbuf_t* ob, uint32_t id) {
+    return (int32_t)(id - ob->zc_done) < 0;
+}
+
+// 发完的段：内核可能还引用着它 (zerocopy 发送还没完成) 就先挂到 zc 链表上，否则直接回收
+static void seg_retire(outbuf_t* ob, outbuf_seg_t* seg) {
+    if (!seg->zc_used || zc_completed(ob, seg->zc_id)) {
+        seg_release(seg);
+        return;
+    }
+    seg->next = NULL;
+    if (ob->zc_tail) {
+        ob->zc_tail->next = seg;
+    } else {
+        ob->zc_head = seg;
+    }
+    ob->zc_tail = seg;
+    ob->zc_held += OUTBUF_SEG_SIZE;
+}
+
+char* outbuf_reserve(outbuf_t* ob, size_t* avail) {
+    // 尾段写满了 (或者队列是空的)，挂一个新段
+    if (ob->tail == NULL || ob->tail->end == OUTBUF_SEG_SIZE) {
+        outbuf_seg_t* seg = seg_alloc();
+        if (ob->tail) {
+            ob->tail->next = seg;
+        } else {
+            ob->head = seg;
+        }
+        ob->tail = seg;
+    }
+    *avail = OUTBUF_SEG_SIZE - ob->tail->end;
+    return ob->tail->data + ob->tail->end;
+}
+
+void outbuf_commit(outbuf_t* ob, size_t n) {
+    ob->tail->end += (int)n;
+    ob->len += n;
+    // reserve 了却什么也没写 (比如整段输入都在等 '^')，而队列本来就是空的：把刚挂上的段还回去
+    if (ob->len == 0) {
+        seg_release(ob->tail);
+        ob->head = NULL;
+        ob->tail = NULL;
+    }
+}
+
+void outbuf_append(outbuf_t* ob, const char* data, size_t n) {
+    while (n > 0) {
+        size_t avail;
+        char* dst = outbuf_reserve(ob, &avail);
+        size_t chunk = n < avail ? n : avail;
+        memcpy(dst, data, chunk);
+        outbuf_commit(ob, chunk);
+        data += chunk;
+        n -= chunk;
+    }
+}
+
+int outbuf_peek(const outbuf_t* ob, struct iovec* iov, int max_iov) {
+    int n = 0;
+    for (outbuf_seg_t* seg = ob->head; seg && n < max_iov; seg = seg->next) {
+        if (seg->end == seg->start) continue;
+        iov[n].iov_base = seg->data + seg->start;
+        iov[n].iov_len = seg->end - seg->start;
+        n++;
+    }
+    return n;
+}
+
+void outbuf_consume(outbuf_t* ob, size_t n) {
+    if (n > ob->len) n = ob->len;
+    ob->len -= n;
+    while (n > 0 && ob->head) {
+        outbuf_seg_t* seg = ob->head;
+        size_t in_seg = seg->end - seg->start;
+        if (n < in_seg) {
+            seg->start += (int)n;
+            return;
+        }
+        n -= in_seg;
+        // 已经发完的段整段回收；队列空了连尾段也还回去，空闲连接不占任何缓冲段
+        ob->head = seg->next;
+        if (seg == ob->tail) {
+            ob->tail = NULL;
+        }
+        seg_retire(ob, seg);
+    }
+}
+
+// 一次 zerocopy 发送带走了队头 n 个字节：给涉及到的段 (最后一段可能只发了一部分) 记上这次的序号
+static void zc_mark_sent(outbuf_t* ob, size_t n) {
+    for (outbuf_seg_t* seg = ob->head; seg && n > 0; seg = seg->next) {
+        size_t in_seg = seg->end - seg->start;
+        if (in_seg == 0) continue;
+        seg->zc_used = 1;
+        seg->zc_id = ob->zc_next;
+        n -= n < in_seg ? n : in_seg;
+    }
+    ob->zc_next++;
+}
+
+ssize_t outbuf_writev(outbuf_t* ob, int fd) {
+    struct iovec iov[OUTBUF_MAX_IOV];
+    int niov = outbuf_peek(ob, iov, OUTBUF_MAX_IOV);
+    if (niov == 0) return 0;
+
+    int zerocopy = ob->zc_threshold && ob->len >= ob->zc_threshold &&
+                   ob->zc_next - ob->zc_done < OUTBUF_ZC_WINDOW && ob->zc_held < OUTBUF_ZC_MAX_HELD;
+
+    // 用 sendmsg 代替 writev，只是为了能带 MSG_NOSIGNAL (对端关闭时返回 EPIPE 而不是触发 SIGPIPE)
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = niov;
+    ssize_t sent = sendmsg(fd, &msg, MSG_NOSIGNAL | (zerocopy ? MSG_ZEROCOPY : 0));
+    if (sent < 0 && zerocopy && errno == ENOBUFS) {
+        // 锁住的页超过了 RLIMIT_MEMLOCK / optmem_max：这一次退回普通拷贝
+        zerocopy = 0;
+        sent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    }
+    if (sent > 0) {
+        // 内核只给真正发出了数据的调用分配序号 (失败的调用会把序号退回去)
+        if (zerocopy) zc_mark_sent(ob, (size_t)sent);
+        outbuf_consume(ob, (size_t)sent);
+    }
+    return sent;
+}
+
+int outbuf_enable_zerocopy(outbuf_t* ob, int fd, size_t threshold) {
+    int one = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) < 0) {
+        return -1;
+    }
+    ob->zc_threshold = threshold;
+    return 0;
+}
+
+// 序号为 id 的发送完成了：先记在 zc_early 里，从 zc_done 开始连续完成的部分再往前推
+static void zc_mark_done(outbuf_t* ob, uint32_t id) {
+    uint32_t d = id - ob->zc_done;
+    if (d >= OUTBUF_ZC_WINDOW) return;  // 窗口外 (重复的通知)，不可能是还在等的发送
+    ob->zc_early |= 1ull << d;
+    while (ob->zc_early & 1) {
+        ob->zc_early >>= 1;
+        ob->zc_done++;
+    }
+}
+
+int outbuf_zerocopy_complete(outbuf_t* ob, int fd) {
+    int n = 0;
+    while (1) {
+        char control[128];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(fd, &msg, MSG_ERRQUEUE) < 0) {
+            if (errno == EINTR) continue;
+            break;  // EAGAIN：错误队列读空了
+        }
+        for (struct cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+                !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)) {
+                continue;
+            }
+            struct sock_extended_err* serr = (struct sock_extended_err*)CMSG_DATA(cm);
+            if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY || serr->ee_errno != 0) continue;
+            // 一条通知覆盖一段连续的序号 [ee_info, ee_data] (内核会把相邻的完成合并起来)
+            for (uint32_t id = serr->ee_info;; id++) {
+                zc_mark_done(ob, id);
+                if (id == serr->ee_data) break;
+            }
+            if ((serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) && ob->zc_threshold) {
+                // 数据最后还是被拷贝了一次，zerocopy 只剩下锁页和通知的开销：这个连接退回普通发送
+                log_debug("fd %d: MSG_ZEROCOPY fell back to copying, disabled for this connection", fd);
+                ob->zc_threshold = 0;
+            }
+            n++;
+        }
+    }
+
+    // 按发送顺序回收已经完成的段
+    while (ob->zc_head && zc_completed(ob, ob->zc_head->zc_id)) {
+        outbuf_seg_t* seg = ob->zc_head;
+        ob->zc_head = seg->next;
+        if (ob->zc_head == NULL) ob->zc_tail = NULL;
+        ob->zc_held -= OUTBUF_SEG_SIZE;
+        seg_release(seg);
+    }
+    return n;
+}
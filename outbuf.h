@@ -0,0 +1,85 @@
+#ifndef OUTBUF_H
+#define OUTBUF_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+// 每个连接的输出队列：由固定大小的缓冲段 (segment) 串成的链表
+// 以前的做法是一个 1024 字节的 buf_to_send：
+//   - 满了之后多出来的回显字节被直接丢掉，大消息会出错；
+//   - 每次部分发送都要 memmove 剩下的数据，大消息的总拷贝量是 O(n^2)。
+// 现在：写满一段就挂一段新的，发送时用一次 writev 把多段一起交给内核，
+// 发完的段整段回收到缓冲段池里，每个字节只被写入一次、发送一次，总代价 O(n)。
+
+#define OUTBUF_SEG_SIZE 4096
+
+// 背压 (Backpressure) 水位线：
+// 待发送数据超过高水位 -> 停止读这个连接 (客户端只发不收时，服务端内存不会无限增长)；
+// 降到低水位以下 -> 恢复读取。两条线拉开距离，避免在临界点来回抖动。
+#define OUTBUF_HIGH_WATER (64 * 1024)
+#define OUTBUF_LOW_WATER (16 * 1024)
+
+typedef struct outbuf_seg {
+    struct outbuf_seg* next;
+    int start;                    // 第一个未发送字节的位置
+    int end;                      // 已写入数据的末尾
+    int zc_used;                  // 是否用 MSG_ZEROCOPY 发过 (内核可能还引用着这块内存)
+    uint32_t zc_id;               // 引用它的最后一次 zerocopy 发送的序号
+    char data[OUTBUF_SEG_SIZE];
+} outbuf_seg_t;
+
+// MSG_ZEROCOPY：sendmsg 不再把数据拷进内核，而是直接锁住用户态的页，网卡发完 (TCP 收到 ACK) 后
+// 再通过 socket 的错误队列 (MSG_ERRQUEUE) 通知“第 lo..hi 次发送完成了”。
+// 在那之前这些段一个字节都不能改、也不能还给缓冲段池，所以发完的段先挂到 zc 链表上等通知。
+// 锁页、收通知本身也有开销，只有大块发送才划算 (内核文档的经验值是 10KB 以上)，由 zc_threshold 控制。
+// 等通知要等到对方 ACK (至少一个 RTT)，这期间不能停下来干等：同时等待通知的发送超过 OUTBUF_ZC_WINDOW 次，
+// 或者等通知的段超过 OUTBUF_ZC_MAX_HELD 字节，这一次就走普通拷贝，所以锁住的内存有上限，也不影响背压。
+#define OUTBUF_ZC_WINDOW 64
+#define OUTBUF_ZC_MAX_HELD (1024 * 1024)
+
+typedef struct {
+    outbuf_seg_t* head;           // 最早写入、最先发送的段
+    outbuf_seg_t* tail;           // 正在写入的段
+    size_t len;                   // 队列里待发送的总字节数
+
+    size_t zc_threshold;          // 待发送数据不少于这么多字节时用 MSG_ZEROCOPY 发，0 表示不用
+    outbuf_seg_t* zc_head;        // 已经发完、等内核完成通知的段 (按发送顺序)
+    outbuf_seg_t* zc_tail;
+    size_t zc_held;               // zc 链表占着的内存 (段数 * OUTBUF_SEG_SIZE)
+    uint32_t zc_next;             // 下一次 zerocopy 发送的序号 (和内核里每个 socket 的计数器一致)
+    uint32_t zc_done;             // 序号小于它的发送都已经完成
+    uint64_t zc_early;            // 乱序先到的完成通知：第 i 位对应序号 zc_done + i
+} outbuf_t;
+
+void outbuf_init(outbuf_t* ob);
+// 释放所有段，包括还在等 zerocopy 完成通知的段：调用者要保证内核已经不再需要它们 (见 epoll_server.c 的 free_client_state)
+void outbuf_free(outbuf_t* ob);
+
+// 写入：先 reserve 拿到尾部可写的连续空间，写完再 commit 实际写入的字节数
+char* outbuf_reserve(outbuf_t* ob, size_t* avail);
+void outbuf_commit(outbuf_t* ob, size_t n);
+void outbuf_append(outbuf_t* ob, const char* data, size_t n);
+
+// 读取：把队头的若干段填进 iovec 数组 (不移除)，返回填了几个
+int outbuf_peek(const outbuf_t* ob, struct iovec* iov, int max_iov);
+// 丢掉队头 n 个字节 (已经发出去了)，用空的段还给缓冲段池
+void outbuf_consume(outbuf_t* ob, size_t n);
+
+// 一次 writev 把队列里尽可能多的数据发出去；返回值同 writev (出错时 -1，errno 有效)
+// 开了 zerocopy 且待发送数据够多时带 MSG_ZEROCOPY
+ssize_t outbuf_writev(outbuf_t* ob, int fd);
+
+// 在 fd 上打开 SO_ZEROCOPY，之后不少于 threshold 字节的发送走 zerocopy；内核不支持时返回 -1
+int outbuf_enable_zerocopy(outbuf_t* ob, int fd, size_t threshold);
+// 读完 fd 错误队列里的完成通知，把内核不再引用的段还回缓冲段池，返回读到的通知数
+// 内核报告数据其实被拷贝了 (比如对端在本机，loopback 收包时总要拷一次) 时，这个连接以后不再用 zerocopy
+int outbuf_zerocopy_complete(outbuf_t* ob, int fd);
+
+// 还有没有发出去但内核没通知完成的 zerocopy 发送
+static inline int outbuf_zerocopy_busy(const outbuf_t* ob) {
+    return ob->zc_next != ob->zc_done;
+}
+
+#endif
@@ -0,0 +1,143 @@
+#include "protocol.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define PROTOCOL_HAVE_X86 1
+#include <immintrin.h>
+#endif
+
+// IN_MSG 内核：把 in 开头直到第一个 '$' (不含) 的字节 +1 写到 out，返回处理了多少字节
+// 如果整段都没有 '$'，返回 len
+typedef size_t (*in_msg_kernel_t)(const char* in, size_t len, char* out);
+
+static size_t in_msg_scalar(const char* in, size_t len, char* out) {
+    size_t i = 0;
+    for (; i < len; i++) {
+        if (in[i] == '$') break;
+        out[i] = in[i] + 1;
+    }
+    return i;
+}
+
+#ifdef PROTOCOL_HAVE_X86
+// SSE2：每次 16 字节
+// 先整块 +1 存出去，再看这一块里有没有 '$'：
+// 有的话只算前 n 个字节有效 (多写的那几个字节落在 out 后面还没用到的位置，下一次会被覆盖)
+// 因为 out 至少有 len 字节空间且 i + 16 <= len，这样“多写”永远不会越界
+__attribute__((target("sse2")))
+static size_t in_msg_sse2(const char* in, size_t len, char* out) {
+    const __m128i dollar = _mm_set1_epi8('$');
+    const __m128i one = _mm_set1_epi8(1);
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(in + i));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, dollar));
+        _mm_storeu_si128((__m128i*)(out + i), _mm_add_epi8(v, one));
+        if (mask) {
+            return i + (size_t)__builtin_ctz((unsigned)mask);
+        }
+    }
+    return i + in_msg_scalar(in + i, len - i, out + i);
+}
+
+// AVX2：每次 32 字节，逻辑同上
+__attribute__((target("avx2")))
+static size_t in_msg_avx2(const char* in, size_t len, char* out) {
+    const __m256i dollar = _mm256_set1_epi8('$');
+    const __m256i one = _mm256_set1_epi8(1);
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(in + i));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, dollar));
+        _mm256_storeu_si256((__m256i*)(out + i), _mm256_add_epi8(v, one));
+        if (mask) {
+            return i + (size_t)__builtin_ctz(mask);
+        }
+    }
+    // 剩下不足 32 字节的尾巴交给 SSE2 / 标量
+    return i + in_msg_sse2(in + i, len - i, out + i);
+}
+#endif
+
+static in_msg_kernel_t in_msg_kernel = in_msg_scalar;
+static const char* in_msg_kernel_name = "scalar";
+
+// 程序启动时 (main 之前) 通过 CPUID 选出最快的内核
+__attribute__((constructor))
+static void protocol_select_impl(void) {
+#ifdef PROTOCOL_HAVE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        in_msg_kernel = in_msg_avx2;
+        in_msg_kernel_name = "avx2";
+        return;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        in_msg_kernel = in_msg_sse2;
+        in_msg_kernel_name = "sse2";
+        return;
+    }
+#endif
+}
+
+const char* protocol_impl_name(void) {
+    return in_msg_kernel_name;
+}
+
+int protocol_set_impl(const char* name) {
+    if (strcmp(name, "scalar") == 0) {
+        in_msg_kernel = in_msg_scalar;
+        in_msg_kernel_name = "scalar";
+        return 0;
+    }
+#ifdef PROTOCOL_HAVE_X86
+    if (strcmp(name, "sse2") == 0 && __builtin_cpu_supports("sse2")) {
+        in_msg_kernel = in_msg_sse2;
+        in_msg_kernel_name = "sse2";
+        return 0;
+    }
+    if (strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2")) {
+        in_msg_kernel = in_msg_avx2;
+        in_msg_kernel_name = "avx2";
+        return 0;
+    }
+#endif
+    return -1;
+}
+
+size_t protocol_process(ProcessingState* state, const char* in, size_t len, char* out, size_t* msgs_done) {
+    ProcessingState st = *state;
+    size_t i = 0;
+    size_t produced = 0;
+    size_t msgs = 0;
+
+    // 客户端抢在 '*' 之前发来的数据，按 WAIT_FOR_MSG 处理
+    if (st == INITIAL_ACK) st = WAIT_FOR_MSG;
+
+    while (i < len) {
+        if (st == WAIT_FOR_MSG) {
+            const char* caret = memchr(in + i, '^', len - i);
+            if (caret == NULL) {
+                break; // 整段都不是消息内容，全部忽略
+            }
+            i = (size_t)(caret - in) + 1;
+            st = IN_MSG;
+        } else {
+            size_t n = in_msg_kernel(in + i, len - i, out + produced);
+            i += n;
+            produced += n;
+            if (i < len) {
+                // in[i] 就是 '$'：消息结束，'$' 本身不回显
+                i++;
+                st = WAIT_FOR_MSG;
+                msgs++;
+            }
+        }
+    }
+
+    *state = st;
+    if (msgs_done) *msgs_done += msgs;
+    return produced;
+}
@@ -0,0 +1,30 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stddef.h>
+
+// 所有服务器共用的协议状态机 (见 README 第 1 节)
+// 以前每个服务器各自复制一份逐字节的 switch；现在统一交给 protocol_process()，
+// 它一次处理一整段输入：
+//   - WAIT_FOR_MSG：用 memchr 跳到下一个 '^' (glibc 的 memchr 本身就是向量化的)；
+//   - IN_MSG：每次 16 (SSE2) / 32 (AVX2) 个字节一起找 '$'，同时把前面的字节整体 +1 写出去。
+// 具体用哪个内核在程序启动时通过 CPUID 选定，不支持的 CPU 退回逐字节的标量版本。
+
+typedef enum {
+    INITIAL_ACK,  // 初始连接，尚未发送欢迎字符 '*'
+    WAIT_FOR_MSG, // 等待消息开始符 '^'，在此状态下忽略所有其他输入
+    IN_MSG        // 正在接收消息，对收到的字符 +1 回显，直到收到结束符 '$'
+} ProcessingState;
+
+// 处理一段输入 in[0..len)，回显字节写到 out，返回写出的字节数
+// *state 会被更新为处理完这段输入后的状态；msgs_done 不为 NULL 时累加本段里结束的消息数 (遇到 '$')
+// 要求：out 至少有 len 字节空间 (输出永远不会比输入多)，且不能和 in 重叠 (向量内核会整块写 out)
+size_t protocol_process(ProcessingState* state, const char* in, size_t len, char* out, size_t* msgs_done);
+
+// 当前使用的 IN_MSG 内核名字："avx2" / "sse2" / "scalar"
+const char* protocol_impl_name(void);
+
+// 强制切换内核 (压测对比用)，CPU 不支持或名字不认识时返回 -1
+int protocol_set_impl(const char* name);
+
+#endif
@@ -0,0 +1,85 @@
+// 协议状态机微基准：对比 scalar / sse2 / avx2 三种 IN_MSG 内核的吞吐 (GB/s)
+// 编译：cc -O2 protocol_bench.c protocol.c utils.c log.c -o protocol_bench -pthread
+// 用法：./protocol_bench [每种尺寸处理的总字节数 MB，默认 256]
+//
+// 每条消息是 '^' + payload + '$'，payload 是随机可打印字符；
+// 一次 protocol_process 喂一整块 (和服务器里一次 recv 拿到的一段一样)，
+// 统计的是输入字节数 / 耗时。
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "protocol.h"
+#include "utils.h"
+
+static const size_t payload_sizes[] = {64, 256, 1024, 4096, 16384, 65536, 262144, 1048576};
+static const char* impls[] = {"scalar", "sse2", "avx2"};
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// 生成一块输入：若干条 payload 字节的消息首尾相接，块大小至少 64KB，避免调用开销淹没小消息
+static char* make_input(size_t payload, size_t* len_out) {
+    size_t msg_len = payload + 2;
+    size_t nmsgs = msg_len >= 65536 ? 1 : (65536 + msg_len - 1) / msg_len;
+    size_t len = nmsgs * msg_len;
+    char* in = xmalloc(len);
+    for (size_t m = 0; m < nmsgs; m++) {
+        char* p = in + m * msg_len;
+        p[0] = '^';
+        for (size_t k = 1; k <= payload; k++) {
+            p[k] = 'a' + rand() % 26;
+        }
+        p[msg_len - 1] = '$';
+    }
+    *len_out = len;
+    return in;
+}
+
+int main(int argc, char** argv) {
+    size_t total_mb = 256;
+    if (argc >= 2) {
+        total_mb = (size_t)atoi(argv[1]);
+    }
+    printf("default impl: %s, %zu MB per size\n", protocol_impl_name(), total_mb);
+    printf("%10s", "payload");
+    for (size_t i = 0; i < sizeof impls / sizeof impls[0]; i++) {
+        printf("%10s", impls[i]);
+    }
+    printf("   (GB/s)\n");
+
+    for (size_t s = 0; s < sizeof payload_sizes / sizeof payload_sizes[0]; s++) {
+        size_t len;
+        char* in = make_input(payload_sizes[s], &len);
+        char* out = xmalloc(len);
+        size_t rounds = total_mb * 1024 * 1024 / len;
+        if (rounds == 0) rounds = 1;
+
+        printf("%10zu", payload_sizes[s]);
+        for (size_t i = 0; i < sizeof impls / sizeof impls[0]; i++) {
+            if (protocol_set_impl(impls[i]) < 0) {
+                printf("%10s", "n/a");
+                continue;
+            }
+            ProcessingState state = WAIT_FOR_MSG;
+            size_t msgs = 0, produced = 0;
+            double t0 = now_sec();
+            for (size_t r = 0; r < rounds; r++) {
+                produced += protocol_process(&state, in, len, out, &msgs);
+            }
+            double dt = now_sec() - t0;
+            // 顺便校验一下：每条消息都应该完整地回显出来
+            if (msgs != rounds * (len / (payload_sizes[s] + 2)) || produced != msgs * payload_sizes[s]) {
+                die("protocol_process produced unexpected output");
+            }
+            printf("%10.2f", (double)len * rounds / dt / 1e9);
+        }
+        printf("\n");
+        free(in);
+        free(out);
+    }
+    return 0;
+}
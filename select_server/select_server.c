@@ -5,7 +5,11 @@
 #include <unistd.h>
 #include <sys/select.h>
 #include "../utils.h"
+#include "../outbuf.h"
+#include "../protocol.h"
+#include "../log.h"
 #include <string.h>
+#include <errno.h>
 
 #if 0
 // 宏定义：select 最多能监控 FD_SETSIZE (通常是 1024) 个 socket
@@ -118,21 +122,16 @@ int main(int argc, char** argv) {
 
 
 #define MAX_CLIENTS 100
-#define SENDBUF_SIZE 1024
-// 定义协议状态
-typedef enum {
-    INITIAL_ACK,  // 刚连上，还没发送 '*'
-    WAIT_FOR_MSG, // 等待消息开始符 '^'
-    IN_MSG        // 正在接收消息，等待结束符 '$'
-} ProcessingState;
+// 每次监听 Socket 就绪时最多 accept 多少个新连接
+#define ACCEPT_BATCH 64
 
 // 定义每个客户端的状态
 typedef struct {
     int fd;
     ProcessingState state;
-    // 缓冲区
-    char buf_to_send[SENDBUF_SIZE];
-    int bytes_to_send;// 缓冲区里有多少数据待发送
+    // 输出队列 (缓冲段链表，见 outbuf.c)：不会因为满了而丢字节，发送时一次 writev
+    outbuf_t out;
+    int read_paused;// 背压：待发送数据超过高水位后暂停读取
 } client_state_t;
 
 // 初始化客户端状态数组
@@ -142,17 +141,42 @@ void init_clients() {
     for (int i = 0;i < MAX_CLIENTS; i++) {
         clients[i].fd = -1; // -1表示空位
         clients[i].state = INITIAL_ACK;
-        clients[i].bytes_to_send = 0;
+        clients[i].read_paused = 0;
+        outbuf_init(&clients[i].out);
     }
 }
 
+// 断开客户端并归还它占用的缓冲段
+void close_client(int i) {
+    close(clients[i].fd);
+    conn_release(1);
+    clients[i].fd = -1; // 释放位置
+    clients[i].state = INITIAL_ACK;
+    clients[i].read_paused = 0;
+    outbuf_free(&clients[i].out);
+}
+
 int main(int argc, char** argv) {
     setvbuf(stdout, NULL, _IONBF, 0);
     int portnum = 9090;
-    if (argc >= 2) {
-        portnum = atoi(argv[1]);
+    int log_level = LOG_LEVEL_INFO;
+    int max_conns = MAX_CLIENTS;
+    // 用法：select_server [port] [-v] [-C N]
+    //   -v 打开 DEBUG 日志 (记录每个连接的建立和断开)
+    //   -C 最多同时接受 N 个连接 (不超过 MAX_CLIENTS)
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-v") == 0) {
+            log_level = LOG_LEVEL_DEBUG;
+        } else if (strcmp(argv[i], "-C") == 0 && i + 1 < argc) {
+            max_conns = atoi(argv[++i]);
+            if (max_conns <= 0 || max_conns > MAX_CLIENTS) max_conns = MAX_CLIENTS;
+        } else {
+            portnum = atoi(argv[i]);
+        }
     }
     printf("Serving on port %d\n", portnum);
+    log_init(log_level, STDERR_FILENO);
+    conn_limit_init(max_conns);
 
     int listener_sockfd = listen_inet_socket(portnum);
     // 关键点：一定要把 listener 设为非阻塞！
@@ -167,25 +191,28 @@ int main(int argc, char** argv) {
     while (1) {
         FD_ZERO(&readfds);
         FD_ZERO(&writefds);
-        FD_SET(listener_sockfd, &readfds);
         max_fd = listener_sockfd;
+        int free_slots = 0;
 
         // 将所有有效的客户端 fd 加入 select 监控集合
         for (int i = 0; i < MAX_CLIENTS; i++) {
-            if (clients[i].fd != -1) {
-                FD_SET(clients[i].fd, &readfds);
+            if (clients[i].fd == -1) {
+                free_slots++;
+            } else {
+                // 背压：输出队列堆到高水位时先不读这个客户端，等发到低水位以下再恢复
+                if (!clients[i].read_paused) {
+                    FD_SET(clients[i].fd, &readfds);
+                }
                 
                 // 只有当有数据要发送时，才加入 writefds
-                if (clients[i].bytes_to_send > 0) {
+                if (clients[i].out.len > 0) {
                     FD_SET(clients[i].fd, &writefds);
                 } else if (clients[i].state == INITIAL_ACK) {
                     // 对于新连接，我们立即准备发送 '*'
-                    if (clients[i].bytes_to_send < SENDBUF_SIZE) {
-                         clients[i].buf_to_send[clients[i].bytes_to_send++] = '*';
-                         clients[i].state = WAIT_FOR_MSG;
-                         // 加入 writefds 以便立即发送
-                         FD_SET(clients[i].fd, &writefds);
-                    }
+                    outbuf_append(&clients[i].out, "*", 1);
+                    clients[i].state = WAIT_FOR_MSG;
+                    // 加入 writefds 以便立即发送
+                    FD_SET(clients[i].fd, &writefds);
                 }
 
                 if (clients[i].fd > max_fd) {
@@ -194,34 +221,37 @@ int main(int argc, char** argv) {
             }
         }
 
-        int activity = select(max_fd + 1, &readfds, NULL, NULL, NULL);
+        // 有空位才监听新连接；满了就让连接先在内核的监听队列里排着
+        // (以前满了照样 accept，结果那个 fd 没地方放，直接泄漏了)
+        // -C 设置的连接上限同理 (见 utils.c 的准入控制)
+        if (free_slots > 0 && conn_active() < conn_limit_max()) {
+            FD_SET(listener_sockfd, &readfds);
+        }
+
+        int activity = select(max_fd + 1, &readfds, &writefds, NULL, NULL);
 
         if (activity < 0) {
-            perror("select error");
+            log_error("select error: %m");
             continue;
         }
 
-        // 处理新连接
+        // 处理新连接：一次把监听队列里的连接取出来 (最多取到空位用完)，新 fd 已经是非阻塞的
         if (FD_ISSET(listener_sockfd, &readfds)) {
-            struct sockaddr_in peer_addr;
-            socklen_t peer_addr_len = sizeof(peer_addr);
-            int new_socket = accept(listener_sockfd, (struct sockaddr *)&peer_addr, &peer_addr_len);
-
-            if (new_socket < 0) {
-                perror("accept error");
-            } else {
-                make_socket_non_blocking(new_socket);
-                printf("New connection, socket fd is %d\n", new_socket);
-                for (int i = 0;i < MAX_CLIENTS; i++) {
-                    // 如果是-1状态，就变成就绪态
-                    if (clients[i].fd == -1) {
-                        clients[i].fd = new_socket;
-                        clients[i].state = INITIAL_ACK;
-                        clients[i].bytes_to_send = 0;
-                        printf("Adding to list of clients at index %d\n", i);
-                        break;
-                    }
+            int new_fds[ACCEPT_BATCH];
+            int drained;
+            int want = conn_acquire(free_slots < ACCEPT_BATCH ? free_slots : ACCEPT_BATCH);
+            int n = accept_batch(listener_sockfd, new_fds, want, &drained);
+            conn_release(want - n);
+            int slot = 0;
+            for (int k = 0; k < n; k++) {
+                // 找下一个 -1 的空位，变成就绪态
+                while (clients[slot].fd != -1) {
+                    slot++;
                 }
+                clients[slot].fd = new_fds[k];
+                clients[slot].state = INITIAL_ACK;
+                clients[slot].read_paused = 0;
+                log_debug("Adding fd %d to list of clients at index %d", new_fds[k], slot);
             }
         }
         // 检查是不是有已连接的客户端有数据可读
@@ -239,68 +269,48 @@ int main(int argc, char** argv) {
                     // 客户端断开或出错
                     if (valread == 0) {
                         // 正常关闭
-                        printf("Host disconnected, fd %d\n", sockfd);
+                        log_debug("Host disconnected, fd %d", sockfd);
                     } else {
-                        perror("recv error");
+                        log_error("recv error: %m");
                     }
-                    close(sockfd);
-                    FD_CLR(sockfd, &readfds); // 确保从集合中移除
-                    clients[i].fd = -1; // 释放位置
-                    clients[i].bytes_to_send = 0;
-                    clients[i].state = INITIAL_ACK;
+                    FD_CLR(sockfd, &writefds); // 确保从集合中移除
+                    close_client(i);
                     continue; // 处理下一个客户端
                 }
 
-                // 处理接收到的数据
-                for (int k = 0; k < valread; k++) {
-                    char input = buffer[k];
-                    switch (clients[i].state) {
-                        case INITIAL_ACK:
-                            // 理论上不应该在这里收到数据，除非还没发 '*' 客户端就发数据了
-                            // 这里我们简单处理，直接忽略或转入 WAIT_FOR_MSG
-                            clients[i].state = WAIT_FOR_MSG;
-                            // fallthrough
-                        case WAIT_FOR_MSG:
-                            if (input == '^') {
-                                clients[i].state = IN_MSG;
-                            }
-                            break;
-                        case IN_MSG:
-                            if (input == '$') {
-                                clients[i].state = WAIT_FOR_MSG;
-                            } else {
-                                if (clients[i].bytes_to_send < SENDBUF_SIZE) {
-                                    clients[i].buf_to_send[clients[i].bytes_to_send++] = input + 1;
-                                }
-                            }
-                            break;
-                    }
+                // 处理接收到的数据 (协议状态机见 protocol.c)，回显内容直接写进输出队列的尾段
+                // 尾段剩多少空间就喂多少输入 (输出不会比输入多)，写满了再挂新段
+                // 还没发 '*' 客户端就发数据的话，INITIAL_ACK 按 WAIT_FOR_MSG 处理
+                size_t off = 0;
+                while (off < (size_t)valread) {
+                    size_t avail;
+                    char* out = outbuf_reserve(&clients[i].out, &avail);
+                    size_t chunk = (size_t)valread - off < avail ? (size_t)valread - off : avail;
+                    outbuf_commit(&clients[i].out,
+                                  protocol_process(&clients[i].state, buffer + off, chunk, out, NULL));
+                    off += chunk;
+                }
+                if (clients[i].out.len >= OUTBUF_HIGH_WATER) {
+                    clients[i].read_paused = 1;
                 }
             }
         }
 
         // 处理写事件
         for (int i = 0; i < MAX_CLIENTS; i++) {
-             if (clients[i].fd != -1 && clients[i].bytes_to_send > 0 && FD_ISSET(clients[i].fd, &writefds)) {
-                int sockfd = clients[i].fd;
-                int sent = send(sockfd, clients[i].buf_to_send, clients[i].bytes_to_send, 0);
+             if (clients[i].fd != -1 && clients[i].out.len > 0 && FD_ISSET(clients[i].fd, &writefds)) {
+                // 一次 writev 把输出队列里的多个段一起发出去，发完的段直接回收，不再 memmove
+                ssize_t sent = outbuf_writev(&clients[i].out, clients[i].fd);
 
-                if (sent < 0) {
-                    perror("send error");
-                    close(sockfd);
-                    FD_CLR(sockfd, &readfds); // 确保从集合中移除
-                    clients[i].fd = -1;
-                    clients[i].bytes_to_send = 0;
-                    clients[i].state = INITIAL_ACK;
+                if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                    log_error("send error: %m");
+                    close_client(i);
                     continue;
                 }
-                
-                if (sent > 0) {
-                    int remaining = clients[i].bytes_to_send - sent;
-                    if (remaining > 0) {
-                         memmove(clients[i].buf_to_send, clients[i].buf_to_send + sent, remaining);
-                    }
-                    clients[i].bytes_to_send = remaining;
+
+                // 背压解除：输出队列降到低水位以下，下一轮重新监听读事件
+                if (clients[i].read_paused && clients[i].out.len <= OUTBUF_LOW_WATER) {
+                    clients[i].read_paused = 0;
                 }
             }
         }
@@ -1,3 +1,5 @@
+#define _GNU_SOURCE // accept4
+#include <errno.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -7,47 +9,51 @@
 #include <unistd.h>
 
 #include "../utils.h"
-
-typedef enum {
-    WAIT_FOR_MSG, IN_MSG
-} ProcessingState;
+#include "../protocol.h"
+#include "../log.h"
 
 void serve_connection(int sockfd) {
+    // 单个连接出错 (比如对方 RST) 只结束这个连接，不再 perror_die 把服务器带走
     if (send(sockfd, "*", 1, 0) < 1) {
-        perror_die("send");
+        log_error("send: %m");
+        close(sockfd);
+        return;
     }
 
     ProcessingState state = WAIT_FOR_MSG;
+    // 回显攒在 out 里，读空了接收队列才一次 send (见 threads/threaded_server.c 和 utils.h 的 sendbuf_t)
+    sendbuf_t out;
+    sendbuf_init(&out, sockfd, NULL);
+    int replied = 0;
 
     while (1) {
         uint8_t buf[1024];
-        int len =recv(sockfd, buf, sizeof buf, 0);
-        if (len < 0) {
-            perror_die("recv");
+        int len =recv(sockfd, buf, sizeof buf, replied ? MSG_DONTWAIT : 0);
+        if (len < 0 && replied && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            len = 0;
+        } else if (len < 0) {
+            log_debug("recv: %m");
+            break;
         } else if (len == 0) {
+            sendbuf_flush(&out);
             break;
         }
 
-        for (int i = 0; i < len; ++i) {
-            switch (state) {
-                case WAIT_FOR_MSG:
-                    if (buf[i] == '^') {
-                        state = IN_MSG;
-                    }
-                    break;
-                case IN_MSG:
-                    if (buf[i] == '$') {
-                        state = WAIT_FOR_MSG;
-                    } else {
-                        buf[i] += 1;
-                        if (send(sockfd, &buf[i], 1, 0) < 1) {
-                            perror("send error");
-                            close(sockfd);
-                            return;
-                        }
-                    }
-                    break;
-            }
+        // 整段交给状态机 (见 protocol.c)
+        size_t msgs = 0;
+        char* dst = sendbuf_reserve(&out, len);
+        if (dst) {
+            sendbuf_commit(&out, protocol_process(&state, (const char*)buf, len, dst, &msgs));
+        }
+        replied |= msgs > 0;
+        if (dst && replied && len < (int)sizeof buf) {
+            replied = 0;
+            if (sendbuf_flush(&out) < 0) dst = NULL;
+        }
+        if (!dst) {
+            log_error("send error: %m");
+            close(sockfd);
+            return;
         }
     }
     close(sockfd);
@@ -56,22 +62,40 @@ void serve_connection(int sockfd) {
 int main(int argc, char **argv) {
     setvbuf(stdout, NULL, _IONBF, 0);
     int portnum = 9090;
-    if (argc >= 2) {
-        portnum = atoi(argv[1]);
+    int log_level = LOG_LEVEL_INFO;
+    // 用法：sequential_server [port] [-v]，-v 打开 DEBUG 日志 (记录每个连接的对端地址)
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-v") == 0) {
+            log_level = LOG_LEVEL_DEBUG;
+        } else {
+            portnum = atoi(argv[i]);
+        }
     }
     printf("Serving on port %d\n", portnum);
+    log_init(log_level, STDERR_FILENO);
 
     int sockfd = listen_inet_socket(portnum);
+    // 顺序服务器同一时刻只服务一个连接，天然就是“满了不 accept”，这里只需要备用 fd
+    conn_limit_init(1);
     while (1) {
         struct sockaddr_in peer_addr;
         socklen_t peer_addr_len = sizeof(peer_addr);
-        int newsockfd = accept(sockfd, (struct sockaddr*)&peer_addr, &peer_addr_len);
+        // SOCK_CLOEXEC：accept 出来的 fd 不会被 exec 出去的子进程继承，省掉一次 fcntl
+        int newsockfd = accept4(sockfd, (struct sockaddr*)&peer_addr, &peer_addr_len, SOCK_CLOEXEC);
         if (newsockfd < 0) {
-            perror_die("ERROR on accept");
-        } 
-        report_peer_connected(&peer_addr, peer_addr_len);
+            // 暂时性的错误 (fd 用完、对方提前断开、被信号打断) 不应该让服务器退出
+            if (errno == EMFILE || errno == ENFILE) {
+                accept_shed(sockfd);
+            } else if (errno != EINTR && errno != ECONNABORTED) {
+                log_error("accept: %m");
+            }
+            continue;
+        }
+        if (log_enabled(LOG_LEVEL_DEBUG)) {
+            report_peer_connected(&peer_addr, peer_addr_len);
+        }
         serve_connection(newsockfd);
-        printf("peer done\n");
+        log_debug("peer done");
     }
     return 0;
 }
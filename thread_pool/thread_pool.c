@@ -1,105 +1,732 @@
 #include "thread_pool.h"
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 #include <pthread.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
 static void* thread_pool_worker(void* arg);
+static void* thread_pool_manager(void* arg);
+static void notify_workers(thread_pool_t* pool, int n);
 
+// 当前线程是哪个池子的哪个 Worker (不是 Worker 的线程为 NULL)，thread_pool_add 靠它决定任务放哪
+static __thread pool_worker_t* current_worker;
 
+static int pool_elastic(thread_pool_t* pool) {
+    return pool->min_threads < pool->thread_count;
+}
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// 现在 + us 微秒的绝对时间，给 pthread_cond_timedwait 用 (条件变量都用单调时钟)
+static struct timespec deadline_after_us(uint64_t us) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_sec += us / 1000000;
+    ts.tv_nsec += (us % 1000000) * 1000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+    return ts;
+}
+
+// 在 *addr 上睡觉，前提是它的值还是 val (不是就马上返回)；timeout_us 为 0 表示不限时
+static void futex_wait(atomic_uint* addr, unsigned val, uint64_t timeout_us) {
+    struct timespec ts = {(time_t)(timeout_us / 1000000), (long)(timeout_us % 1000000) * 1000};
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, timeout_us ? &ts : NULL, NULL, 0);
+}
+
+static void futex_wake(atomic_uint* addr, int n) {
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
+
+// 自旋等待时告诉 CPU “我在忙等”：让出流水线给同一物理核上的另一个超线程，也省电
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+// 入队：看 enqueue_pos 指向的槽位
+//   seq == pos：空槽，CAS 把 enqueue_pos 推进一格，抢到了这个槽就独占它，写完任务再发布 seq = pos + 1；
+//   seq <  pos：上一圈的任务还没被取走，队列满了；
+//   seq >  pos：别的生产者已经抢先用掉了这个下标，重新读 enqueue_pos 再试。
+static int queue_push(thread_pool_t* pool, void (*function)(void *), void* argument) {
+    size_t pos = atomic_load_explicit(&pool->enqueue_pos, memory_order_relaxed);
+    while (1) {
+        pool_slot_t* slot = &pool->queue[pos & pool->mask];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0) {
+            // CAS 失败时 pos 会被换成最新的 enqueue_pos，直接重试
+            if (atomic_compare_exchange_weak_explicit(&pool->enqueue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                slot->task.function = function;
+                slot->task.argument = argument;
+                if (pool->stamp_tasks) {
+                    atomic_store_explicit(&slot->enqueued_ns, now_ns(), memory_order_relaxed);
+                }
+                atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+                return 0;
+            }
+        } else if (diff < 0) {
+            return -1;
+        } else {
+            pos = atomic_load_explicit(&pool->enqueue_pos, memory_order_relaxed);
+        }
+    }
+}
+
+// 批量入队：从 enqueue_pos 开始数出连续的空槽 (最多 count 个)，一次 CAS 把下标推进这么多格，
+// 抢到的槽位逐个写好再发布。返回入队的个数，0 表示队列满了
+static int queue_push_batch(thread_pool_t* pool, const thread_task_t* tasks, int count) {
+    size_t pos = atomic_load_explicit(&pool->enqueue_pos, memory_order_relaxed);
+    while (1) {
+        int n = 0;
+        intptr_t diff = 0;
+        while (n < count) {
+            size_t seq = atomic_load_explicit(&pool->queue[(pos + n) & pool->mask].seq, memory_order_acquire);
+            diff = (intptr_t)seq - (intptr_t)(pos + n);
+            if (diff != 0) {
+                break;
+            }
+            n++;
+        }
+        if (n == 0) {
+            if (diff < 0) {
+                return 0;
+            }
+            pos = atomic_load_explicit(&pool->enqueue_pos, memory_order_relaxed);
+            continue;
+        }
+        // CAS 失败时 pos 会被换成最新的 enqueue_pos，重新数
+        if (atomic_compare_exchange_weak_explicit(&pool->enqueue_pos, &pos, pos + n,
+                                                  memory_order_relaxed, memory_order_relaxed)) {
+            uint64_t now = pool->stamp_tasks ? now_ns() : 0;
+            for (int i = 0; i < n; i++) {
+                pool_slot_t* slot = &pool->queue[(pos + i) & pool->mask];
+                slot->task = tasks[i];
+                atomic_store_explicit(&slot->enqueued_ns, now, memory_order_relaxed);
+                atomic_store_explicit(&slot->seq, pos + i + 1, memory_order_release);
+            }
+            return n;
+        }
+    }
+}
+
+// 出队：和入队对称，等的是 seq == pos + 1 (任务已经写好)
+// 取走之后把 seq 设成 pos + 槽位数，这个槽就留给下一圈的生产者了
+static int queue_pop(thread_pool_t* pool, thread_task_t* task, uint64_t* enqueued_ns) {
+    size_t pos = atomic_load_explicit(&pool->dequeue_pos, memory_order_relaxed);
+    while (1) {
+        pool_slot_t* slot = &pool->queue[pos & pool->mask];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&pool->dequeue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                *task = slot->task;
+                *enqueued_ns = atomic_load_explicit(&slot->enqueued_ns, memory_order_relaxed);
+                atomic_store_explicit(&slot->seq, pos + pool->mask + 1, memory_order_release);
+                return 0;
+            }
+        } else if (diff < 0) {
+            return -1;  // 空 (或者生产者抢到了槽还没写完，它写完会来叫醒我们)
+        } else {
+            pos = atomic_load_explicit(&pool->dequeue_pos, memory_order_relaxed);
+        }
+    }
+}
+
+// 注入队列里最老的任务已经等了多久 (微秒，队列空时为 0)。
+// 只是给监工线程估个大概：读的时候这个槽可能正好被取走、重新写入，读到的时间错了也就是早一点或晚一点加线程
+static uint64_t oldest_wait_us(thread_pool_t* pool) {
+    size_t pos = atomic_load(&pool->dequeue_pos);
+    pool_slot_t* slot = &pool->queue[pos & pool->mask];
+    if (atomic_load(&slot->seq) != pos + 1) {
+        return 0;
+    }
+    uint64_t enqueued = atomic_load_explicit(&slot->enqueued_ns, memory_order_relaxed);
+    uint64_t now = now_ns();
+    return now > enqueued ? (now - enqueued) / 1000 : 0;
+}
+
+// 睡觉之前的最后一次检查 (seq_cst，和 thread_pool_add 里的栅栏配对)
+static int queue_empty(thread_pool_t* pool) {
+    size_t pos = atomic_load(&pool->dequeue_pos);
+    size_t seq = atomic_load(&pool->queue[pos & pool->mask].seq);
+    return (intptr_t)seq - (intptr_t)(pos + 1) < 0;
+}
+
+// ---- 工作窃取：每个 Worker 一个 Chase-Lev 双端队列 (内存序按 Lê 等人给 C11 的版本) ----
+
+// 主人放任务：满了返回 -1 (调用方退回注入队列)
+static int deque_push(thread_pool_t* pool, pool_worker_t* w, void (*function)(void *), void* argument,
+                      uint64_t enqueued_ns) {
+    long b = atomic_load_explicit(&w->bottom, memory_order_relaxed);
+    long t = atomic_load_explicit(&w->top, memory_order_acquire);
+    if (b - t > (long)pool->mask) {
+        return -1;
+    }
+    pool_deque_slot_t* slot = &w->slots[b & pool->mask];
+    atomic_store_explicit(&slot->function, function, memory_order_relaxed);
+    atomic_store_explicit(&slot->argument, argument, memory_order_relaxed);
+    atomic_store_explicit(&slot->enqueued_ns, enqueued_ns, memory_order_relaxed);
+    // 槽位写完才发布 bottom，小偷 acquire 读到新的 bottom 就一定能看到任务
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&w->bottom, b + 1, memory_order_relaxed);
+    return 0;
+}
+
+// 主人取任务 (后进先出)：先把 bottom 退一格“占住”最后一个任务，再看 top。
+// 只剩最后一个时小偷可能同时在偷，这时和小偷一样用 CAS 抢 top，输了就算空
+static int deque_take(thread_pool_t* pool, pool_worker_t* w, thread_task_t* task, uint64_t* enqueued_ns) {
+    long b = atomic_load_explicit(&w->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&w->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    long t = atomic_load_explicit(&w->top, memory_order_relaxed);
+    if (t > b) {
+        atomic_store_explicit(&w->bottom, b + 1, memory_order_relaxed);
+        return -1;
+    }
+    pool_deque_slot_t* slot = &w->slots[b & pool->mask];
+    task->function = atomic_load_explicit(&slot->function, memory_order_relaxed);
+    task->argument = atomic_load_explicit(&slot->argument, memory_order_relaxed);
+    *enqueued_ns = atomic_load_explicit(&slot->enqueued_ns, memory_order_relaxed);
+    if (t == b) {
+        int won = atomic_compare_exchange_strong_explicit(&w->top, &t, t + 1,
+                                                          memory_order_seq_cst, memory_order_relaxed);
+        atomic_store_explicit(&w->bottom, b + 1, memory_order_relaxed);
+        return won ? 0 : -1;
+    }
+    return 0;
+}
+
+// 小偷从 top 一端偷 (先进先出)。CAS 输了 (被别的小偷或主人抢先) 也返回 -1，调用方换个对象再试
+static int deque_steal(thread_pool_t* pool, pool_worker_t* w, thread_task_t* task, uint64_t* enqueued_ns) {
+    long t = atomic_load_explicit(&w->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    long b = atomic_load_explicit(&w->bottom, memory_order_acquire);
+    if (t >= b) {
+        return -1;
+    }
+    // 先读再 CAS：CAS 成功说明读的时候这个槽还没被人动过
+    pool_deque_slot_t* slot = &w->slots[t & pool->mask];
+    task->function = atomic_load_explicit(&slot->function, memory_order_relaxed);
+    task->argument = atomic_load_explicit(&slot->argument, memory_order_relaxed);
+    *enqueued_ns = atomic_load_explicit(&slot->enqueued_ns, memory_order_relaxed);
+    return atomic_compare_exchange_strong_explicit(&w->top, &t, t + 1,
+                                                   memory_order_seq_cst, memory_order_relaxed) ? 0 : -1;
+}
+
+// xorshift32：挑偷窃对象用，不需要多好的随机性，只要各个 Worker 别总盯着同一个人
+static uint32_t next_random(uint32_t* state) {
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+// 从全局 (注入) 队列取任务：腾出了一个空位，有生产者在 thread_pool_add_wait 里等空位就叫醒一个。
+// 和睡觉的 Worker 一样是“先登记再检查”：生产者 space_waiters++ 之后再试一次入队，这边先出队再看 space_waiters
+static int injection_pop(thread_pool_t* pool, thread_task_t* task, uint64_t* enqueued_ns) {
+    if (queue_pop(pool, task, enqueued_ns) != 0) {
+        return -1;
+    }
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&pool->space_waiters, memory_order_relaxed) > 0) {
+        pthread_mutex_lock(&(pool->lock));
+        pthread_cond_signal(&(pool->space));
+        pthread_mutex_unlock(&(pool->lock));
+    }
+    return 0;
+}
+
+// 找活干：自己的双端队列 -> 注入队列 -> 从随机的一个 Worker 开始挨个偷一圈
+// *enqueued_ns 是任务的入队时间 (没记录时为 0)
+static int find_task(thread_pool_t* pool, pool_worker_t* self, thread_task_t* task, uint64_t* enqueued_ns) {
+    if (!pool->work_stealing) {
+        return injection_pop(pool, task, enqueued_ns);
+    }
+    if (deque_take(pool, self, task, enqueued_ns) == 0 || injection_pop(pool, task, enqueued_ns) == 0) {
+        return 0;
+    }
+    int n = pool->thread_count;
+    int start = (int)(next_random(&self->rng) % (uint32_t)n);
+    for (int i = 0; i < n; i++) {
+        pool_worker_t* victim = &pool->workers[(start + i) % n];
+        if (victim != self && deque_steal(pool, victim, task, enqueued_ns) == 0) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// 睡觉之前的最后一次检查：工作窃取模式下所有双端队列也都得是空的 (seq_cst，理由同 queue_empty)
+static int pool_idle(thread_pool_t* pool) {
+    if (!queue_empty(pool)) {
+        return 0;
+    }
+    if (pool->work_stealing) {
+        for (int i = 0; i < pool->thread_count; i++) {
+            pool_worker_t* w = &pool->workers[i];
+            if (atomic_load(&w->top) < atomic_load(&w->bottom)) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+// 注入队列里大概有多少个任务 (两个下标分开读，只是个估计)
+static intptr_t queue_depth(thread_pool_t* pool) {
+    size_t enq = atomic_load_explicit(&pool->enqueue_pos, memory_order_relaxed);
+    size_t deq = atomic_load_explicit(&pool->dequeue_pos, memory_order_relaxed);
+    return (intptr_t)(enq - deq);
+}
+
+// ---- 统计 ----
+
+// 值 v (纳秒) 落在直方图的哪个桶：小于 8 的直接对应，否则按最高位 e 分段，段内再看紧跟最高位的 3 位
+static int hist_bucket(uint64_t v) {
+    if (v < (1u << POOL_HIST_SUB_BITS)) {
+        return (int)v;
+    }
+    int e = 63 - __builtin_clzll(v);
+    if (e > POOL_HIST_MAX_EXP) {
+        return POOL_HIST_BUCKETS - 1;
+    }
+    int sub = (int)(v >> (e - POOL_HIST_SUB_BITS)) & ((1 << POOL_HIST_SUB_BITS) - 1);
+    return ((e - POOL_HIST_SUB_BITS + 1) << POOL_HIST_SUB_BITS) + sub;
+}
+
+// 第 i 个桶里最大的值
+static uint64_t hist_bucket_max(int i) {
+    if (i < (1 << POOL_HIST_SUB_BITS)) {
+        return (uint64_t)i;
+    }
+    int e = (i >> POOL_HIST_SUB_BITS) + POOL_HIST_SUB_BITS - 1;
+    uint64_t sub = (uint64_t)(i & ((1 << POOL_HIST_SUB_BITS) - 1));
+    uint64_t width = 1ull << (e - POOL_HIST_SUB_BITS);
+    return ((1ull << e) + sub * width) + width - 1;
+}
+
+// 只有一个线程写的计数器：读出来加上再写回去，不需要 lock 前缀的原子加
+static inline void stat_add(atomic_ulong* counter, unsigned long v) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + v, memory_order_relaxed);
+}
+
+// 入队之后更新注入队列深度的最高水位：绝大多数时候只是一次读，超过旧值才 CAS
+static void note_queue_depth(thread_pool_t* pool) {
+    intptr_t depth = queue_depth(pool);
+    unsigned long max = atomic_load_explicit(&pool->depth_max, memory_order_relaxed);
+    while (depth > 0 && (unsigned long)depth > max &&
+           !atomic_compare_exchange_weak_explicit(&pool->depth_max, &max, (unsigned long)depth,
+                                                  memory_order_relaxed, memory_order_relaxed)) {
+    }
+}
+
+static void note_rejected(thread_pool_t* pool, int n) {
+    if (pool->stats_enabled) {
+        atomic_fetch_add_explicit(&pool->rejected, (unsigned long)n, memory_order_relaxed);
+    }
+}
+
+// 在一个空着的槽位上启动一个 Worker (调用方持有 lock)。槽位上的线程空闲超时退出过就先 join 掉
+static int spawn_worker_locked(thread_pool_t* pool) {
+    for (int i = 0; i < pool->thread_count; i++) {
+        pool_worker_t* w = &pool->workers[i];
+        if (w->state == POOL_WORKER_RUNNING) {
+            continue;
+        }
+        if (w->state == POOL_WORKER_EXITED) {
+            pthread_join(pool->threads[i], NULL);
+        }
+        w->state = POOL_WORKER_RUNNING;
+        atomic_fetch_add(&pool->live_threads, 1);
+        // 让每个线程都去执行 thread_pool_worker 函数
+        // 注意：把这个 Worker 的状态传进去，里面有 pool 指针，因为线程需要访问队列
+        if (pthread_create(&(pool->threads[i]), NULL, thread_pool_worker, (void*)w) != 0) {
+            w->state = POOL_WORKER_UNUSED;
+            atomic_fetch_sub(&pool->live_threads, 1);
+            return -1;
+        }
+        return 0;
+    }
+    return -1;
+}
 
 thread_pool_t* thread_pool_create(int thread_count, int queue_size) {
-    // 1. 申请线程池管理器的内存
-    thread_pool_t* pool = malloc(sizeof(thread_pool_t));
+    return thread_pool_create_ex(thread_count, queue_size, 0);
+}
+
+thread_pool_t* thread_pool_create_ex(int thread_count, int queue_size, int flags) {
+    return thread_pool_create_elastic(thread_count, thread_count, queue_size, flags);
+}
+
+thread_pool_t* thread_pool_create_elastic(int min_threads, int max_threads, int queue_size, int flags) {
+    if (min_threads < 1 || max_threads < min_threads) {
+        return NULL;
+    }
+    // 1. 申请线程池管理器的内存 (按缓存行对齐，两个下标才真的各占一行)
+    thread_pool_t* pool;
+    if (posix_memalign((void**)&pool, POOL_CACHE_LINE, sizeof(thread_pool_t)) != 0) {
+        return NULL;
+    }
 
-    // 2. 初始化基本参数
-    pool->thread_count = thread_count;
-    pool->queue_size = queue_size;
-    pool->head = 0;
-    pool->tail = 0;
-    pool->count = 0;
-    pool->shutdown = 0;
+    // 2. 初始化基本参数：槽位数向上取整到 2 的幂，下标对它取模只要一次 & 运算
+    size_t capacity = 2;
+    while (capacity < (size_t)queue_size) capacity <<= 1;
+    pool->thread_count = max_threads;
+    pool->min_threads = min_threads;
+    pool->queue_size = (int)capacity;
+    pool->mask = capacity - 1;
+    pool->work_stealing = (flags & THREAD_POOL_WORK_STEALING) != 0;
+    pool->stats_enabled = (flags & THREAD_POOL_STATS) != 0;
+    pool->stamp_tasks = pool->stats_enabled || min_threads < max_threads;
+    pool->spin_iters = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? POOL_SPIN_ITERS : 0;
+    atomic_init(&pool->enqueue_pos, 0);
+    atomic_init(&pool->dequeue_pos, 0);
+    atomic_init(&pool->sleepers, 0);
+    atomic_init(&pool->park_seq, 0);
+    atomic_init(&pool->wake_pending, 0);
+    atomic_init(&pool->space_waiters, 0);
+    atomic_init(&pool->shutdown, 0);
+    atomic_init(&pool->rejected, 0);
+    atomic_init(&pool->depth_max, 0);
+    atomic_init(&pool->live_threads, 0);
+    atomic_init(&pool->manager_idle, 0);
 
-    // 3. 申请任务队列的内存
-    pool->queue = (thread_task_t*)malloc(sizeof(thread_task_t) * queue_size);
+    // 3. 申请任务队列的内存，第 i 个槽位一开始等的是下标为 i 的生产者
+    pool->queue = (pool_slot_t*)malloc(sizeof(pool_slot_t) * capacity);
+    for (size_t i = 0; i < capacity; i++) {
+        atomic_init(&pool->queue[i].seq, i);
+        atomic_init(&pool->queue[i].enqueued_ns, 0);
+    }
 
-    // 4. 申请线程数组的内存
-    pool->threads = (pthread_t*)malloc(sizeof(pthread_t) * thread_count);
+    // 4. 申请线程数组和每个 Worker 的状态 (按缓存行对齐：各个 Worker 的 top / bottom 互不干扰)
+    //    工作窃取模式下每个 Worker 再配一个和全局队列一样大的双端队列
+    pool->threads = (pthread_t*)malloc(sizeof(pthread_t) * max_threads);
+    if (posix_memalign((void**)&pool->workers, POOL_CACHE_LINE, sizeof(pool_worker_t) * max_threads) != 0) {
+        free(pool->queue);
+        free(pool->threads);
+        free(pool);
+        return NULL;
+    }
+    for (int i = 0; i < max_threads; i++) {
+        pool_worker_t* w = &pool->workers[i];
+        atomic_init(&w->top, 0);
+        atomic_init(&w->bottom, 0);
+        w->slots = pool->work_stealing ? (pool_deque_slot_t*)malloc(sizeof(pool_deque_slot_t) * capacity) : NULL;
+        w->rng = 2463534242u + (uint32_t)i * 0x9e3779b9u;  // xorshift 的状态不能是 0
+        w->index = i;
+        w->state = POOL_WORKER_UNUSED;
+        w->stats = NULL;
+        if (pool->stats_enabled && posix_memalign((void**)&w->stats, POOL_CACHE_LINE, sizeof(pool_worker_stats_t)) == 0) {
+            memset(w->stats, 0, sizeof(pool_worker_stats_t));
+        }
+        w->pool = pool;
+    }
 
-    // 5. 初始化锁和条件变量
+    // 5. 初始化锁和条件变量 (超时等待都按单调时钟算，不受改系统时间影响)
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
     pthread_mutex_init(&(pool->lock), NULL);
-    pthread_cond_init(&(pool->notify), NULL);
+    pthread_cond_init(&(pool->space), &cond_attr);
+    pthread_cond_init(&(pool->manager_notify), &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
 
-    // 6. 最关键的一步：启动所有线程！
-    for (int i = 0;i < thread_count; i++) {
-        // 让每个线程都去执行 thread_pool_worker 函数
-        // 注意：把 pool 指针传进去，因为线程需要访问队列
-        pthread_create(&(pool->threads[i]), NULL, thread_pool_worker, (void*)pool);
+    // 6. 最关键的一步：启动线程！先起 min_threads 个，弹性模式下再起一个监工线程负责扩容
+    pthread_mutex_lock(&(pool->lock));
+    for (int i = 0; i < min_threads; i++) {
+        spawn_worker_locked(pool);
+    }
+    pthread_mutex_unlock(&(pool->lock));
+    if (pool_elastic(pool)) {
+        pthread_create(&(pool->manager), NULL, thread_pool_manager, (void*)pool);
     }
     return pool;
 }
 
+// 执行一个任务；开了统计时记下排队时间和执行时间，并结束这个 Worker 的空闲计时
+static void run_task(pool_worker_t* self, thread_task_t* task, uint64_t enqueued_ns) {
+    pool_worker_stats_t* st = self->stats;
+    if (st == NULL) {
+        (*(task->function))(task->argument);
+        return;
+    }
+    uint64_t start = now_ns();
+    uint64_t idle_since = atomic_load_explicit(&st->idle_since_ns, memory_order_relaxed);
+    if (idle_since) {
+        stat_add(&st->idle_ns, start - idle_since);
+        atomic_store_explicit(&st->idle_since_ns, 0, memory_order_relaxed);
+    }
+    if (enqueued_ns) {
+        stat_add(&st->wait_hist[hist_bucket(start > enqueued_ns ? start - enqueued_ns : 0)], 1);
+    }
+    atomic_store_explicit(&st->busy_since_ns, start, memory_order_relaxed);
+    (*(task->function))(task->argument);
+    uint64_t end = now_ns();
+    stat_add(&st->run_hist[hist_bucket(end - start)], 1);
+    stat_add(&st->busy_ns, end - start);
+    stat_add(&st->tasks, 1);
+    atomic_store_explicit(&st->busy_since_ns, 0, memory_order_relaxed);
+}
+
+// 找不到活了：开始空闲计时 (已经在计时就不动)
+static void mark_idle(pool_worker_t* self) {
+    pool_worker_stats_t* st = self->stats;
+    if (st != NULL && atomic_load_explicit(&st->idle_since_ns, memory_order_relaxed) == 0) {
+        atomic_store_explicit(&st->idle_since_ns, now_ns(), memory_order_relaxed);
+    }
+}
+
 void* thread_pool_worker(void* arg) {
     // 强制类型转换，要求传参数的类型必须是void*
-    thread_pool_t* pool = (thread_pool_t*)arg;
-    while (1) {
-        //访问队列先加锁
-        pthread_mutex_lock(&(pool->lock));
+    pool_worker_t* self = (pool_worker_t*)arg;
+    thread_pool_t* pool = self->pool;
+    thread_task_t task;
+    uint64_t enqueued_ns;
+    int woken = 0;
+    current_worker = self;
+    while (!atomic_load_explicit(&pool->shutdown, memory_order_acquire)) {
+        // 有任务就直接取，不碰任何锁
+        if (find_task(pool, self, &task, &enqueued_ns) == 0) {
+            // 刚被叫醒：生产者在我们醒来之前的提交都没有再叫人 (见 wake_pending)，
+            // 剩下的活如果还多，接力叫醒下一个
+            if (woken) {
+                woken = 0;
+                if (!pool_idle(pool)) {
+                    notify_workers(pool, 1);
+                }
+            }
+            // 执行任务函数，将参数传递给它
+            run_task(self, &task, enqueued_ns);//相当于执行serve_connection(sockfd)
+            continue;
+        }
+        mark_idle(self);
+
+        // 队列空了：先自旋一会儿，任务往往紧跟着就来，省掉一次睡下去再被叫醒 (两次系统调用加两次切换)
+        int spins = pool->spin_iters;
+        while (spins-- > 0 && pool_idle(pool) && !atomic_load_explicit(&pool->shutdown, memory_order_relaxed)) {
+            cpu_relax();
+        }
+        if (!pool_idle(pool)) {
+            continue;
+        }
 
-        //检测是否有任务，防止虚假唤醒
-        while (pool->count == 0 && !pool->shutdown) {
-            // 队列为空，等待新任务
-            pthread_cond_wait(&(pool->notify), &(pool->lock));
+        // 准备睡觉：先读 park_seq，再登记 (sleepers++)、清掉 wake_pending，再检查一次队列。
+        // 生产者那边是“先入队，再看 sleepers，有人睡、wake_pending 又是 0 就把它置 1，park_seq++ 再 FUTEX_WAKE”，
+        // 两边都是 seq_cst：要么我们看到了刚入队的任务，不睡；要么生产者看到了 sleepers > 0 和我们清掉的
+        // wake_pending，改了 park_seq，我们的 FUTEX_WAIT 发现值变了会马上返回 (不会丢唤醒)。
+        // 生产者看到 wake_pending 已经是 1 时不再叫：前一次叫醒的 Worker 醒来后会清掉它、再检查队列，
+        // 一定能看到这次提交的任务。这样一串提交里只有第一个做 FUTEX_WAKE 系统调用
+        // 弹性模式下最多睡 THREAD_POOL_IDLE_TIMEOUT_MS，到时还没活、Worker 又多于 min_threads 就退出
+        unsigned seq = atomic_load(&pool->park_seq);
+        atomic_fetch_add(&pool->sleepers, 1);
+        atomic_store(&pool->wake_pending, 0);
+        int timed_out = 0;
+        uint64_t deadline = now_us() + (uint64_t)THREAD_POOL_IDLE_TIMEOUT_MS * 1000;
+        while (!atomic_load(&pool->shutdown) && pool_idle(pool)) {
+            uint64_t timeout = 0;
+            if (pool_elastic(pool)) {
+                uint64_t now = now_us();
+                if (now >= deadline) {
+                    timed_out = 1;
+                    break;
+                }
+                timeout = deadline - now;
+            }
+            futex_wait(&pool->park_seq, seq, timeout);
+            seq = atomic_load(&pool->park_seq);
+            atomic_store(&pool->wake_pending, 0);
+            woken = 1;
+        }
+        atomic_fetch_sub(&pool->sleepers, 1);
+        if (!timed_out) {
+            continue;
         }
-        
-        if (pool->shutdown) {
-            // 线程池要关闭了，退出循环
+        // sleepers-- 之后入队的生产者不会再来叫我们，所以退出前再检查一次队列
+        pthread_mutex_lock(&(pool->lock));
+        if (atomic_load(&pool->live_threads) > pool->min_threads && pool_idle(pool)) {
+            atomic_fetch_sub(&pool->live_threads, 1);
+            self->state = POOL_WORKER_EXITED;
+            if (self->stats != NULL) {
+                stat_add(&self->stats->idle_ns, now_ns() - atomic_load(&self->stats->idle_since_ns));
+                atomic_store(&self->stats->idle_since_ns, 0);
+            }
             pthread_mutex_unlock(&(pool->lock));
-            pthread_exit(NULL);
+            return NULL;
         }
+        pthread_mutex_unlock(&(pool->lock));
+    }
+    return NULL;
+}
 
-        // 从队列中取出任务
-        thread_task_t task = pool->queue[pool->head];
-        // 移动头指针，准备处理下一个任务,防止越界
-        pool->head = (pool->head + 1) % pool->queue_size;
-        pool->count--;
+// 监工线程 (只在弹性模式下有)：注入队列里最老的任务等了 THREAD_POOL_GROW_AFTER_US 还没人取、
+// 也没有空闲的 Worker，就加一个 Worker，再等一个周期看看新 Worker 上岗后是否还不够。
+// 不能只在 thread_pool_add 里判断：服务器的任务一占就是整条连接的寿命，
+// 所有 Worker 都忙、又没有新连接进来时，没有人会再调用 thread_pool_add
+static void* thread_pool_manager(void* arg) {
+    thread_pool_t* pool = (thread_pool_t*)arg;
+    pthread_mutex_lock(&(pool->lock));
+    while (!atomic_load(&pool->shutdown)) {
+        if (atomic_load(&pool->live_threads) == pool->thread_count || queue_empty(pool)) {
+            // 没什么可做：先登记 manager_idle 再检查一次 (和 notify_workers 配对)，然后一直睡到生产者来叫
+            atomic_store(&pool->manager_idle, 1);
+            if (!atomic_load(&pool->shutdown) &&
+                (atomic_load(&pool->live_threads) == pool->thread_count || queue_empty(pool))) {
+                pthread_cond_wait(&(pool->manager_notify), &(pool->lock));
+            }
+            atomic_store(&pool->manager_idle, 0);
+            continue;
+        }
+        uint64_t waited = oldest_wait_us(pool);
+        uint64_t delay = THREAD_POOL_GROW_AFTER_US;
+        if (waited >= THREAD_POOL_GROW_AFTER_US && atomic_load(&pool->sleepers) == 0) {
+            spawn_worker_locked(pool);
+        } else if (waited < THREAD_POOL_GROW_AFTER_US) {
+            delay = THREAD_POOL_GROW_AFTER_US - waited;
+        }
+        struct timespec deadline = deadline_after_us(delay);
+        pthread_cond_timedwait(&(pool->manager_notify), &(pool->lock), &deadline);
+    }
+    pthread_mutex_unlock(&(pool->lock));
+    return NULL;
+}
 
-        // 解锁，允许其他线程访问队列
+// 入队 n 个任务之后：有 Worker 在睡才去叫醒，最多叫醒 n 个 (放进本地队列的任务也要叫人，醒来的 Worker 会去偷)；
+// 大家都在忙 (或者还在自旋) 时入队就是一次 CAS，没有任何系统调用。
+// 弹性模式下，排队的任务比睡着的 Worker 多、还能加线程、监工线程又在无限期地睡，就叫醒它开始计时
+static void notify_workers(thread_pool_t* pool, int n) {
+    if (pool->stats_enabled) {
+        note_queue_depth(pool);
+    }
+    atomic_thread_fence(memory_order_seq_cst);
+    int sleepers = atomic_load_explicit(&pool->sleepers, memory_order_relaxed);
+    if (sleepers > 0 && atomic_exchange(&pool->wake_pending, 1) == 0) {
+        atomic_fetch_add(&pool->park_seq, 1);
+        futex_wake(&pool->park_seq, n < sleepers ? n : sleepers);
+    }
+    if (pool_elastic(pool) && atomic_load_explicit(&pool->manager_idle, memory_order_relaxed) &&
+        atomic_load_explicit(&pool->live_threads, memory_order_relaxed) < pool->thread_count &&
+        queue_depth(pool) > sleepers) {
+        pthread_mutex_lock(&(pool->lock));
+        pthread_cond_signal(&(pool->manager_notify));
         pthread_mutex_unlock(&(pool->lock));
+    }
+}
 
-        // 执行任务函数，将参数传递给它
-        (*(task.function))(task.argument);//相当于执行serve_connection(sockfd)
+// thread_pool_add 的主体。失败不计入“被拒绝”：thread_pool_add_wait 失败了还要接着等
+static int submit_one(thread_pool_t *pool, void (*function)(void *), void* argument) {
+    // 线程池关闭了，或者队列满了，直接返回 (不会覆盖还没执行的任务)
+    if (atomic_load_explicit(&pool->shutdown, memory_order_acquire)) {
+        return -1;
+    }
+    // 工作窃取模式下 Worker 自己提交的 (子) 任务先放本地双端队列，满了再退回注入队列
+    pool_worker_t* self = current_worker;
+    int queued = pool->work_stealing && self != NULL && self->pool == pool &&
+                 deque_push(pool, self, function, argument, pool->stamp_tasks ? now_ns() : 0) == 0;
+    if (!queued && queue_push(pool, function, argument) != 0) {
+        return -1;
     }
+    notify_workers(pool, 1);
+    return 0;
 }
 
 int thread_pool_add(thread_pool_t *pool, void (*function)(void *), void* argument) {
-    int err = 0;
-    int next_tail;
+    if (submit_one(pool, function, argument) != 0) {
+        note_rejected(pool, 1);
+        return -1;
+    }
+    return 0;
+}
 
-    // 加锁
-    if (pthread_mutex_lock(&(pool->lock)) != 0) {
-       return -1;
+int thread_pool_add_batch(thread_pool_t *pool, const thread_task_t *tasks, int count) {
+    if (atomic_load_explicit(&pool->shutdown, memory_order_acquire)) {
+        note_rejected(pool, count);
+        return -1;
     }
+    int done = 0;
+    // 工作窃取模式下 Worker 自己提交的先放本地双端队列，放不下的再批量进注入队列
+    pool_worker_t* self = current_worker;
+    if (pool->work_stealing && self != NULL && self->pool == pool) {
+        uint64_t now = pool->stamp_tasks ? now_ns() : 0;
+        while (done < count && deque_push(pool, self, tasks[done].function, tasks[done].argument, now) == 0) {
+            done++;
+        }
+    }
+    while (done < count) {
+        int n = queue_push_batch(pool, tasks + done, count - done);
+        if (n == 0) {
+            break;
+        }
+        done += n;
+    }
+    if (done > 0) {
+        notify_workers(pool, done);
+    }
+    if (done < count) {
+        note_rejected(pool, count - done);
+    }
+    return done;
+}
 
-    // 计算尾部位置
-    next_tail = (pool->tail + 1) % pool->queue_size;
+int thread_pool_add_wait(thread_pool_t *pool, void (*function)(void *), void* argument, int timeout_ms) {
+    if (submit_one(pool, function, argument) == 0) {
+        return 0;
+    }
+    if (timeout_ms == 0 || atomic_load(&pool->shutdown)) {
+        note_rejected(pool, 1);
+        return -1;
+    }
 
-    // 检测队列是否已满
-    if (pool->count == pool->queue_size) {
-        err = -1;
+    // 队列满了：登记 space_waiters 之后每次醒来都再试一次入队 (Worker 从注入队列取走任务后会来叫醒我们)
+    struct timespec deadline = deadline_after_us(timeout_ms > 0 ? (uint64_t)timeout_ms * 1000 : 0);
+    int ret = -1;
+    pthread_mutex_lock(&(pool->lock));
+    atomic_fetch_add(&pool->space_waiters, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    while (!atomic_load(&pool->shutdown)) {
+        if (queue_push(pool, function, argument) == 0) {
+            ret = 0;
+            break;
+        }
+        if (timeout_ms < 0) {
+            pthread_cond_wait(&(pool->space), &(pool->lock));
+        } else if (pthread_cond_timedwait(&(pool->space), &(pool->lock), &deadline) == ETIMEDOUT) {
+            ret = queue_push(pool, function, argument);
+            break;
+        }
     }
+    atomic_fetch_sub(&pool->space_waiters, 1);
+    pthread_mutex_unlock(&(pool->lock));
 
-    // 检测线程池是否关闭
-    if (pool->shutdown) {
-        err = -1;
+    if (ret == 0) {
+        notify_workers(pool, 1);
     } else {
-        // 队列不满，添加任务
-        pool->queue[pool->tail].function = function;
-        pool->queue[pool->tail].argument = argument;
-        pool->tail = next_tail;
-        pool->count++;
-        // 唤醒一个等待中的线程
-        pthread_cond_signal(&(pool->notify));
+        note_rejected(pool, 1);
     }
-    pthread_mutex_unlock(&(pool->lock));
-    return err;
+    return ret;
 }
 
 int thread_pool_destroy(thread_pool_t *pool) {
@@ -109,24 +736,99 @@ int thread_pool_destroy(thread_pool_t *pool) {
     if (pthread_mutex_lock(&(pool->lock)) != 0) {
         return -1;
     }
-    pool->shutdown = 1;
+    atomic_store(&pool->shutdown, 1);
     /*
     1. 先解锁，允许其他线程访问队列
-    2. 广播信号，唤醒所有等待中的线程
-    3. 等待所有线程执行完毕
+    2. 唤醒所有等待中的线程 (睡在 futex 上的 Worker，等空位的生产者、监工线程)
+    3. 等待所有线程执行完毕 (空闲超时退出、还没 join 的也要 join)
     4. 销毁锁和条件变量
     5. 释放内存
     */
-    if (pthread_mutex_unlock(&(pool->lock)) != 0 || pthread_cond_broadcast(&(pool->notify)) != 0) {
+    atomic_fetch_add(&pool->park_seq, 1);
+    futex_wake(&pool->park_seq, INT_MAX);
+    if (pthread_mutex_unlock(&(pool->lock)) != 0 || pthread_cond_broadcast(&(pool->space)) != 0 || pthread_cond_broadcast(&(pool->manager_notify)) != 0) {
         return -1;
     }
+    if (pool_elastic(pool)) {
+        pthread_join(pool->manager, NULL);
+    }
     for (int i = 0;i < pool->thread_count;i++) {
-        pthread_join(pool->threads[i], NULL);
+        if (pool->workers[i].state != POOL_WORKER_UNUSED) {
+            pthread_join(pool->threads[i], NULL);
+        }
+    }
+    for (int i = 0; i < pool->thread_count; i++) {
+        free(pool->workers[i].slots);
+        free(pool->workers[i].stats);
     }
+    free(pool->workers);
     free(pool->queue);
     free(pool->threads);
     pthread_mutex_destroy(&(pool->lock));
-    pthread_cond_destroy(&(pool->notify));
+    pthread_cond_destroy(&(pool->space));
+    pthread_cond_destroy(&(pool->manager_notify));
     free(pool);
     return 0;
+}
+
+int thread_pool_stats(thread_pool_t *pool, thread_pool_stats_t *out) {
+    if (pool == NULL || !pool->stats_enabled) {
+        return -1;
+    }
+    memset(out, 0, sizeof(*out));
+    out->rejected = atomic_load_explicit(&pool->rejected, memory_order_relaxed);
+    out->queue_depth_max = atomic_load_explicit(&pool->depth_max, memory_order_relaxed);
+    intptr_t depth = queue_depth(pool);
+    out->queue_depth = depth > 0 ? (long)depth : 0;
+    out->live_threads = atomic_load_explicit(&pool->live_threads, memory_order_relaxed);
+    out->sleepers = atomic_load_explicit(&pool->sleepers, memory_order_relaxed);
+
+    // 正在执行的任务、正在进行的空闲也算到现在为止，不然长连接 (一个任务就是整条连接) 的 Worker
+    // 在连接结束前一直显示为 0% 忙
+    uint64_t now = now_ns();
+    for (int i = 0; i < pool->thread_count; i++) {
+        pool_worker_stats_t* st = pool->workers[i].stats;
+        if (st == NULL) {
+            continue;
+        }
+        out->tasks += atomic_load_explicit(&st->tasks, memory_order_relaxed);
+        out->busy_ns += atomic_load_explicit(&st->busy_ns, memory_order_relaxed);
+        out->idle_ns += atomic_load_explicit(&st->idle_ns, memory_order_relaxed);
+        uint64_t busy_since = atomic_load_explicit(&st->busy_since_ns, memory_order_relaxed);
+        uint64_t idle_since = atomic_load_explicit(&st->idle_since_ns, memory_order_relaxed);
+        if (busy_since && now > busy_since) {
+            out->busy_ns += now - busy_since;
+        }
+        if (idle_since && now > idle_since) {
+            out->idle_ns += now - idle_since;
+        }
+        for (int b = 0; b < POOL_HIST_BUCKETS; b++) {
+            out->wait_hist[b] += atomic_load_explicit(&st->wait_hist[b], memory_order_relaxed);
+            out->run_hist[b] += atomic_load_explicit(&st->run_hist[b], memory_order_relaxed);
+        }
+    }
+    return 0;
+}
+
+uint64_t thread_pool_hist_percentile(const unsigned long *hist, double p) {
+    unsigned long total = 0;
+    for (int b = 0; b < POOL_HIST_BUCKETS; b++) {
+        total += hist[b];
+    }
+    if (total == 0) {
+        return 0;
+    }
+    // 第 ceil(p * total) 个样本落在哪个桶
+    unsigned long rank = (unsigned long)(p * total);
+    if (rank < p * total || rank == 0) {
+        rank++;
+    }
+    unsigned long seen = 0;
+    for (int b = 0; b < POOL_HIST_BUCKETS; b++) {
+        seen += hist[b];
+        if (seen >= rank) {
+            return hist_bucket_max(b);
+        }
+    }
+    return hist_bucket_max(POOL_HIST_BUCKETS - 1);
 }
\ No newline at end of file
@@ -2,6 +2,9 @@
 #define THREAD_POOL_H
 
 #include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
 
 // 1. 定义任务结构体
 // 这里的 function 就是一个通用的函数指针
@@ -13,23 +16,151 @@ typedef struct {
     void *argument;
 } thread_task_t;
 
-// 2. 定义线程池结构体
+// 缓存行大小：生产者、消费者各自修改的下标放在不同的缓存行上，避免互相踢掉对方的缓存 (伪共享)
+#define POOL_CACHE_LINE 64
+
+// 队列的一个槽位：seq 是 Vyukov 有界 MPMC 队列的序号，说明这个槽现在轮到谁
+//   seq == pos       空槽，等下标为 pos 的生产者来写
+//   seq == pos + 1   写好了，等下标为 pos 的消费者来取
+//   取走之后 seq = pos + capacity，留给下一圈的生产者
+typedef struct {
+    atomic_size_t seq;
+    thread_task_t task;
+    _Atomic uint64_t enqueued_ns;  // 入队时间 (单调时钟，纳秒)：弹性模式下监工线程据此判断排队是否太久，
+                                   // 开了统计时用来算排队时间；两者都没开时不记录 (为 0)
+} pool_slot_t;
+
+// 工作窃取模式下每个 Worker 自己的 Chase-Lev 双端队列 (有界，槽位数和全局队列一样)
+//   主人 (这个 Worker 自己) 在 bottom 一端 push / take，后进先出，刚产生的子任务数据还在缓存里；
+//   其他 Worker 在 top 一端用 CAS 偷，先进先出，偷走的是最老、通常也是最大的那块活。
+// 槽位的两个字段都是原子的 (relaxed)：小偷读槽位和主人写槽位可能撞在一起，读到的旧值会因为 CAS 失败被丢掉
+typedef struct {
+    _Atomic(void (*)(void *)) function;
+    _Atomic(void *) argument;
+    _Atomic uint64_t enqueued_ns;
+} pool_deque_slot_t;
+
+// ---- 统计 (THREAD_POOL_STATS) ----
+// 对数-线性直方图 (单位纳秒)：小于 8 的值各占一个桶，之后每个 2 的幂区间再等分成 8 个桶，
+// 相对误差不超过 12.5%；最大到 2^40 ns (约 18 分钟)，更大的都算进最后一个桶
+#define POOL_HIST_SUB_BITS 3
+#define POOL_HIST_MAX_EXP  40
+#define POOL_HIST_BUCKETS  ((POOL_HIST_MAX_EXP - POOL_HIST_SUB_BITS + 2) << POOL_HIST_SUB_BITS)
+
+// 每个 Worker 一份，只有这个 Worker 自己写 (relaxed 原子读写，没有锁也没有 RMW)，thread_pool_stats 随时可以读
 typedef struct {
-    pthread_mutex_t lock;      // 互斥锁
-    pthread_cond_t notify;     // 条件变量
+    atomic_ulong tasks;                          // 执行完的任务数
+    atomic_ulong busy_ns;                        // 执行任务的时间之和 (只算执行完的)
+    atomic_ulong idle_ns;                        // 找不到活 (自旋 + 睡觉) 的时间之和 (只算已经结束的空闲)
+    atomic_ulong busy_since_ns;                  // 正在执行的任务从什么时候开始，没在执行为 0
+    atomic_ulong idle_since_ns;                  // 这次空闲从什么时候开始，没在空闲为 0
+    atomic_ulong wait_hist[POOL_HIST_BUCKETS];   // 排队时间：入队 -> 被这个 Worker 取走
+    atomic_ulong run_hist[POOL_HIST_BUCKETS];    // 执行时间：开始执行 -> 执行完
+} pool_worker_stats_t;
+
+typedef struct {
+    _Alignas(POOL_CACHE_LINE) atomic_long top;     // 小偷取的一端
+    _Alignas(POOL_CACHE_LINE) atomic_long bottom;  // 主人放 / 取的一端
+    pool_deque_slot_t *slots;                      // 普通模式下为 NULL
+    uint32_t rng;                                  // 挑选偷窃对象用的随机数状态，只有主人自己用
+    int index;
+    int state;                                     // POOL_WORKER_*，持 lock 读写
+    pool_worker_stats_t *stats;                    // 没开统计时为 NULL
+    struct thread_pool *pool;
+} pool_worker_t;
+
+// Worker 槽位的状态：弹性模式下线程会退出、槽位会被新线程复用
+#define POOL_WORKER_UNUSED  0  // 没有线程
+#define POOL_WORKER_RUNNING 1
+#define POOL_WORKER_EXITED  2  // 线程已经退出 (空闲超时)，还没 join
+
+// 空闲的 Worker 先自旋这么多轮 (每轮一条 pause 指令，合起来几十微秒) 看有没有新任务，还没有才睡到 futex 上。
+// 只有一个 CPU 时不自旋：自旋的线程占着 CPU，提交任务的线程反而跑不了
+#define POOL_SPIN_ITERS 1000
+
+// 弹性模式的默认参数
+#define THREAD_POOL_GROW_AFTER_US    1000   // 队列里最老的任务等了这么久还没有 Worker 来取，就加一个 Worker
+#define THREAD_POOL_IDLE_TIMEOUT_MS  10000  // 多于 min_threads 的 Worker 闲了这么久就退出
+
+// thread_pool_create_ex 的 flags
+#define THREAD_POOL_WORK_STEALING 1  // 每个 Worker 一个本地双端队列，空闲的 Worker 去别人那里偷
+#define THREAD_POOL_STATS         2  // 记录排队 / 执行时间直方图、队列最高水位等，用 thread_pool_stats 读
+
+// 2. 定义线程池结构体
+// 以前是 一把互斥锁 + 环形数组，每次入队出队都要抢同一把锁，head / tail / count 还挤在同一个缓存行上；
+// 现在任务队列是无锁的 (Vyukov 有界 MPMC 队列)：生产者和消费者各自用 CAS 抢下标，抢到就独占那个槽位。
+// 队列真的空了的 Worker 睡在 park_seq 这个 futex 上，有人在睡时生产者才去 FUTEX_WAKE，
+// 一次入队几个任务就最多叫醒几个 Worker。
+// 工作窃取模式下这个全局队列就是“注入队列”：只接收池子外面 (比如 accept 线程) 提交的任务，
+// Worker 自己提交的任务放进它自己的双端队列。
+typedef struct thread_pool {
+    _Alignas(POOL_CACHE_LINE) atomic_size_t enqueue_pos;  // 生产者 (thread_pool_add) 的下标
+    _Alignas(POOL_CACHE_LINE) atomic_size_t dequeue_pos;  // 消费者 (Worker) 的下标
+    _Alignas(POOL_CACHE_LINE) atomic_int sleepers;        // 正在 (或准备) 睡觉的 Worker 数
+    atomic_uint park_seq;      // Worker 睡觉用的 futex：每次叫醒前 +1，睡前读到的值变了就不睡
+    atomic_int wake_pending;   // 已经 FUTEX_WAKE 过、还没有 Worker 醒来处理：这期间的提交不必再叫
+    atomic_int space_waiters;  // 在 thread_pool_add_wait 里等空位的生产者数
+    atomic_int shutdown;       // 是否关闭
+    _Alignas(POOL_CACHE_LINE) atomic_ulong rejected;      // 统计：被拒绝的提交 (满了 / 已关闭 / 等空位超时)
+    atomic_ulong depth_max;    // 统计：注入队列深度的最高水位 (只有超过旧值时才写)
+
+    pool_slot_t *queue;        // 任务队列数组 (槽位数是 2 的幂)
+    size_t mask;               // 槽位数 - 1
+    int queue_size;            // 队列最大长度 (创建时的参数向上取整到 2 的幂)
+    int spin_iters;            // 睡之前自旋的轮数 (单核时为 0)
+    pthread_mutex_t lock;      // 保护 Worker 增减、监工线程和等空位的生产者 (Worker 睡觉不用它)
+    pthread_cond_t space;      // 队列有空位了 (thread_pool_add_wait 在这上面等)
     pthread_t *threads;        // 线程数组
-    thread_task_t *queue;      // 任务队列数组
-    int thread_count;          // 线程数量
-    int queue_size;            // 队列最大长度
-    int head;                  // 队头
-    int tail;                  // 队尾
-    int count;                 // 当前任务数
-    int shutdown;              // 是否关闭
+    int thread_count;          // 线程槽位数 (= max_threads，弹性模式下不一定每个槽位都有线程)
+    pool_worker_t *workers;    // 每个 Worker 的状态 (双端队列只在工作窃取模式下分配)
+    int work_stealing;         // 创建时带了 THREAD_POOL_WORK_STEALING
+    int stats_enabled;         // 创建时带了 THREAD_POOL_STATS
+    int stamp_tasks;           // 入队时记录时间 (弹性模式或开了统计)
+
+    // 弹性大小 (min_threads < thread_count 时)：监工线程在任务排队太久时加 Worker，
+    // 多出来的 Worker 空闲超时后自己退出
+    int min_threads;
+    atomic_int live_threads;   // 现在活着的 Worker 数
+    atomic_int manager_idle;   // 监工线程在无限期地等 (生产者要叫醒它)
+    pthread_t manager;
+    pthread_cond_t manager_notify;
 } thread_pool_t;
 
+// thread_pool_stats 的结果：所有 Worker 的统计合在一起 (从线程池创建起累计)
+typedef struct {
+    unsigned long tasks;             // 执行完的任务数
+    unsigned long rejected;          // 被拒绝的提交
+    unsigned long queue_depth_max;   // 注入队列深度的最高水位
+    long queue_depth;                // 现在注入队列里大约有多少个任务
+    int live_threads;                // 活着的 Worker 数
+    int sleepers;                    // 正在睡觉的 Worker 数
+    unsigned long busy_ns;           // 所有 Worker 执行任务的时间之和 (包括正在执行的)
+    unsigned long idle_ns;           // 所有 Worker 空闲的时间之和 (包括正在空闲的)
+    unsigned long wait_hist[POOL_HIST_BUCKETS];  // 排队时间直方图 (纳秒)
+    unsigned long run_hist[POOL_HIST_BUCKETS];   // 执行时间直方图 (纳秒)
+} thread_pool_stats_t;
+
 // 3. 函数声明
+// thread_pool_add：队列满了或者线程池已关闭时返回 -1 (不会阻塞)
+//   工作窃取模式下，在这个池子的 Worker 里调用会放进当前 Worker 的本地队列 (满了再退回注入队列)
+// thread_pool_add_batch：一次提交 count 个任务，只做一次唤醒 (最多叫醒 count 个 Worker)；
+//   返回实际提交的个数 (队列满了会少于 count，提交的是 tasks 的前若干个)，线程池已关闭时返回 -1
+// thread_pool_add_wait：队列满了就等空位，最多等 timeout_ms 毫秒 (< 0 一直等，0 等于 thread_pool_add)；
+//   超时或线程池关闭时返回 -1。不要在 Worker 里调用：所有 Worker 都在等空位时没人去腾空位
+// thread_pool_create 等于 thread_pool_create_ex(thread_count, queue_size, 0)
+// thread_pool_create_ex 等于 thread_pool_create_elastic(thread_count, thread_count, queue_size, flags)
+// thread_pool_create_elastic：先启动 min_threads 个 Worker，最多长到 max_threads 个
 thread_pool_t* thread_pool_create(int thread_count, int queue_size);
+thread_pool_t* thread_pool_create_ex(int thread_count, int queue_size, int flags);
+thread_pool_t* thread_pool_create_elastic(int min_threads, int max_threads, int queue_size, int flags);
 int thread_pool_add(thread_pool_t *pool, void (*function)(void *), void *argument);
+int thread_pool_add_batch(thread_pool_t *pool, const thread_task_t *tasks, int count);
+int thread_pool_add_wait(thread_pool_t *pool, void (*function)(void *), void *argument, int timeout_ms);
 int thread_pool_destroy(thread_pool_t *pool);
+// thread_pool_stats：把各个 Worker 的统计合并到 *out，没开 THREAD_POOL_STATS 时返回 -1。
+//   不加锁，和 Worker 并发读，每个计数器各自是准的，互相之间不保证是同一瞬间的值
+// thread_pool_hist_percentile：直方图的第 p 分位 (0 < p <= 1)，返回所在桶的上界 (纳秒)，直方图为空时返回 0
+int thread_pool_stats(thread_pool_t *pool, thread_pool_stats_t *out);
+uint64_t thread_pool_hist_percentile(const unsigned long *hist, double p);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,342 @@
+// 线程池任务队列的测试，两部分：
+// 1. 竞争：1 ~ 16 个生产者同时 thread_pool_add，对比
+//      mutex：以前的实现 (一把锁 + 环形数组，每次入队出队都抢同一把锁，照原样抄在下面)；
+//      mpmc ：现在 thread_pool.c 里的无锁有界 MPMC 队列。
+//    任务本身是空的 (只给一个计数器 +1)，测的纯粹是队列和唤醒的开销；
+//    队列满了生产者就 sched_yield 再试，“满”的次数也一起打印。
+// 2. 子任务：外面提交 SPAWN_ROOTS 个根任务，每个任务再提交两个子任务，一直分到 SPAWN_DEPTH 层
+//    (二叉树，每个根 2^(SPAWN_DEPTH+1)-1 个任务)，做完再来一批，一共 SPAWN_ROUNDS 批，对比
+//      global：所有任务都进同一个全局队列；
+//      steal ：THREAD_POOL_WORK_STEALING，子任务进当前 Worker 的本地队列，闲着的 Worker 去偷。
+//    子任务提交失败 (队列满) 就在当前线程里直接执行，这个次数打印为 inline。
+// 3. 唤醒延迟：每隔 LAT_GAP_US 一次性来 LAT_BURST 个任务 (像 accept 线程一口气接到一批连接)，
+//    间隔里 Worker 都睡着了。对比逐个 thread_pool_add 和一次 thread_pool_add_batch：
+//    从这批任务开始提交到每个任务开始执行的延迟，以及提交线程花在提交上的时间。
+// 编译：cc -O2 thread_pool/thread_pool_bench.c thread_pool/thread_pool.c -o thread_pool/thread_pool_bench -pthread
+// 用法：./thread_pool/thread_pool_bench [Worker 数，默认 4] [每轮任务数 (万)，默认 200]
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "thread_pool.h"
+
+#define QUEUE_SIZE 1024
+#define LAT_BURST 16
+#define LAT_ROUNDS 2000
+#define LAT_GAP_US 1000
+#define SPAWN_ROOTS 16
+#define SPAWN_DEPTH 12
+#define SPAWN_ROUNDS 16
+// 全局 FIFO 队列按层展开这棵树，最宽的一层 (SPAWN_ROOTS * 2^SPAWN_DEPTH 个叶子) 要能全部放下，
+// 不然子任务大多在提交的线程里就地执行，测的就不是队列了
+#define SPAWN_QUEUE_SIZE (SPAWN_ROOTS << (SPAWN_DEPTH + 1))
+
+static const int producer_counts[] = {1, 2, 4, 8, 16};
+
+// ---- 以前的实现：互斥锁 + 条件变量 + 环形数组 ----
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t notify;
+    pthread_t* threads;
+    thread_task_t* queue;
+    int thread_count;
+    int queue_size;
+    int head;
+    int tail;
+    int count;
+    int shutdown;
+} mutex_pool_t;
+
+static void* mutex_pool_worker(void* arg) {
+    mutex_pool_t* pool = arg;
+    while (1) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->count == 0 && !pool->shutdown) {
+            pthread_cond_wait(&pool->notify, &pool->lock);
+        }
+        if (pool->shutdown) {
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+        thread_task_t task = pool->queue[pool->head];
+        pool->head = (pool->head + 1) % pool->queue_size;
+        pool->count--;
+        pthread_mutex_unlock(&pool->lock);
+        task.function(task.argument);
+    }
+}
+
+static mutex_pool_t* mutex_pool_create(int thread_count, int queue_size) {
+    mutex_pool_t* pool = calloc(1, sizeof(*pool));
+    pool->thread_count = thread_count;
+    pool->queue_size = queue_size;
+    pool->queue = malloc(sizeof(thread_task_t) * queue_size);
+    pool->threads = malloc(sizeof(pthread_t) * thread_count);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->notify, NULL);
+    for (int i = 0; i < thread_count; i++) {
+        pthread_create(&pool->threads[i], NULL, mutex_pool_worker, pool);
+    }
+    return pool;
+}
+
+static int mutex_pool_add(mutex_pool_t* pool, void (*function)(void*), void* argument) {
+    int err = 0;
+    pthread_mutex_lock(&pool->lock);
+    if (pool->count == pool->queue_size || pool->shutdown) {
+        err = -1;
+    } else {
+        pool->queue[pool->tail].function = function;
+        pool->queue[pool->tail].argument = argument;
+        pool->tail = (pool->tail + 1) % pool->queue_size;
+        pool->count++;
+        pthread_cond_signal(&pool->notify);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return err;
+}
+
+static void mutex_pool_destroy(mutex_pool_t* pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = 1;
+    pthread_mutex_unlock(&pool->lock);
+    pthread_cond_broadcast(&pool->notify);
+    for (int i = 0; i < pool->thread_count; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    free(pool->queue);
+    free(pool->threads);
+    free(pool);
+}
+
+// ---- 测试 ----
+static atomic_long tasks_done;
+
+static void empty_task(void* arg) {
+    (void)arg;
+    atomic_fetch_add_explicit(&tasks_done, 1, memory_order_relaxed);
+}
+
+typedef struct {
+    int use_mpmc;
+    void* pool;
+    long tasks;
+    long full;  // 队列满、需要重试的次数
+    pthread_barrier_t* start;
+} producer_arg_t;
+
+static void* producer(void* arg) {
+    producer_arg_t* p = arg;
+    pthread_barrier_wait(p->start);
+    for (long i = 0; i < p->tasks; i++) {
+        while ((p->use_mpmc ? thread_pool_add(p->pool, empty_task, NULL)
+                            : mutex_pool_add(p->pool, empty_task, NULL)) != 0) {
+            p->full++;
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// ---- 唤醒延迟 ----
+typedef struct {
+    uint64_t submitted_ns;  // 这批任务开始提交的时间
+    uint64_t* latency_ns;   // 任务开始执行时把延迟写到这里
+} lat_arg_t;
+
+static uint64_t lat_samples[LAT_BURST * LAT_ROUNDS];
+static atomic_long lat_done;
+
+static void lat_task(void* arg) {
+    lat_arg_t* a = arg;
+    *a->latency_ns = now_ns() - a->submitted_ns;
+    atomic_fetch_add_explicit(&lat_done, 1, memory_order_release);
+}
+
+static int cmp_u64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+// 跑一轮唤醒延迟测试，延迟的 p50 / p99 / 平均值 (微秒) 写进 out[0..2]，返回每批提交花的时间 (微秒)
+static double run_latency(int batch, int nworkers, double* out) {
+    thread_pool_t* pool = thread_pool_create(nworkers, QUEUE_SIZE);
+    lat_arg_t args[LAT_BURST];
+    thread_task_t tasks[LAT_BURST];
+    atomic_store(&lat_done, 0);
+    uint64_t submit_ns = 0;
+
+    for (int round = 0; round < LAT_ROUNDS; round++) {
+        // 等上一批做完，再空闲一段时间让 Worker 都去睡觉
+        while (atomic_load_explicit(&lat_done, memory_order_acquire) < (long)round * LAT_BURST) {
+            sched_yield();
+        }
+        usleep(LAT_GAP_US);
+        uint64_t t0 = now_ns();
+        for (int i = 0; i < LAT_BURST; i++) {
+            args[i] = (lat_arg_t){t0, &lat_samples[round * LAT_BURST + i]};
+            tasks[i] = (thread_task_t){lat_task, &args[i]};
+        }
+        if (batch) {
+            for (int n = 0; n < LAT_BURST;) {
+                n += thread_pool_add_batch(pool, tasks + n, LAT_BURST - n);
+            }
+        } else {
+            for (int i = 0; i < LAT_BURST; i++) {
+                while (thread_pool_add(pool, lat_task, &args[i]) != 0) {
+                    sched_yield();
+                }
+            }
+        }
+        submit_ns += now_ns() - t0;
+    }
+    while (atomic_load_explicit(&lat_done, memory_order_acquire) < (long)LAT_ROUNDS * LAT_BURST) {
+        sched_yield();
+    }
+    thread_pool_destroy(pool);
+
+    size_t n = sizeof(lat_samples) / sizeof(lat_samples[0]);
+    qsort(lat_samples, n, sizeof(lat_samples[0]), cmp_u64);
+    double sum = 0;
+    for (size_t i = 0; i < n; i++) sum += lat_samples[i];
+    out[0] = lat_samples[n / 2] / 1e3;
+    out[1] = lat_samples[n * 99 / 100] / 1e3;
+    out[2] = sum / n / 1e3;
+    return submit_ns / 1e3 / LAT_ROUNDS;
+}
+
+// ---- 子任务 ----
+static thread_pool_t* spawn_pool;
+static atomic_long spawn_inline;
+
+// 参数就是剩下的层数，直接塞在指针里
+static void spawn_task(void* arg) {
+    intptr_t depth = (intptr_t)arg;
+    atomic_fetch_add_explicit(&tasks_done, 1, memory_order_relaxed);
+    if (depth == 0) {
+        return;
+    }
+    for (int i = 0; i < 2; i++) {
+        void* child = (void*)(depth - 1);
+        if (thread_pool_add(spawn_pool, spawn_task, child) != 0) {
+            atomic_fetch_add_explicit(&spawn_inline, 1, memory_order_relaxed);
+            spawn_task(child);
+        }
+    }
+}
+
+// 跑一轮子任务测试，返回每秒完成的任务数 (百万)，*inline_out 是子任务入队失败、就地执行的次数
+static double run_spawn(int flags, int nworkers, long* inline_out) {
+    spawn_pool = thread_pool_create_ex(nworkers, SPAWN_QUEUE_SIZE, flags);
+    atomic_store(&tasks_done, 0);
+    atomic_store(&spawn_inline, 0);
+    long per_round = SPAWN_ROOTS * ((2L << SPAWN_DEPTH) - 1);
+    long expected = per_round * SPAWN_ROUNDS;
+
+    double t0 = now_sec();
+    for (int round = 1; round <= SPAWN_ROUNDS; round++) {
+        for (int i = 0; i < SPAWN_ROOTS; i++) {
+            while (thread_pool_add(spawn_pool, spawn_task, (void*)(intptr_t)SPAWN_DEPTH) != 0) {
+                sched_yield();
+            }
+        }
+        while (atomic_load_explicit(&tasks_done, memory_order_relaxed) < per_round * round) {
+            sched_yield();
+        }
+    }
+    double elapsed = now_sec() - t0;
+    thread_pool_destroy(spawn_pool);
+    *inline_out = atomic_load(&spawn_inline);
+    return expected / elapsed / 1e6;
+}
+
+// 跑一轮，返回每秒完成的任务数 (百万)，*full_out 是队列满的次数
+static double run(int use_mpmc, int nworkers, int nproducers, long total, long* full_out) {
+    void* pool = use_mpmc ? (void*)thread_pool_create(nworkers, QUEUE_SIZE) : (void*)mutex_pool_create(nworkers, QUEUE_SIZE);
+    pthread_barrier_t start;
+    pthread_barrier_init(&start, NULL, nproducers + 1);
+    pthread_t tids[16];
+    producer_arg_t args[16];
+    atomic_store(&tasks_done, 0);
+
+    long per_producer = total / nproducers;
+    for (int i = 0; i < nproducers; i++) {
+        args[i] = (producer_arg_t){use_mpmc, pool, per_producer, 0, &start};
+        pthread_create(&tids[i], NULL, producer, &args[i]);
+    }
+    pthread_barrier_wait(&start);
+    double t0 = now_sec();
+    for (int i = 0; i < nproducers; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    // 生产者都结束了，再等 Worker 把队列里剩下的做完
+    long expected = per_producer * nproducers;
+    while (atomic_load_explicit(&tasks_done, memory_order_relaxed) < expected) {
+        sched_yield();
+    }
+    double elapsed = now_sec() - t0;
+
+    if (use_mpmc) {
+        thread_pool_destroy(pool);
+    } else {
+        mutex_pool_destroy(pool);
+    }
+    pthread_barrier_destroy(&start);
+
+    *full_out = 0;
+    for (int i = 0; i < nproducers; i++) *full_out += args[i].full;
+    return expected / elapsed / 1e6;
+}
+
+int main(int argc, char** argv) {
+    int nworkers = argc > 1 ? atoi(argv[1]) : 4;
+    long total = (argc > 2 ? atol(argv[2]) : 200) * 10000;
+    if (nworkers < 1 || total < 16) {
+        fprintf(stderr, "usage: %s [workers] [tasks per run, x10000]\n", argv[0]);
+        return 1;
+    }
+    printf("workers=%d tasks=%ld queue=%d cpus=%ld\n", nworkers, total, QUEUE_SIZE, sysconf(_SC_NPROCESSORS_ONLN));
+    printf("%-10s %14s %14s %12s %12s\n", "producers", "mutex Mops/s", "mpmc Mops/s", "mutex full", "mpmc full");
+    for (size_t i = 0; i < sizeof(producer_counts) / sizeof(producer_counts[0]); i++) {
+        int np = producer_counts[i];
+        long full_mutex, full_mpmc;
+        double mutex_rate = run(0, nworkers, np, total, &full_mutex);
+        double mpmc_rate = run(1, nworkers, np, total, &full_mpmc);
+        printf("%-10d %14.2f %14.2f %12ld %12ld\n", np, mutex_rate, mpmc_rate, full_mutex, full_mpmc);
+    }
+
+    long inline_global, inline_steal;
+    double global_rate = run_spawn(0, nworkers, &inline_global);
+    double steal_rate = run_spawn(THREAD_POOL_WORK_STEALING, nworkers, &inline_steal);
+    printf("\nspawn: %d rounds x %d roots x depth %d (%ld tasks)\n", SPAWN_ROUNDS, SPAWN_ROOTS, SPAWN_DEPTH,
+           SPAWN_ROUNDS * SPAWN_ROOTS * ((2L << SPAWN_DEPTH) - 1));
+    printf("%-10s %14s %14s %12s %12s\n", "", "global Mops/s", "steal Mops/s", "global inline", "steal inline");
+    printf("%-10s %14.2f %14.2f %12ld %12ld\n", "", global_rate, steal_rate, inline_global, inline_steal);
+
+    printf("\nwakeup: %d rounds x burst of %d, %d us apart (latency = burst submitted -> task starts)\n",
+           LAT_ROUNDS, LAT_BURST, LAT_GAP_US);
+    printf("%-10s %10s %10s %10s %16s\n", "submit", "p50 us", "p99 us", "avg us", "submit us/burst");
+    for (int batch = 0; batch < 2; batch++) {
+        double lat[3];
+        double submit_us = run_latency(batch, nworkers, lat);
+        printf("%-10s %10.1f %10.1f %10.1f %16.1f\n", batch ? "batch" : "single", lat[0], lat[1], lat[2], submit_us);
+    }
+    return 0;
+}
@@ -1,79 +1,432 @@
+#define _GNU_SOURCE // accept4
 #include "thread_pool.h"
 #include "../utils.h"
+#include "../protocol.h"
+#include "../log.h"
+#include "../outbuf.h"
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <poll.h>
 #include <unistd.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 
+// 线程池平时 POOL_MIN_THREADS 个 Worker，连接排队超过 THREAD_POOL_GROW_AFTER_US 就加，最多 POOL_MAX_THREADS 个；
+// 一个 Worker 要陪一条连接走完全程，所以上限至少要和期望的并发连接数差不多
+#define POOL_MIN_THREADS 4
+#define POOL_MAX_THREADS 128
+#define POOL_QUEUE_SIZE 100
+// 队列满了 accept 线程最多等这么久 (毫秒)，还是没有空位才关掉这个连接
+#define POOL_SUBMIT_TIMEOUT_MS 1000
+// 监听队列里一次最多取出这么多个连接，用 thread_pool_add_batch 一起交给线程池 (一次唤醒)
+#define ACCEPT_BATCH 32
+
+// -m event (M:N)：一个任务只处理某个连接的一次就绪事件，默认 4 个 Worker 服务所有连接
+#define EVENT_THREADS 4
+#define EVENT_QUEUE_SIZE 1024
+// 每次 epoll_wait 最多取回的就绪事件数，也就是一批最多提交多少个任务
+#define EVENT_MAX_EVENTS 256
+// 一次就绪事件里最多 recv 几次：还没读完就重新武装，让别的连接先来 (内核会马上再报告它)
+#define EVENT_READ_BUDGET 16
+
+// -s：每隔这么多秒打印一次线程池的统计 (这段时间里的增量)，0 表示不统计
+static int stats_interval_sec = 0;
+
 void handle_client(void* arg) {
     int sockfd = *((int*)arg);
     free(arg);
 
     if (send(sockfd, "*", 1, 0) < 1) {
         close(sockfd);
+        conn_release(1);
         return;
     }
 
-    enum {WAIT_FOR_MSG, IN_MSG} state = WAIT_FOR_MSG;
+    ProcessingState state = WAIT_FOR_MSG;
     char buf[1024];
+    // 回显攒在 out 里，读空了接收队列才一次 send (见 threads/threaded_server.c 和 utils.h 的 sendbuf_t)
+    sendbuf_t out;
+    sendbuf_init(&out, sockfd, NULL);
+    int replied = 0;
     while (1) {
-        int n = recv(sockfd, buf, sizeof buf, 0);
-        if (n < 0) {
+        int n = recv(sockfd, buf, sizeof buf, replied ? MSG_DONTWAIT : 0);
+        if (n < 0 && replied && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            n = 0;
+        } else if (n <= 0) {
+            // 对方关闭 (0) 也要退出：以前只判断 < 0，客户端一断开这个 Worker 就在 recv 上空转，
+            // 连接也永远不会归还名额
+            if (n == 0) sendbuf_flush(&out);
             break;
         }
-        for (int i = 0;i < n;i++) {
-            switch (state) {
-                case WAIT_FOR_MSG:
-                    if (buf[i] == '^') {
-                        state = IN_MSG;
-                    }
-                    break;
-                case IN_MSG:
-                    if (buf[i] == '$') {
-                        state = WAIT_FOR_MSG;
-                    } else {
-                        buf[i] += 1;
-                        if(send(sockfd, &buf[i], 1, 0) < 1) {
-                            perror("send error");
-                            close(sockfd);
-                        }
-                    }
-                    break;
+        // 整段交给状态机 (见 protocol.c)
+        size_t msgs = 0;
+        char* dst = sendbuf_reserve(&out, n);
+        if (dst) {
+            sendbuf_commit(&out, protocol_process(&state, buf, n, dst, &msgs));
+        }
+        replied |= msgs > 0;
+        if (dst && replied && n < (int)sizeof buf) {
+            replied = 0;
+            if (sendbuf_flush(&out) < 0) dst = NULL;
+        }
+        if (!dst) {
+            log_error("send error: %m");
+            break;
+        }
+    }
+    close(sockfd);
+    conn_release(1);
+}
+
+// ---------------- -m event：就绪事件驱动的 M:N 模式 ----------------
+// 上面的 handle_client 让一个 Worker 阻塞在一条连接的 recv 上直到连接结束，4 个 Worker 只能服务 4 个客户端。
+// 这里改成：主线程 (poller) 用 epoll 等就绪，每个就绪的连接作为一个任务交给线程池；
+// Worker 用非阻塞的 recv / send 跑完这一轮状态机，然后用 EPOLL_CTL_MOD 重新武装这个 fd 就返回，
+// 不再占着线程等数据。线程数只和 CPU 有关，连接数只受 fd 上限限制。
+// 客户端 fd 都带 EPOLLONESHOT：事件一报出来内核就禁用这个 fd，直到处理它的 Worker 重新武装，
+// 同一个连接任何时刻最多一个 Worker 在处理，event_conn_t 不需要加锁。
+// 重新武装是 Worker 对这个连接做的最后一件事：之后它可能马上被别的 Worker 拿走。
+
+typedef struct {
+    int fd;
+    ProcessingState state;
+    outbuf_t out;           // 对方收得慢、内核发送缓冲区满了时没发出去的回显
+    // 上一个 Worker 重新武装前 release、下一个 Worker 开始时 acquire：
+    // 交接本来靠的是 epoll_ctl / epoll_wait 两次系统调用，这一对原子操作让 C 内存模型也看得见
+    atomic_int handoff;
+} event_conn_t;
+
+static int event_epfd = -1;
+static int event_listenfd = -1;
+// 连接数到上限时把监听 Socket 的事件清空 (不再 accept)，有连接关闭后再恢复
+static atomic_int accept_paused;
+
+static void event_ctl(int op, int fd, uint32_t events, void* ptr) {
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = ptr;
+    if (epoll_ctl(event_epfd, op, fd, &ev) == -1) {
+        log_error("epoll_ctl fd %d: %m", fd);
+    }
+}
+
+// 有名额了就恢复 accept。暂停和恢复的两边都是“先改自己的，再 fence，再看对方的”，
+// 谁最后看到“暂停了、又有空名额”谁负责恢复，exchange 保证只恢复一次
+static void resume_accept_if_room(void) {
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(&accept_paused) && conn_active() < conn_limit_max() && atomic_exchange(&accept_paused, 0)) {
+        event_ctl(EPOLL_CTL_MOD, event_listenfd, EPOLLIN, NULL);
+    }
+}
+
+// close 会把 fd 从 epoll 里摘掉 (ONESHOT 禁用期间只有当前 Worker 持有它)
+static void event_close(event_conn_t* c) {
+    close(c->fd);
+    outbuf_free(&c->out);
+    free(c);
+    conn_release(1);
+    resume_accept_if_room();
+}
+
+// 一个就绪事件：先把上次没发完的发出去，再读到 EAGAIN (最多 EVENT_READ_BUDGET 次)，最后重新武装
+// 有没发完的回显就先不读了 (背压)，只等 EPOLLOUT
+static void serve_ready(void* arg) {
+    event_conn_t* c = (event_conn_t*)arg;
+    char buf[1024];
+    char out[sizeof buf];
+    atomic_load_explicit(&c->handoff, memory_order_acquire);
+
+    while (c->out.len > 0) {
+        ssize_t sent = outbuf_writev(&c->out, c->fd);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            event_close(c);
+            return;
+        }
+    }
+    for (int i = 0; i < EVENT_READ_BUDGET && c->out.len == 0; i++) {
+        ssize_t n = recv(c->fd, buf, sizeof buf, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        if (n <= 0) {
+            event_close(c);
+            return;
+        }
+        size_t produced = protocol_process(&c->state, buf, n, out, NULL);
+        if (produced == 0) continue;
+        ssize_t sent = send(c->fd, out, produced, MSG_NOSIGNAL);
+        if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            event_close(c);
+            return;
+        }
+        if (sent < (ssize_t)produced) {
+            // 短写：剩下的留到 EPOLLOUT
+            size_t done = sent > 0 ? (size_t)sent : 0;
+            outbuf_append(&c->out, out + done, produced - done);
+        }
+    }
+    int fd = c->fd;
+    uint32_t events = (c->out.len > 0 ? EPOLLOUT : EPOLLIN) | EPOLLONESHOT;
+    atomic_store_explicit(&c->handoff, 1, memory_order_release);
+    event_ctl(EPOLL_CTL_MOD, fd, events, c);
+}
+
+// 新连接：'*' 直接发 (新连接的发送缓冲区是空的)，然后挂到 epoll 上等数据
+static void event_add_conn(int fd) {
+    event_conn_t* c = (event_conn_t*)xmalloc(sizeof(event_conn_t));
+    c->fd = fd;
+    c->state = WAIT_FOR_MSG;
+    outbuf_init(&c->out);
+    atomic_init(&c->handoff, 0);
+    if (send(fd, "*", 1, MSG_NOSIGNAL) != 1) {
+        outbuf_append(&c->out, "*", 1);
+    }
+    event_ctl(EPOLL_CTL_ADD, fd, (c->out.len > 0 ? EPOLLOUT : EPOLLIN) | EPOLLONESHOT, c);
+}
+
+// 监听 Socket 就绪：按名额批量 accept；一个名额都没有就暂停监听，等有连接关闭
+static void event_accept(void) {
+    int fds[ACCEPT_BATCH];
+    int drained;
+    int want = conn_acquire(ACCEPT_BATCH);
+    if (want == 0) {
+        atomic_store(&accept_paused, 1);
+        event_ctl(EPOLL_CTL_MOD, event_listenfd, 0, NULL);
+        // 暂停的同时可能正好有连接关闭 (它看到的还是“没暂停”，不会来恢复)，自己再检查一次
+        resume_accept_if_room();
+        return;
+    }
+    int n = accept_batch(event_listenfd, fds, want, &drained);
+    conn_release(want - n);
+    for (int i = 0; i < n; i++) {
+        event_add_conn(fds[i]);
+    }
+}
+
+// poller：只等就绪、只做 accept，就绪的连接一批交给线程池 (一次唤醒)
+// 队列满了就等空位：这段时间不再 epoll_wait，ONESHOT 下没取走的事件留在内核里，不会丢
+static void run_event_loop(int listenfd, thread_pool_t* pool) {
+    event_listenfd = listenfd;
+    event_epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (event_epfd == -1) {
+        perror_die("epoll_create1");
+    }
+    make_socket_non_blocking(listenfd);
+    event_ctl(EPOLL_CTL_ADD, listenfd, EPOLLIN, NULL);
+
+    struct epoll_event events[EVENT_MAX_EVENTS];
+    thread_task_t tasks[EVENT_MAX_EVENTS];
+    while (1) {
+        int n = epoll_wait(event_epfd, events, EVENT_MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno != EINTR) {
+                log_error("epoll_wait: %m");
+            }
+            continue;
+        }
+        int count = 0;
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == NULL) {
+                event_accept();
+            } else {
+                tasks[count++] = (thread_task_t){serve_ready, events[i].data.ptr};
+            }
+        }
+        int submitted = count > 0 ? thread_pool_add_batch(pool, tasks, count) : 0;
+        for (int i = submitted < 0 ? 0 : submitted; i < count; i++) {
+            if (thread_pool_add_wait(pool, serve_ready, tasks[i].argument, -1) != 0) {
+                serve_ready(tasks[i].argument);
             }
         }
     }
 }
 
+// 纳秒换成好读的单位
+static const char* format_ns(char* buf, size_t len, uint64_t ns) {
+    if (ns < 1000000) {
+        snprintf(buf, len, "%.1fus", ns / 1e3);
+    } else if (ns < 1000000000) {
+        snprintf(buf, len, "%.1fms", ns / 1e6);
+    } else {
+        snprintf(buf, len, "%.2fs", ns / 1e9);
+    }
+    return buf;
+}
+
+// 统计线程：定期取一次快照，和上一次相减，打印这段时间里的排队时间、执行时间分布。
+// 排队时间长 = Worker 不够 (或者都被长连接占着)；执行时间长 = 任务本身慢
+static void* stats_reporter(void* arg) {
+    thread_pool_t* pool = (thread_pool_t*)arg;
+    static thread_pool_stats_t prev, cur, delta;
+    char w50[16], w99[16], wmax[16], r50[16], r99[16], rmax[16];
+    while (1) {
+        sleep(stats_interval_sec);
+        thread_pool_stats(pool, &cur);
+        delta = cur;
+        delta.tasks -= prev.tasks;
+        delta.rejected -= prev.rejected;
+        delta.busy_ns -= prev.busy_ns;
+        delta.idle_ns -= prev.idle_ns;
+        for (int b = 0; b < POOL_HIST_BUCKETS; b++) {
+            delta.wait_hist[b] -= prev.wait_hist[b];
+            delta.run_hist[b] -= prev.run_hist[b];
+        }
+        double total_ns = (double)delta.busy_ns + delta.idle_ns;
+        log_info("[pool] tasks=%lu rejected=%lu threads=%d idle=%d queue=%ld (max %lu) busy=%.0f%% conns=%d/%d"
+                 " | wait p50=%s p99=%s max=%s | run p50=%s p99=%s max=%s",
+                 delta.tasks, delta.rejected, delta.live_threads, delta.sleepers, delta.queue_depth,
+                 delta.queue_depth_max, total_ns > 0 ? 100.0 * delta.busy_ns / total_ns : 0.0,
+                 conn_active(), conn_limit_max(),
+                 format_ns(w50, sizeof w50, thread_pool_hist_percentile(delta.wait_hist, 0.5)),
+                 format_ns(w99, sizeof w99, thread_pool_hist_percentile(delta.wait_hist, 0.99)),
+                 format_ns(wmax, sizeof wmax, thread_pool_hist_percentile(delta.wait_hist, 1.0)),
+                 format_ns(r50, sizeof r50, thread_pool_hist_percentile(delta.run_hist, 0.5)),
+                 format_ns(r99, sizeof r99, thread_pool_hist_percentile(delta.run_hist, 0.99)),
+                 format_ns(rmax, sizeof rmax, thread_pool_hist_percentile(delta.run_hist, 1.0)));
+        prev = cur;
+    }
+    return NULL;
+}
+
 int main(int argc, char* argv[]) {
     int port = 9090;
-    if (argc >= 2) {
-        port = atoi(argv[1]);
+    int log_level = LOG_LEVEL_INFO;
+    int min_threads = POOL_MIN_THREADS;
+    int max_threads = POOL_MAX_THREADS;
+    int max_conns = 0;
+    int event_mode = 0;
+    int threads_set = 0;
+    // 用法：thread_pool_server [port] [-v] [-C N] [-t min[,max]] [-s secs] [-m blocking|event]
+    //   -v 打开 DEBUG 日志 (记录每个连接的对端地址)
+    //   -C 最多同时接受 N 个连接 (正在服务的 + 在队列里排队的)，满了就先不 accept
+    //   -t Worker 数的下限和上限 (只给一个数就是固定大小)
+    //   -m blocking (默认) 一个 Worker 陪一条连接走完全程；event 一个任务只处理一次就绪事件 (M:N)，
+    //      默认固定 4 个 Worker，连接数只受 -C / ulimit -n 限制
+    //   -s 每隔 secs 秒打印线程池的统计：排队时间、执行时间的分布，队列最高水位，被拒绝的连接，Worker 忙闲比例
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-v") == 0) {
+            log_level = LOG_LEVEL_DEBUG;
+        } else if (strcmp(argv[i], "-C") == 0 && i + 1 < argc) {
+            max_conns = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            char* comma;
+            min_threads = (int)strtol(argv[++i], &comma, 10);
+            max_threads = *comma == ',' ? atoi(comma + 1) : min_threads;
+            if (min_threads < 1 || max_threads < min_threads) {
+                die("-t: need 1 <= min <= max");
+            }
+            threads_set = 1;
+        } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            stats_interval_sec = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "event") == 0) {
+                event_mode = 1;
+            } else if (strcmp(argv[i], "blocking") != 0) {
+                die("-m: expected blocking or event");
+            }
+        } else {
+            port = atoi(argv[i]);
+        }
     }
 
     int listenfd = listen_inet_socket(port);
     printf("Thread Pool Server listening on port %d\n", port);
+    log_init(log_level, STDERR_FILENO);
+    if (event_mode) {
+        // 连接不占线程：默认固定 EVENT_THREADS 个 Worker，连接上限按 ulimit -n 算
+        if (!threads_set) {
+            min_threads = max_threads = EVENT_THREADS;
+        }
+        conn_limit_init(max_conns);
+    } else {
+        // 默认最多 Worker 上限 + 队列长度个连接：再多的连接既没有线程服务、也进不了队列
+        conn_limit_init(max_conns > 0 ? max_conns : max_threads + POOL_QUEUE_SIZE);
+    }
 
-    thread_pool_t* pool = thread_pool_create(4, 100);
+    thread_pool_t* pool = thread_pool_create_elastic(min_threads, max_threads,
+                                                     event_mode ? EVENT_QUEUE_SIZE : POOL_QUEUE_SIZE,
+                                                     stats_interval_sec > 0 ? THREAD_POOL_STATS : 0);
     if (!pool) {
         die("Failed to create thread pool");
     }
-    printf("Thread pool created with 4 threads\n");
+    if (stats_interval_sec > 0) {
+        pthread_t reporter;
+        if (pthread_create(&reporter, NULL, stats_reporter, pool) != 0) {
+            die("Failed to start stats thread");
+        }
+        pthread_detach(reporter);
+    }
+    printf("Thread pool created with %d-%d threads, max connections %d%s\n", min_threads, max_threads,
+           conn_limit_max(), event_mode ? ", event-driven (M:N)" : "");
+    if (event_mode) {
+        run_event_loop(listenfd, pool);
+    }
 
+    // 监听 Socket 设成非阻塞：poll 等到有连接，再一口气 accept 到 EAGAIN。
+    // 新连接不带 SOCK_NONBLOCK，handle_client 里还是阻塞的 recv / send
+    make_socket_non_blocking(listenfd);
+    thread_task_t tasks[ACCEPT_BATCH];
     while (1) {
-        struct sockaddr_in peer_addr;
-        socklen_t peer_addr_len = sizeof peer_addr;
+        struct pollfd pfd = {listenfd, POLLIN, 0};
+        if (poll(&pfd, 1, -1) < 0) {
+            if (errno != EINTR) {
+                log_error("poll: %m");
+            }
+            continue;
+        }
+        // 准入控制：名额用完就停在 accept 之前，等有连接结束；有名额时最多预占 ACCEPT_BATCH 个。
+        // 有连接到了才预占，不然 poll 等待期间预占的名额会一直算在 conn_active() 里
+        int want = conn_acquire(ACCEPT_BATCH);
+        if (want == 0) {
+            conn_acquire_wait();
+            want = 1;
+        }
 
-        int newsockfd = accept(listenfd, (struct sockaddr*)&peer_addr, &peer_addr_len);
-        if (newsockfd < 0) {
-            perror_die("ERROR on accept");
+        int count = 0;
+        while (count < want) {
+            struct sockaddr_in peer_addr;
+            socklen_t peer_addr_len = sizeof peer_addr;
+            // SOCK_CLOEXEC：accept 出来的 fd 不会被 exec 出去的子进程继承，省掉一次 fcntl
+            int newsockfd = accept4(listenfd, (struct sockaddr*)&peer_addr, &peer_addr_len, SOCK_CLOEXEC);
+            if (newsockfd < 0) {
+                // fd 用完之类暂时性的错误不再让服务器退出
+                int err = errno;
+                if (err == EMFILE || err == ENFILE) {
+                    accept_shed(listenfd);
+                } else if (err != EAGAIN && err != EINTR && err != ECONNABORTED) {
+                    log_error("accept: %s", strerror(err));
+                }
+                if (err == ECONNABORTED || err == EINTR) {
+                    continue;
+                }
+                break;
+            }
+            if (log_enabled(LOG_LEVEL_DEBUG)) {
+                report_peer_connected(&peer_addr, peer_addr_len);
+            }
+            // 防止传递太快，修改地址，所以记下地址传给线程池
+            int* arg = (int*)malloc(sizeof(int));
+            *arg = newsockfd;
+            tasks[count++] = (thread_task_t){handle_client, arg};
         }
-        report_peer_connected(&peer_addr, peer_addr_len);
-        // 防止传递太快，修改地址，所以记下地址传给线程池
-        int* arg = (int*)malloc(sizeof(int));
-        *arg = newsockfd;
+        conn_release(want - count);
 
-        thread_pool_add(pool, handle_client, arg);
+        // 这一批连接一次提交、一次唤醒；队列放不下的逐个等空位 (背压：这段时间不再 accept)，
+        // 等不到再关掉，不让这个连接永远等不到 Worker
+        int submitted = count > 0 ? thread_pool_add_batch(pool, tasks, count) : 0;
+        for (int i = submitted < 0 ? 0 : submitted; i < count; i++) {
+            if (thread_pool_add_wait(pool, handle_client, tasks[i].argument, POOL_SUBMIT_TIMEOUT_MS) != 0) {
+                log_warn("thread pool queue full for %d ms, dropping connection", POOL_SUBMIT_TIMEOUT_MS);
+                close(*(int*)tasks[i].argument);
+                free(tasks[i].argument);
+                conn_release(1);
+            }
+        }
     }
     thread_pool_destroy(pool);
     return 0;
@@ -1,3 +1,5 @@
+#define _GNU_SOURCE // accept4
+#include <errno.h>
 #include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -5,52 +7,92 @@
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "../utils.h"
+#include "../protocol.h"
+#include "../log.h"
 
 typedef struct { int sockfd;} thread_config_t;
 
-typedef enum { WAIT_FOR_MSG, IN_MSG } ProcessingState;
+// -m cached 的默认值：线程数上限、线程栈大小、空闲线程多久之后退出
+#define CACHED_MAX_THREADS 4096
+#define CACHED_STACK_KB 256
+#define CACHED_IDLE_SEC 60
+// -S 的下限：serve_connection 的栈帧里有 16KB 的输出缓冲 (sendbuf_t)，再加上 libc / 日志的余量
+#define MIN_STACK_KB 64
+
+// 线程的统计和 -m cached 的线程缓存，都由 lock 保护
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;          // 空闲线程停在这里等指派
+    int* queue;                   // 等线程接手的连接 (环形队列，容量是连接数上限，准入控制保证不会溢出)
+    int cap;
+    int head;
+    int len;
+    int max_threads;
+    int live;                     // 活着的线程数
+    int idle;                     // 停在 cond 上、还没被指派的线程数
+    int wakeups;                  // 已经指派、还没醒来领取的唤醒次数
+    unsigned long created;        // 新建的线程数
+    unsigned long reused;         // 由服务过别的连接的线程接手的连接数
+    unsigned long queued;         // 线程数到了上限、只能排队的连接数
+    unsigned long expired;        // 空闲超时退出的线程数
+} threads = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static pthread_attr_t thread_attr;
+// -s：每隔这么多秒打印一次线程的统计，0 表示不打印
+static int stats_interval_sec = 0;
 
 void serve_connection(int sockfd) {
+    ProcessingState state = WAIT_FOR_MSG;
+    // 单个连接出错 (比如对方 RST) 只结束这个连接，以前 perror_die 会把整个服务器连同其他连接一起带走
     if (send(sockfd, "*", 1, 0) < 1) {
-        perror_die("send");
+        log_error("send: %m");
+        goto done;
     }
-    ProcessingState state = WAIT_FOR_MSG;
+    // 回显先攒在 out 里 (见 utils.h 的 sendbuf_t)，一条消息不管被 recv 切成几段都只 send 一次
+    sendbuf_t out;
+    sendbuf_init(&out, sockfd, NULL);
+    int replied = 0;    // out 里有已经结束的消息的回显，对方在等
     while(1) {
         uint8_t buf[1024];
-        int len = recv(sockfd, buf, sizeof buf, 0);
+        // 有回复要发时不能阻塞在 recv 上 (对方可能正等着回复才发下一条)，只看看还有没有现成的数据
+        int len = recv(sockfd, buf, sizeof buf, replied ? MSG_DONTWAIT : 0);
 
-        if (len < 0) {
-            perror_die("recv");
+        if (len < 0 && replied && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            len = 0;
+        } else if (len < 0) {
+            log_debug("recv: %m");
+            break;
         } else if (len == 0) {
+            // 对方只关了写端时还能收到没结束的那条消息的回显
+            sendbuf_flush(&out);
             break;
         }
 
-        for (int i = 0;i < len;i++) {
-            switch(state) {
-                case WAIT_FOR_MSG:
-                    if (buf[i] == '^') {
-                        state = IN_MSG;
-                    }
-                    break;
-                case IN_MSG:
-                    if (buf[i] == '$') {
-                        state = WAIT_FOR_MSG;
-                    } else {
-                        buf[i] += 1;
-                        if(send(sockfd, &buf[i], 1, 0) < 1) {
-                            perror("send error");
-                            close(sockfd);
-                            break;
-                        }
-                    }
-                    break;
-            }
+        // 整段交给状态机 (见 protocol.c)
+        size_t msgs = 0;
+        char* dst = sendbuf_reserve(&out, len);
+        if (dst) {
+            sendbuf_commit(&out, protocol_process(&state, (const char*)buf, len, dst, &msgs));
+        }
+        replied |= msgs > 0;
+        // 没读满缓冲区，说明接收队列已经空了：现在就回复，不用再多一次注定 EAGAIN 的 recv
+        // 读满了就先接着读，流水线发来的一批消息跨了几次 recv 也只回一次
+        if (dst && replied && len < (int)sizeof buf) {
+            replied = 0;
+            if (sendbuf_flush(&out) < 0) dst = NULL;
+        }
+        if (!dst) {
+            log_error("send error: %m");
+            break;
         }
     }
+done:
     close(sockfd);
+    conn_release(1);
 }
 
 void* server_thread(void *arg) {
@@ -59,13 +101,145 @@ void* server_thread(void *arg) {
     free(config);
 
     unsigned long id = (unsigned long)pthread_self();
-    printf("Thread %lu created to handle connection with socket %d\n", id, sockfd);
+    log_debug("Thread %lu created to handle connection with socket %d", id, sockfd);
     
     serve_connection(sockfd);
-    printf("Thread %lu done\n", id);
+    log_debug("Thread %lu done", id);
+    pthread_mutex_lock(&threads.lock);
+    threads.live--;
+    pthread_mutex_unlock(&threads.lock);
     return 0;
 }
 
+// ---------------- -m cached：缓存线程 ----------------
+// 默认模式每个连接 pthread_create 一个新线程，服务完就退出。连接频繁建立 / 断开时，建线程 (mmap 栈、clone)
+// 的开销比服务这个连接本身还大；每个线程默认预留 8MB 栈，线程数除了连接数上限之外也没有别的约束。
+// cached 模式 (类似 Java 的 newCachedThreadPool)：
+//   - 服务完一个连接的线程不退出，先看队列里有没有排队的连接，没有就停在条件变量上等下一个，
+//     空闲超过 CACHED_IDLE_SEC 秒才退出；
+//   - 新连接优先交给空闲线程，没有空闲的、线程数也没到上限 (-t) 才新建，到了上限就在队列里排队，
+//     等某个线程服务完手上的连接再来取 (它的 '*' 也要等到那时才发)；
+//   - 线程栈用 pthread_attr_setstacksize 设成 -S 指定的大小 (默认 CACHED_STACK_KB)。
+
+static void* cached_thread(void* arg) {
+    (void)arg;
+    int served = 0;
+    pthread_mutex_lock(&threads.lock);
+    while (1) {
+        while (threads.len == 0) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_MONOTONIC, &deadline);
+            deadline.tv_sec += CACHED_IDLE_SEC;
+            threads.idle++;
+            int rc = 0;
+            while (threads.wakeups == 0 && rc != ETIMEDOUT) {
+                rc = pthread_cond_timedwait(&threads.cond, &threads.lock, &deadline);
+            }
+            if (threads.wakeups == 0) {
+                // 空闲太久，没人指派：退出 (没被指派的线程自己从 idle 里减掉)
+                threads.idle--;
+                threads.live--;
+                threads.expired++;
+                pthread_mutex_unlock(&threads.lock);
+                return NULL;
+            }
+            // 被指派了，idle 已经由指派的一方减掉。连接可能被刚服务完的线程抢先取走，那就接着等
+            threads.wakeups--;
+        }
+        int sockfd = threads.queue[threads.head];
+        threads.head = (threads.head + 1) % threads.cap;
+        threads.len--;
+        if (served++ > 0) {
+            threads.reused++;
+        }
+        pthread_mutex_unlock(&threads.lock);
+
+        serve_connection(sockfd);
+
+        pthread_mutex_lock(&threads.lock);
+    }
+}
+
+static void cached_init(int max_threads) {
+    threads.cap = conn_limit_max();
+    threads.queue = xmalloc(sizeof(int) * threads.cap);
+    threads.max_threads = max_threads;
+    pthread_condattr_t cattr;
+    pthread_condattr_init(&cattr);
+    pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+    pthread_cond_init(&threads.cond, &cattr);
+    pthread_condattr_destroy(&cattr);
+}
+
+// 把一个新连接交给缓存线程：有空闲的就叫醒一个，没有就新建，线程数到了上限就只排队
+static void cached_dispatch(int sockfd) {
+    pthread_mutex_lock(&threads.lock);
+    threads.queue[(threads.head + threads.len) % threads.cap] = sockfd;
+    threads.len++;
+    int spawn = 0;
+    if (threads.idle > 0) {
+        threads.idle--;
+        threads.wakeups++;
+        pthread_cond_signal(&threads.cond);
+    } else if (threads.live < threads.max_threads) {
+        threads.live++;
+        threads.created++;
+        spawn = 1;
+    } else {
+        threads.queued++;
+    }
+    pthread_mutex_unlock(&threads.lock);
+    if (!spawn) {
+        return;
+    }
+
+    pthread_t tid;
+    int rc = pthread_create(&tid, &thread_attr, cached_thread, NULL);
+    if (rc == 0) {
+        return;
+    }
+    // 线程建不出来 (EAGAIN：线程数或内存到了系统上限)：还有别的线程活着，连接就留在队列里等它们；
+    // 一个线程都没有的话没人会来取，只能放弃刚放进去的这个连接
+    log_error("pthread_create: %s", strerror(rc));
+    pthread_mutex_lock(&threads.lock);
+    threads.live--;
+    threads.created--;
+    int drop = threads.live == 0 && threads.len > 0;
+    if (drop) {
+        threads.len--;
+        sockfd = threads.queue[(threads.head + threads.len) % threads.cap];
+    } else {
+        threads.queued++;
+    }
+    pthread_mutex_unlock(&threads.lock);
+    if (drop) {
+        close(sockfd);
+        conn_release(1);
+    }
+}
+
+// 统计线程：新建 / 复用的比例说明线程缓存有没有起作用，queued 说明线程数上限是不是太小
+static void* stats_reporter(void* arg) {
+    (void)arg;
+    unsigned long prev_created = 0, prev_reused = 0, prev_queued = 0, prev_expired = 0;
+    while (1) {
+        sleep(stats_interval_sec);
+        pthread_mutex_lock(&threads.lock);
+        unsigned long created = threads.created, reused = threads.reused;
+        unsigned long queued = threads.queued, expired = threads.expired;
+        int live = threads.live, idle = threads.idle, waiting = threads.len;
+        pthread_mutex_unlock(&threads.lock);
+        log_info("[threads] created=%lu reused=%lu queued=%lu expired=%lu | live=%d idle=%d waiting=%d conns=%d/%d",
+                 created - prev_created, reused - prev_reused, queued - prev_queued, expired - prev_expired,
+                 live, idle, waiting, conn_active(), conn_limit_max());
+        prev_created = created;
+        prev_reused = reused;
+        prev_queued = queued;
+        prev_expired = expired;
+    }
+    return NULL;
+}
+
 /* 为什么我们要用 malloc 给 config 分配内存？能不能直接传 &newsockfd ？
 - newsockfd 是 main 函数里的一个局部变量。
 - 主线程跑得飞快，它马上就会去 accept 下一个连接， 修改 newsockfd 的值。
@@ -78,31 +252,123 @@ void* server_thread(void *arg) {
 int main(int argc, char** argv) {
     setvbuf(stdout, NULL, _IONBF, 0);
     int portnum = 9090;
-    if (argc >= 2) {
-        portnum = atoi(argv[1]);
+    int log_level = LOG_LEVEL_INFO;
+    int max_conns = 0;
+    int cached = 0;
+    int max_threads = CACHED_MAX_THREADS;
+    int stack_kb = -1;
+    // 用法：threaded_server [port] [-v] [-C N] [-m spawn|cached] [-t N] [-S KB] [-s secs]
+    //   -v 打开 DEBUG 日志 (记录每个连接的对端地址和线程)
+    //   -C 最多同时接受 N 个连接，满了就先不 accept，默认按 ulimit -n 计算
+    //   -m spawn (默认) 每个连接新建一个线程 (= 连接数个线程)；cached 服务完的线程留着接下一个连接
+    //   -t cached 模式的线程数上限 (默认 CACHED_MAX_THREADS)，多出来的连接排队等线程空出来
+    //   -S 线程栈大小 (KB)，cached 模式默认 CACHED_STACK_KB，spawn 模式默认用系统的 (通常 8MB)
+    //   -s 每隔 secs 秒打印线程的统计：新建 / 复用 / 排队 / 超时退出
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-v") == 0) {
+            log_level = LOG_LEVEL_DEBUG;
+        } else if (strcmp(argv[i], "-C") == 0 && i + 1 < argc) {
+            max_conns = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "cached") == 0) {
+                cached = 1;
+            } else if (strcmp(argv[i], "spawn") != 0) {
+                die("unknown mode '%s' (expected spawn or cached)", argv[i]);
+            }
+        } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            max_threads = atoi(argv[++i]);
+            if (max_threads < 1) max_threads = 1;
+        } else if (strcmp(argv[i], "-S") == 0 && i + 1 < argc) {
+            stack_kb = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            stats_interval_sec = atoi(argv[++i]);
+        } else {
+            portnum = atoi(argv[i]);
+        }
     }
     printf("Serving on port %d\n", portnum);
     fflush(stdout);//强制把缓冲区里的内容打印到屏幕上 。
+    log_init(log_level, STDERR_FILENO);
+    conn_limit_init(max_conns);
+    printf("Max connections: %d\n", conn_limit_max());
+
+    pthread_attr_init(&thread_attr);
+    pthread_attr_setdetachstate(&thread_attr, PTHREAD_CREATE_DETACHED);
+    if (stack_kb < 0 && cached) {
+        stack_kb = CACHED_STACK_KB;
+    }
+    if (stack_kb >= 0) {
+        if (stack_kb < MIN_STACK_KB) stack_kb = MIN_STACK_KB;
+        int rc = pthread_attr_setstacksize(&thread_attr, (size_t)stack_kb * 1024);
+        if (rc != 0) {
+            die("pthread_attr_setstacksize(%dKB): %s", stack_kb, strerror(rc));
+        }
+    }
+    if (cached) {
+        cached_init(max_threads);
+        printf("Cached threads: at most %d, stack %dKB, idle timeout %ds\n", max_threads, stack_kb, CACHED_IDLE_SEC);
+    }
+    if (stats_interval_sec > 0) {
+        pthread_t reporter;
+        if (pthread_create(&reporter, &thread_attr, stats_reporter, NULL) != 0) {
+            die("Failed to start stats thread");
+        }
+    }
 
     int sockfd = listen_inet_socket(portnum);//以9090进行监听，不是广播
 
     while(1) {
         struct sockaddr_in peer_addr;
         socklen_t peer_addr_len = sizeof(peer_addr);
+        // 准入控制：线程数到上限就停在这里，等某个连接结束再 accept
+        // 新连接在内核的监听队列里排队，已有的线程不会被越来越多的线程挤得越来越慢
+        conn_acquire_wait();
         /*接受连接请求，表示连通了 */
-        int newsockfd = accept(sockfd, (struct sockaddr*)&peer_addr, &peer_addr_len);
+        // SOCK_CLOEXEC：accept 出来的 fd 不会被 exec 出去的子进程继承，省掉一次 fcntl
+        int newsockfd = accept4(sockfd, (struct sockaddr*)&peer_addr, &peer_addr_len, SOCK_CLOEXEC);
         if (newsockfd < 0) {
-            perror_die("ERROR on accept");
+            // 以前这里直接 perror_die：fd 用完 (EMFILE) 这种暂时性的错误会让整个服务器退出
+            int err = errno;
+            conn_release(1);
+            if (err == EMFILE || err == ENFILE) {
+                accept_shed(sockfd);
+            } else if (err != EINTR && err != ECONNABORTED) {
+                log_error("accept: %s", strerror(err));
+            }
+            continue;
+        }
+        if (log_enabled(LOG_LEVEL_DEBUG)) {
+            report_peer_connected(&peer_addr, peer_addr_len);
+        }
+        if (cached) {
+            cached_dispatch(newsockfd);
+            continue;
         }
-        report_peer_connected(&peer_addr, peer_addr_len);
         pthread_t the_thread;
         thread_config_t* config = (thread_config_t*)malloc(sizeof*(config));
         if (!config) {
             die("OOM");
         }
         config->sockfd = newsockfd;
-        pthread_create(&the_thread, NULL, server_thread, config);
-        pthread_detach(the_thread);
+        pthread_mutex_lock(&threads.lock);
+        threads.live++;
+        threads.created++;
+        pthread_mutex_unlock(&threads.lock);
+        // thread_attr 带了 PTHREAD_CREATE_DETACHED，不用再 pthread_detach
+        int rc = pthread_create(&the_thread, &thread_attr, server_thread, config);
+        if (rc != 0) {
+            // 线程建不出来 (EAGAIN：线程数或内存到了系统上限)，这个连接只能放弃
+            log_error("pthread_create: %s", strerror(rc));
+            pthread_mutex_lock(&threads.lock);
+            threads.live--;
+            threads.created--;
+            pthread_mutex_unlock(&threads.lock);
+            free(config);
+            close(newsockfd);
+            conn_release(1);
+            continue;
+        }
     }
     return 0;
 }
@@ -0,0 +1,132 @@
+#include "timer_wheel.h"
+
+#define SLOT_MASK (TIMER_WHEEL_SLOTS - 1)
+
+static inline void list_init(timer_node_t* head) {
+    head->next = head->prev = head;
+}
+
+static inline void list_append(timer_node_t* head, timer_node_t* node) {
+    node->prev = head->prev;
+    node->next = head;
+    head->prev->next = node;
+    head->prev = node;
+}
+
+static inline void list_unlink(timer_node_t* node) {
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    node->next = node->prev = NULL;
+}
+
+void timer_wheel_init(timer_wheel_t* tw, unsigned tick_ms, uint64_t now_ms) {
+    tw->now = 0;
+    tw->start_ms = now_ms;
+    tw->tick_ms = tick_ms ? tick_ms : 1;
+    tw->count = 0;
+    for (int l = 0; l < TIMER_WHEEL_LEVELS; l++) {
+        for (int s = 0; s < TIMER_WHEEL_SLOTS; s++) {
+            list_init(&tw->slots[l][s]);
+        }
+    }
+}
+
+// 按离现在还有多远决定挂在哪一层：第 l 层的槽号取 expire 的第 l 组 6 位
+static void place(timer_wheel_t* tw, timer_node_t* node) {
+    uint64_t expire = node->expire;
+    if (expire <= tw->now) {
+        // 已经过期的放到下一个要处理的 tick 上
+        expire = tw->now + 1;
+    }
+    uint64_t delta = expire - tw->now;
+    int level = 0;
+    while (level < TIMER_WHEEL_LEVELS - 1 && delta >= (1ull << (TIMER_WHEEL_BITS * (level + 1)))) {
+        level++;
+    }
+    if (level == TIMER_WHEEL_LEVELS - 1 && delta >= (1ull << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))) {
+        // 超出时间轮的范围 (tick = 100ms 时约 19 天)：先挂在最远的位置，到时候 cascade 会重新计算
+        expire = tw->now + (1ull << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1;
+    }
+    int slot = (int)((expire >> (TIMER_WHEEL_BITS * level)) & SLOT_MASK);
+    list_append(&tw->slots[level][slot], node);
+}
+
+void timer_add(timer_wheel_t* tw, timer_node_t* node, uint64_t expire) {
+    if (timer_pending(node)) {
+        list_unlink(node);
+    } else {
+        tw->count++;
+    }
+    node->expire = expire;
+    place(tw, node);
+}
+
+void timer_del(timer_wheel_t* tw, timer_node_t* node) {
+    if (timer_pending(node)) {
+        list_unlink(node);
+        tw->count--;
+    }
+}
+
+// 把第 level 层当前槽里的定时器全部取出来，按剩余时间重新放 (会落到更低的层)
+static void cascade(timer_wheel_t* tw, int level) {
+    int slot = (int)((tw->now >> (TIMER_WHEEL_BITS * level)) & SLOT_MASK);
+    timer_node_t* head = &tw->slots[level][slot];
+    timer_node_t pending;
+    if (head->next == head) return;
+
+    // 先整体搬到临时链表上，避免重新放回同一个槽时无限循环
+    pending.next = head->next;
+    pending.prev = head->prev;
+    pending.next->prev = &pending;
+    pending.prev->next = &pending;
+    list_init(head);
+
+    while (pending.next != &pending) {
+        timer_node_t* node = pending.next;
+        list_unlink(node);
+        if (node->expire <= tw->now) {
+            // 正好在这个 tick 到期：放进马上就要处理的第 0 层当前槽
+            list_append(&tw->slots[0][tw->now & SLOT_MASK], node);
+        } else {
+            place(tw, node);
+        }
+    }
+}
+
+int timer_wheel_advance(timer_wheel_t* tw, uint64_t now_ms, timer_expire_cb cb, void* arg) {
+    if (now_ms < tw->start_ms) return 0;
+    uint64_t target = (now_ms - tw->start_ms) / tw->tick_ms;
+    int fired = 0;
+
+    while (tw->now < target) {
+        // 轮子空着的时候直接跳到目标时间，不用一个 tick 一个 tick 地走
+        if (tw->count == 0) {
+            __atomic_store_n(&tw->now, target, __ATOMIC_RELAXED);
+            break;
+        }
+        __atomic_store_n(&tw->now, tw->now + 1, __ATOMIC_RELAXED);
+
+        // 第 0 层转完一圈 (槽号回到 0)，从上一层拿下一批；上一层也转完一圈就继续往上
+        for (int level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+            if ((tw->now & ((1ull << (TIMER_WHEEL_BITS * level)) - 1)) != 0) break;
+            cascade(tw, level);
+        }
+
+        timer_node_t* head = &tw->slots[0][tw->now & SLOT_MASK];
+        while (head->next != head) {
+            timer_node_t* node = head->next;
+            list_unlink(node);
+            tw->count--;
+            if (node->expire > tw->now) {
+                // 被 clamp 到远处的超长定时器：还没到，重新放
+                tw->count++;
+                place(tw, node);
+                continue;
+            }
+            fired++;
+            cb(node, arg);
+        }
+    }
+    return fired;
+}
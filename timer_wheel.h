@@ -0,0 +1,70 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// 分层时间轮 (Hierarchical Timing Wheel)，用来做连接超时
+//
+// 为什么不用最小堆？每个连接每收到一点数据都要把超时往后推，堆的话就是一次 O(log N) 的调整；
+// 时间轮的插入 / 删除都是 O(1) 的链表操作，而且我们连“往后推”都不做：
+// 连接活跃时只记一下时间戳 (一次赋值)，定时器到期时再检查一遍真正的截止时间，
+// 没到就按新的截止时间重新挂回去 (懒更新)。一个一直活跃的连接，每个超时周期只会被摸一次。
+//
+// 结构：4 层，每层 64 个槽，以 tick 为单位；第 0 层覆盖 64 个 tick，第 1 层 64^2 个，以此类推。
+// 每走完第 0 层一圈，就把第 1 层对应槽里的定时器按剩余时间重新分散 (cascade) 到低层。
+// 超出最大范围的定时器挂在最高层，到时候会重新计算。
+
+#define TIMER_WHEEL_LEVELS 4
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+
+// 嵌在连接状态结构体里的定时器节点 (侵入式双向链表，不需要额外分配内存)
+typedef struct timer_node {
+    struct timer_node* next;
+    struct timer_node* prev;
+    uint64_t expire;  // 到期的 tick
+} timer_node_t;
+
+typedef struct {
+    uint64_t now;        // 当前 tick (已经处理到的时间点)
+    uint64_t start_ms;   // tick 0 对应的单调时钟毫秒数
+    unsigned tick_ms;    // 一个 tick 多少毫秒
+    unsigned count;      // 挂着的定时器个数
+    timer_node_t slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];  // 每个槽是一个带哨兵的循环链表
+} timer_wheel_t;
+
+typedef void (*timer_expire_cb)(timer_node_t* node, void* arg);
+
+void timer_wheel_init(timer_wheel_t* tw, unsigned tick_ms, uint64_t now_ms);
+
+// 节点使用前先初始化 (未挂在轮子上)
+static inline void timer_node_init(timer_node_t* node) {
+    node->next = node->prev = NULL;
+}
+
+static inline int timer_pending(const timer_node_t* node) {
+    return node->next != NULL;
+}
+
+// 当前 tick：连接活跃时记录下来就行，不需要碰定时器本身
+// (Leader/Follower 模式下别的线程可能正在推进时间轮，用 relaxed 原子读)
+static inline uint64_t timer_wheel_now(const timer_wheel_t* tw) {
+    return __atomic_load_n(&tw->now, __ATOMIC_RELAXED);
+}
+
+// 把毫秒换算成 tick (向上取整，保证不会提前到期)
+static inline uint64_t timer_wheel_ticks(const timer_wheel_t* tw, uint64_t ms) {
+    return (ms + tw->tick_ms - 1) / tw->tick_ms;
+}
+
+// 挂到 expire (绝对 tick) 上；已经挂着的先摘下来。O(1)
+void timer_add(timer_wheel_t* tw, timer_node_t* node, uint64_t expire);
+// 摘下来 (没挂着也可以调用)。O(1)
+void timer_del(timer_wheel_t* tw, timer_node_t* node);
+
+// 把时间推进到 now_ms，对每个到期的节点调用 cb (调用前节点已经摘下，cb 里可以重新 timer_add)
+// 返回到期的个数
+int timer_wheel_advance(timer_wheel_t* tw, uint64_t now_ms, timer_expire_cb cb, void* arg);
+
+#endif
@@ -1,14 +1,20 @@
+#define _GNU_SOURCE // accept4
 #include "utils.h"
+#include "log.h"
 
+#include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/types.h>
-#define _GNU_SOURCE
-#include <netdb.h>
+#include <sys/resource.h>
+#include <arpa/inet.h>
+#include <unistd.h>
 
 #define N_BACKLOG 64
 
@@ -34,19 +40,176 @@ void perror_die(char* msg) {
     exit(EXIT_FAILURE);
 }
 void report_peer_connected(const struct sockaddr_in* sa, socklen_t salen) {
-    char hostbuf[NI_MAXHOST];//用来存 对方的 IP 地址
-    char portbuf[NI_MAXSERV];//用来存 对方的端口号
+    char hostbuf[INET_ADDRSTRLEN];//用来存 对方的 IP 地址 (点分十进制)
 
-    if (getnameinfo((struct sockaddr*)sa, salen, hostbuf, NI_MAXHOST, portbuf, NI_MAXHOST, 0) == 0) {
-        //把翻译好的 IP 填进 hostbuf ，把端口填进 portbuf
-        //如果翻译成功（返回0），就打印“peer (hostname, port) connected”；如果失败，就打印“peer (unknown) connected”。
-        printf("peer (%s, %s) connected\n", hostbuf, portbuf);
+    //以前用 getnameinfo：不带 NI_NUMERICHOST 时它会做反向 DNS 查询，一次可能卡上好几秒，
+    //accept 循环就这样被堵住了。现在只做纯数字格式化，不碰网络。
+    if (salen >= sizeof(*sa) && inet_ntop(AF_INET, &sa->sin_addr, hostbuf, sizeof(hostbuf))) {
+        log_debug("peer (%s, %u) connected", hostbuf, ntohs(sa->sin_port));
     } else {
-        printf("peer (unknown) connected\n");
+        log_debug("peer (unknown) connected");
     }
 }
 
+int accept_batch(int listenfd, int* fds, int max, int* drained) {
+    int n = 0;
+    *drained = 0;
+    while (n < max) {
+        struct sockaddr_in peer_addr;
+        socklen_t peer_addr_len = sizeof(peer_addr);
+        //不打日志时连对端地址都不要，内核就不用往用户态拷贝 sockaddr
+        //accept4 直接带上 SOCK_NONBLOCK|SOCK_CLOEXEC，省掉 make_socket_non_blocking 的两次 fcntl
+        int fd = log_enabled(LOG_LEVEL_DEBUG)
+            ? accept4(listenfd, (struct sockaddr*)&peer_addr, &peer_addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC)
+            : accept4(listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                //被信号打断，或者对端在握手完成后、accept 之前就断开了：跳过它接着取
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                //监听队列空了 (或者被别的线程抢先取走了)，不算错误
+                *drained = 1;
+            } else if (errno == EMFILE || errno == ENFILE) {
+                //fd 用完了：丢掉排在最前面的那个连接，剩下的等下一轮 (到时候可能已经有连接关掉了)
+                accept_shed(listenfd);
+            } else {
+                log_error("accept4: %m");
+            }
+            break;
+        }
+        if (log_enabled(LOG_LEVEL_DEBUG)) {
+            report_peer_connected(&peer_addr, peer_addr_len);
+        }
+        fds[n++] = fd;
+    }
+    return n;
+}
+
+static int conn_max = 0;
+static int conn_count = 0;      //原子操作访问
+static int conn_waiters = 0;    //conn_acquire_wait 里睡着的线程数，没人等的时候 conn_release 不碰锁
+static pthread_mutex_t conn_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t conn_freed = PTHREAD_COND_INITIALIZER;
+static int spare_fd = -1;
+static pthread_mutex_t spare_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void conn_limit_init(int max_conns) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+        //软限制默认往往只有 1024，能提就提到硬限制 (相当于自动 ulimit -n)
+        if (rl.rlim_cur < rl.rlim_max) {
+            rl.rlim_cur = rl.rlim_max;
+            setrlimit(RLIMIT_NOFILE, &rl);
+            getrlimit(RLIMIT_NOFILE, &rl);
+        }
+        int by_fds = rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur > 1000000 ? 1000000 : (int)rl.rlim_cur;
+        by_fds = by_fds > 2 * CONN_FD_RESERVE ? by_fds - CONN_FD_RESERVE : by_fds / 2;
+        if (max_conns <= 0 || max_conns > by_fds) {
+            if (max_conns > by_fds) {
+                log_warn("max connections %d exceeds the fd limit, using %d", max_conns, by_fds);
+            }
+            max_conns = by_fds;
+        }
+    } else if (max_conns <= 0) {
+        max_conns = 1024 - CONN_FD_RESERVE;
+    }
+    conn_max = max_conns;
+
+    //备用 fd：平时什么都不干，只是占着一个位置
+    spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (spare_fd < 0) {
+        log_warn("open spare fd: %m");
+    }
+}
+
+int conn_limit_max() {
+    return conn_max;
+}
+
+int conn_active() {
+    return __atomic_load_n(&conn_count, __ATOMIC_RELAXED);
+}
+
+int conn_acquire(int want) {
+    int cur = __atomic_load_n(&conn_count, __ATOMIC_RELAXED);
+    while (1) {
+        int room = conn_max - cur;
+        if (room <= 0) {
+            return 0;
+        }
+        int take = want < room ? want : room;
+        //多个线程同时 accept 时 (Leader/Follower)，用 CAS 保证加起来不会超过上限
+        if (__atomic_compare_exchange_n(&conn_count, &cur, cur + take, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            return take;
+        }
+    }
+}
+
+void conn_acquire_wait() {
+    if (conn_acquire(1)) {
+        return;
+    }
+    pthread_mutex_lock(&conn_lock);
+    __atomic_add_fetch(&conn_waiters, 1, __ATOMIC_SEQ_CST);
+    while (!conn_acquire(1)) {
+        pthread_cond_wait(&conn_freed, &conn_lock);
+    }
+    __atomic_sub_fetch(&conn_waiters, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&conn_lock);
+}
+
+void conn_release(int n) {
+    if (n <= 0) {
+        return;
+    }
+    __atomic_sub_fetch(&conn_count, n, __ATOMIC_SEQ_CST);
+    //等待者先登记再检查名额，这里先归还再检查等待者，两边都是 SEQ_CST，不会错过唤醒
+    if (__atomic_load_n(&conn_waiters, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&conn_lock);
+        pthread_cond_broadcast(&conn_freed);
+        pthread_mutex_unlock(&conn_lock);
+    }
+}
+
+int accept_shed(int listenfd) {
+    static int shed_count = 0;
+    int shed = 0;
+    pthread_mutex_lock(&spare_lock);
+    if (spare_fd >= 0) {
+        close(spare_fd);
+        //监听 Socket 可能是阻塞的 (阻塞式服务器、io_uring)：确认队列里确实有连接再 accept，免得卡住
+        struct pollfd pfd = { .fd = listenfd, .events = POLLIN };
+        if (poll(&pfd, 1, 0) == 1) {
+            int fd = accept4(listenfd, NULL, NULL, SOCK_CLOEXEC);
+            if (fd >= 0) {
+                close(fd);
+                shed = 1;
+            }
+        }
+        spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    }
+    pthread_mutex_unlock(&spare_lock);
+    if (shed) {
+        int total = __atomic_add_fetch(&shed_count, 1, __ATOMIC_RELAXED);
+        log_warn("out of file descriptors, dropped a new connection (%d so far)", total);
+    } else {
+        log_error("accept: out of file descriptors: %m");
+    }
+    return shed;
+}
+
+static int listen_inet_socket_opts(int portnum, int reuseport);
+
 int listen_inet_socket(int portnum) {
+    return listen_inet_socket_opts(portnum, 0);
+}
+
+int listen_inet_reuseport_socket(int portnum) {
+    return listen_inet_socket_opts(portnum, 1);
+}
+
+static int listen_inet_socket_opts(int portnum, int reuseport) {
     int sockfd = socket(AF_INET, SOCK_STREAM, 0);
     //创建socket实例，AF_INET表明ipv4，SOCK_STREAM表明tcp协议
     if (sockfd < 0) {
@@ -61,6 +224,13 @@ int listen_inet_socket(int portnum) {
         perror_die("setsockopt");
     }
 
+    if (reuseport && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+        /*SO_REUSEPORT 允许多个 socket 绑定同一个端口（同一个 reuseport 组），
+        内核按四元组哈希把新连接分散到组里的各个 socket 上，
+        这样多个进程可以各自 accept，不用再抢同一个监听队列。*/
+        perror_die("setsockopt SO_REUSEPORT");
+    }
+
     struct sockaddr_in serv_addr;
     memset(&serv_addr, 0, sizeof(serv_addr));
     serv_addr.sin_family = AF_INET;
@@ -97,4 +267,31 @@ void make_socket_non_blocking(int sockfd) {
         而是返回0表示没有数据可读。*/
         perror_die("fcntl F_SETFL O_NONBLOCK");
     }
-}
\ No newline at end of file
+}
+
+void sendbuf_init(sendbuf_t* sb, int fd, send_fn_t send_fn) {
+    sb->fd = fd;
+    sb->send_fn = send_fn ? send_fn : send;
+    sb->len = 0;
+}
+
+char* sendbuf_reserve(sendbuf_t* sb, size_t need) {
+    if (SENDBUF_SIZE - sb->len < need && sendbuf_flush(sb) < 0) {
+        return NULL;
+    }
+    return sb->data + sb->len;
+}
+
+int sendbuf_flush(sendbuf_t* sb) {
+    size_t sent = 0;
+    while (sent < sb->len) {
+        ssize_t n = sb->send_fn(sb->fd, sb->data + sent, sb->len - sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        sent += (size_t)n;
+    }
+    sb->len = 0;
+    return 0;
+}
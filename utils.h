@@ -5,11 +5,65 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 
-void die(char* fmt, ...);
+void die(char* fmt, ...) __attribute__((noreturn));
 void* xmalloc(size_t size);
-void perror_die(char* msg);
+void perror_die(char* msg) __attribute__((noreturn));
+// 以 DEBUG 级别记录对端地址 (见 log.h)
 void report_peer_connected(const struct sockaddr_in* sa, socklen_t salen);
 int listen_inet_socket(int portnum);
+int listen_inet_reuseport_socket(int portnum);
 void make_socket_non_blocking(int sockfd);
+// 从非阻塞的监听 Socket 上一口气 accept 最多 max 个连接，fd 写进 fds，返回个数
+// 新连接已经是 O_NONBLOCK | FD_CLOEXEC 的；打开 DEBUG 日志时顺便记录对端地址
+// *drained 为 1 表示已经 accept 到 EAGAIN (监听队列空了)，为 0 表示是被 max 截断或出错停下的
+// fd 用完 (EMFILE/ENFILE) 时会调用 accept_shed 丢掉一个连接，然后停下
+int accept_batch(int listenfd, int* fds, int max, int* drained);
+
+// ---- 过载保护 (准入控制) ----
+// 所有服务器共用一个进程内的连接计数：accept 之前先占名额，满了就不再 accept (事件驱动的服务器
+// 把监听 Socket 从 poll 集合里拿掉，阻塞式的服务器停在 accept 之前)，新连接留在内核的监听队列里排队，
+// 已经接进来的连接不受影响。
+// max_conns <= 0 表示按 RLIMIT_NOFILE 自动计算 (先把软限制提到硬限制，再留出 CONN_FD_RESERVE 个 fd
+// 给监听 Socket、epoll、日志等)。同时打开一个备用 fd，见 accept_shed。
+#define CONN_FD_RESERVE 64
+void conn_limit_init(int max_conns);
+int conn_limit_max();
+// 当前占用的名额 (已接受、还没关闭的连接数)
+int conn_active();
+// 为接下来的 accept 预占最多 want 个名额，返回实际拿到的个数，0 表示已经满了
+int conn_acquire(int want);
+// 阻塞式服务器用：等到有空名额为止，占一个
+void conn_acquire_wait();
+// 连接关闭 (或预占了没用上) 时归还 n 个名额
+void conn_release(int n);
+// accept 因 EMFILE/ENFILE 失败时调用：关掉备用 fd 腾出一个位置，把排在最前面的连接 accept 出来立刻关掉，
+// 再把备用 fd 占回来。对方会马上收到关闭，而不是一直挂在监听队列里；水平触发的监听 Socket 也不会因为
+// 一直可读、却怎么都 accept 不出来而空转。返回 1 表示丢掉了一个连接
+int accept_shed(int listenfd);
+
+// ---- 阻塞式服务器的输出缓冲 ----
+// 以前每段 recv 的回显马上 send 一次：大消息被 1KB 的接收缓冲切成好几段，一条消息要好几次 send，
+// 第二段起的小包还会被 Nagle 扣住，等对方的延迟 ACK (约 40ms)。现在回显先攒在每个连接自己的缓冲里，
+// 一条消息结束时 (或者攒满了) 才一次发出去。
+#define SENDBUF_SIZE (16 * 1024)
+
+typedef ssize_t (*send_fn_t)(int sockfd, const void* buf, size_t len, int flags);
+
+typedef struct {
+    int fd;
+    send_fn_t send_fn;            // 默认是 send，协程服务器换成 co_send
+    size_t len;                   // 攒着还没发的字节数
+    char data[SENDBUF_SIZE];
+} sendbuf_t;
+
+// send_fn 为 NULL 时用 send
+void sendbuf_init(sendbuf_t* sb, int fd, send_fn_t send_fn);
+// 返回尾部可写的位置，保证至少有 need (<= SENDBUF_SIZE) 字节空间，不够就先把攒着的发出去；发送出错返回 NULL
+char* sendbuf_reserve(sendbuf_t* sb, size_t need);
+static inline void sendbuf_commit(sendbuf_t* sb, size_t n) {
+    sb->len += n;
+}
+// 把攒着的全部发出去 (带 MSG_NOSIGNAL，对方已经关闭时返回错误而不是 SIGPIPE)，出错返回 -1，errno 有效
+int sendbuf_flush(sendbuf_t* sb);
 
 #endif 
\ No newline at end of file
@@ -0,0 +1,235 @@
+// MSG_ZEROCOPY 基准：同样的大消息回显，对比 epoll 服务器走普通拷贝 (-L) 和 zerocopy (-z) 时
+// 每回显 1GB 数据服务器进程要花多少 CPU 时间 (用户态 + 内核态)
+// 编译：cc -O2 zerocopy_bench.c -o zerocopy_bench
+// 用法：./zerocopy_bench [服务器程序，默认 ./epoll_server/server] [每轮回显的 MB 数，默认 1024]
+//
+// 每轮启动一个全新的单线程服务器，NCONN 个连接不停地发 '^' + payload + '$'，同时读回显并校验；
+// 传完之后杀掉服务器，用 wait4 拿到它整个生命周期的 rusage (启动开销只有几毫秒，可以忽略)。
+// 注意：对端在本机时 (loopback / veth) 内核收包总要拷贝一次，zerocopy 的通知会带上
+// SO_EE_CODE_ZEROCOPY_COPIED，服务器随即对这个连接退回普通发送。要看到真正的节省需要跨机器、经过真实网卡。
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#define NCONN 4
+#define BENCH_PORT 9190
+#define ZEROCOPY_THRESHOLD "16384"
+
+static const size_t payload_sizes[] = {64 * 1024, 1024 * 1024};
+
+typedef struct {
+    const char* name;
+    const char* flag;
+    const char* arg;
+} bench_mode_t;
+
+static const bench_mode_t modes[] = {
+    {"copy", "-L", NULL},
+    {"zerocopy", "-z", ZEROCOPY_THRESHOLD},
+};
+
+typedef struct {
+    int fd;
+    int greeted;       // 收到 '*' 了没有
+    size_t send_off;   // 当前消息发到哪里了
+    size_t msgs_sent;
+    size_t echoed;     // 收到的回显字节数
+} conn_t;
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void die(const char* what) {
+    perror(what);
+    exit(EXIT_FAILURE);
+}
+
+static pid_t start_server(const char* prog, const bench_mode_t* mode, int port) {
+    char portstr[16];
+    snprintf(portstr, sizeof(portstr), "%d", port);
+    pid_t pid = fork();
+    if (pid < 0) die("fork");
+    if (pid == 0) {
+        // 超时全部关掉；服务器的输出丢掉，别和结果表混在一起
+        int devnull = open("/dev/null", 0);
+        dup2(devnull, STDOUT_FILENO);
+        dup2(devnull, STDERR_FILENO);
+        if (mode->arg) {
+            execl(prog, prog, "-T", "0,0,0", mode->flag, mode->arg, portstr, (char*)NULL);
+        } else {
+            execl(prog, prog, "-T", "0,0,0", mode->flag, portstr, (char*)NULL);
+        }
+        _exit(127);
+    }
+    return pid;
+}
+
+static int connect_retry(int port) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    for (int tries = 0; tries < 200; tries++) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0) die("socket");
+        if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0) return fd;
+        close(fd);
+        usleep(10 * 1000);  // 服务器还没 listen
+    }
+    fprintf(stderr, "cannot connect to port %d\n", port);
+    exit(EXIT_FAILURE);
+}
+
+// 跑一轮：每个连接回显 per_conn 字节，返回用时 (秒)
+static double run_clients(conn_t* conns, const char* msg, size_t payload, const char* expect, size_t per_conn) {
+    static char buf[256 * 1024];
+    size_t msg_len = payload + 2;
+    size_t msgs_needed = (per_conn + payload - 1) / payload;
+    int done = 0;
+    double start = now_sec();
+
+    while (done < NCONN) {
+        struct pollfd pfds[NCONN];
+        for (int i = 0; i < NCONN; i++) {
+            conn_t* c = &conns[i];
+            pfds[i].fd = c->fd;
+            pfds[i].events = 0;
+            if (c->echoed >= msgs_needed * payload) {
+                pfds[i].fd = -1;
+                continue;
+            }
+            pfds[i].events = POLLIN;
+            // 最多领先回显两条消息，不然大家都在等对方读，内存也会越堆越多
+            if (c->greeted && c->msgs_sent < msgs_needed && c->msgs_sent * payload < c->echoed + 2 * payload) {
+                pfds[i].events |= POLLOUT;
+            }
+        }
+        if (poll(pfds, NCONN, 5000) <= 0) {
+            fprintf(stderr, "poll timed out / failed\n");
+            exit(EXIT_FAILURE);
+        }
+
+        for (int i = 0; i < NCONN; i++) {
+            conn_t* c = &conns[i];
+            if (pfds[i].fd < 0) continue;
+            if (pfds[i].revents & POLLOUT) {
+                ssize_t n = send(c->fd, msg + c->send_off, msg_len - c->send_off, MSG_DONTWAIT | MSG_NOSIGNAL);
+                if (n < 0 && errno != EAGAIN) die("send");
+                if (n > 0) {
+                    c->send_off += (size_t)n;
+                    if (c->send_off == msg_len) {
+                        c->send_off = 0;
+                        c->msgs_sent++;
+                    }
+                }
+            }
+            if (pfds[i].revents & (POLLIN | POLLERR | POLLHUP)) {
+                ssize_t n = recv(c->fd, buf, sizeof(buf), MSG_DONTWAIT);
+                if (n == 0) {
+                    fprintf(stderr, "server closed the connection\n");
+                    exit(EXIT_FAILURE);
+                }
+                if (n < 0) {
+                    if (errno == EAGAIN) continue;
+                    die("recv");
+                }
+                size_t off = 0;
+                if (!c->greeted) {
+                    if (buf[0] != '*') {
+                        fprintf(stderr, "bad greeting\n");
+                        exit(EXIT_FAILURE);
+                    }
+                    c->greeted = 1;
+                    off = 1;
+                }
+                // 回显是 payload 的每个字节 +1，一条接一条，按在消息里的位置逐段比较
+                while (off < (size_t)n) {
+                    size_t pos = c->echoed % payload;
+                    size_t chunk = (size_t)n - off < payload - pos ? (size_t)n - off : payload - pos;
+                    if (memcmp(buf + off, expect + pos, chunk) != 0) {
+                        fprintf(stderr, "echo mismatch on connection %d at byte %zu\n", i, c->echoed);
+                        exit(EXIT_FAILURE);
+                    }
+                    off += chunk;
+                    c->echoed += chunk;
+                }
+                if (c->echoed >= msgs_needed * payload) done++;
+            }
+        }
+    }
+    return now_sec() - start;
+}
+
+int main(int argc, char** argv) {
+    const char* prog = argc > 1 ? argv[1] : "./epoll_server/server";
+    size_t total_mb = argc > 2 ? (size_t)atol(argv[2]) : 1024;
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("%-8s  %-8s  %9s  %8s  %8s  %8s  %10s\n", "payload", "mode", "echoed MB", "wall s", "user s", "sys s",
+           "CPU s/GB");
+    int port = BENCH_PORT;
+    for (size_t p = 0; p < sizeof(payload_sizes) / sizeof(payload_sizes[0]); p++) {
+        size_t payload = payload_sizes[p];
+        char* msg = malloc(payload + 2);
+        char* expect = malloc(payload);
+        if (!msg || !expect) die("malloc");
+        msg[0] = '^';
+        for (size_t k = 0; k < payload; k++) {
+            msg[k + 1] = 'a' + k % 25;  // 'a'..'y'，+1 之后还是字母，也碰不到 '^' / '$'
+            expect[k] = msg[k + 1] + 1;
+        }
+        msg[payload + 1] = '$';
+
+        double cpu_per_gb[2];
+        for (int m = 0; m < 2; m++) {
+            // 每轮换个端口：上一个服务器的监听 Socket 可能还没完全释放
+            pid_t pid = start_server(prog, &modes[m], port);
+            conn_t conns[NCONN];
+            memset(conns, 0, sizeof(conns));
+            for (int i = 0; i < NCONN; i++) {
+                conns[i].fd = connect_retry(port);
+            }
+            size_t per_conn = total_mb * 1024 * 1024 / NCONN;
+            double wall = run_clients(conns, msg, payload, expect, per_conn);
+            size_t echoed = 0;
+            for (int i = 0; i < NCONN; i++) {
+                echoed += conns[i].echoed;
+                close(conns[i].fd);
+            }
+
+            kill(pid, SIGKILL);
+            struct rusage ru;
+            int status;
+            if (wait4(pid, &status, 0, &ru) < 0) die("wait4");
+            double user = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6;
+            double sys = ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+            double gb = echoed / (1024.0 * 1024 * 1024);
+            cpu_per_gb[m] = (user + sys) / gb;
+            printf("%-8s  %-8s  %9.0f  %8.2f  %8.2f  %8.2f  %10.3f\n",
+                   payload >= 1024 * 1024 ? "1MB" : "64KB", modes[m].name, echoed / (1024.0 * 1024), wall, user,
+                   sys, cpu_per_gb[m]);
+            port++;
+        }
+        printf("%-8s  zerocopy saves %.1f%% CPU per GB\n", "", 100.0 * (cpu_per_gb[0] - cpu_per_gb[1]) / cpu_per_gb[0]);
+        free(msg);
+        free(expect);
+    }
+    return 0;
+}